@@ -31,31 +31,150 @@
 #ifndef CACHESERV_DEFINES_H
 #define CACHESERV_DEFINES_H
 
-#define CS_PAGE_SIZE 0x1000
-#define CS_CACHE_SIZE (CS_PAGE_SIZE * 64)
+#include "core/typedefs.h"
+
+typedef uint32_t data_descriptor;
+typedef uint32_t frame_id;
+typedef uint64_t page_id;
+
+// Defaults used when neither init() nor the project settings specify a cache geometry.
+#define CS_PAGE_SIZE_DEFAULT 0x1000
+#define CS_CACHE_SIZE_DEFAULT (CS_PAGE_SIZE_DEFAULT * 64)
+
+// Bounds for the runtime page size and frame count.
+#define CS_PAGE_SIZE_MIN 0x1000
+#define CS_PAGE_SIZE_MAX 0x200000
+#define CS_NUM_FRAMES_MIN 64
+
+// The page size and number of frames are only known once FileCacheManager::init() has run.
+// The page size is always a power of two, so the page arithmetic below reduces to a mask.
+struct CacheGeometry {
+	size_t page_size;
+	size_t page_mask;
+	uint32_t page_shift;
+	size_t num_frames;
+	size_t cache_size;
+};
+
+extern CacheGeometry cs_geometry;
+
+#define CS_PAGE_SIZE (cs_geometry.page_size)
+#define CS_CACHE_SIZE (cs_geometry.cache_size)
+#define CS_NUM_FRAMES (cs_geometry.num_frames)
 #define CS_MEM_VAL_BAD ~0
-#define CS_NUM_FRAMES ((CS_CACHE_SIZE) / (CS_PAGE_SIZE))
 #define CS_FIFO_THRESH_DEFAULT 8
 #define CS_LRU_THRESH_DEFAULT 8
 #define CS_KEEP_THRESH_DEFAULT 8
+#define CS_CLOCK_THRESH_DEFAULT 8
+#define CS_ARC_THRESH_DEFAULT 8
+#define CS_TWOQ_THRESH_DEFAULT 8
+// The share of 2Q's resident pages the A1in queue may hold, as a divisor.
+#define CS_TWOQ_KIN_DIVISOR 4
+
+// Frames kept aside in each shard for pages the admission filter refused to cache.
+#define CS_TRANSIENT_FRAMES 8
+
+// How many dirty pages an eviction passes over, queueing their write-back, before it waits outside the shard for one of them.
+#define CS_EVICT_DIRTY_SKIPS 4
+
+// The frame pool is split into this many shards, each with its own lock, see FileCacheManager::Shard.
+// The count is rounded down to a power of two, and lowered until every shard has at least CS_SHARD_MIN_FRAMES frames.
+#define CS_SHARDS_DEFAULT 16
+#define CS_SHARDS_MAX 256
+#define CS_SHARD_MIN_FRAMES 64
+
+// The most pages one page view pins. Views of longer ranges are copied instead, see FileCacheManager::pin.
+#define CS_VIEW_MAX_PAGES 16
+// At most 1 / CS_PIN_MAX_SHARE of a shard's frames are pinned at once, so its replacement policy always has pages to pick from.
+#define CS_PIN_MAX_SHARE 4
+
+// IO worker threads started for each device that holds open files.
+#define CS_WORKERS_PER_DEVICE_DEFAULT 2
+#define CS_WORKERS_PER_DEVICE_MAX 32
+
+// How much effort goes into getting written data onto the device.
+enum CacheDurability {
+	// Write back is left to the OS.
+	CS_DURABILITY_NONE,
+	// fdatasync once per flush, and fsync on close.
+	CS_DURABILITY_FLUSH,
+	// fsync on close only.
+	CS_DURABILITY_CLOSE,
+	// Every write is synchronous (O_DSYNC).
+	CS_DURABILITY_DSYNC,
+};
+
+// Buffers, file positions and lengths must be multiples of this for direct IO. 4 KiB covers the logical block size of almost every device.
+#define CS_DIRECT_IO_ALIGNMENT 0x1000
+
+// The most page ops a worker keeps in flight through io_uring at once.
+#define CS_IO_URING_QUEUE_DEPTH 32
+
+// How many times a thread checks a frame's state before it parks, see FrameWait.
+#define CS_FRAME_WAIT_SPIN 64
+// How long a parked thread sleeps before checking the frame again where there's no futex.
+#define CS_FRAME_WAIT_SLEEP_USEC 50
+
+// How many ops each priority class of a worker's queue holds. Pushing to a full class waits for the worker to catch up.
+#define CS_QUEUE_CAPACITY 1024
+
+// How long an op of each priority class may wait before it is served ahead of the higher classes, in usec.
+// In CtrlOp::Priority order: demand, readahead, write-back, flush.
+#define CS_QUEUE_AGING_USEC \
+	{ 0, 20000, 100000, 500000 }
+
+// The most consecutive pages a worker reads or writes with a single preadv/pwritev.
+#define CS_IO_MAX_RUN 64
+
+// Loads on a file are spread over its device's workers in aligned blocks of this many pages, see FileCacheManager::get_load_queue.
+// A worker can only coalesce pages that are in its own queue, so a block is exactly one run: smaller blocks would cut every run short,
+// and larger ones would leave fewer workers to share a file's loads.
+#define CS_IO_LOAD_BLOCK CS_IO_MAX_RUN
+
+// Readahead window sizes, in pages. The window starts at INIT, doubles on every window a sequential
+// reader gets through, and halves on every random access, but never drops below MIN.
+#define CS_READAHEAD_MIN_PAGES 2
+#define CS_READAHEAD_INIT_PAGES 8
+// The default cap on the readahead window, in bytes.
+#define CS_READAHEAD_MAX_DEFAULT 0x80000
+
+// The stride prefetcher follows up to this many interleaved streams per file.
+#define CS_PREFETCH_STREAMS 4
+// How many recent offsets per file the stride prefetcher looks through for new streams.
+#define CS_PREFETCH_HISTORY 8
+// How many strides ahead of a confident stream pages are prefetched.
+#define CS_PREFETCH_DEPTH 4
+// Longer strides aren't looked for.
+#define CS_PREFETCH_MAX_STRIDE 0x1000000
+
+// The default size limit for one write-back write, in bytes. Runs of dirty pages are cut at this size.
+#define CS_MAX_WRITE_SIZE_DEFAULT 0x40000
 #define CS_LEN_UNSPECIFIED 0xFADEFADEFADEFADE
 
 #define STRINGIFY2(X) #X
 #define STRINGIFY(X) STRINGIFY2(X)
 
 // The number of bytes after the previous page offset for the offset a.
-#define CS_PARTIAL_SIZE(a) ((a) % CS_PAGE_SIZE)
+#define CS_PARTIAL_SIZE(a) ((a)&cs_geometry.page_mask)
+
+// A GUID holds the descriptor's namespace in its 24 most significant bits and a file offset in the rest.
+#define CS_GUID_PREFIX_SHIFT 40
+#define CS_GUID_OFFSET_MASK ((((uint64_t)1) << CS_GUID_PREFIX_SHIFT) - 1)
 
 // Extract offset from GUID by masking the range.
-#define CS_GET_FILE_OFFSET_FROM_GUID(guid) ((guid)&0x000000FFFFFFFFFF)
+#define CS_GET_FILE_OFFSET_FROM_GUID(guid) ((guid)&CS_GUID_OFFSET_MASK)
 #define CS_GET_GUID_FROM_FILE_OFFSET(offset, guid_prefix) ((guid_prefix) | offset)
 
+// Extract the data descriptor a GUID belongs to.
+#define CS_GET_DESCRIPTOR_FROM_GUID(guid) ((guid) >> CS_GUID_PREFIX_SHIFT)
+#define CS_GET_GUID_PREFIX(dd) ((page_id)(dd) << CS_GUID_PREFIX_SHIFT)
+
 // Round off to the previous page offset.
-#define CS_GET_PAGE(a) ((a)-CS_PARTIAL_SIZE(a))
+#define CS_GET_PAGE(a) ((a) & ~cs_geometry.page_mask)
 
 #define CS_GET_CACHE_POLICY_FN(fns, policy) (this->*(fns[policy]))
 
-#define CS_GET_LENGTH_IN_PAGES(length) (((length) / CS_PAGE_SIZE) + CS_PARTIAL_SIZE(length))
+#define CS_GET_LENGTH_IN_PAGES(length) (((length) + cs_geometry.page_mask) >> cs_geometry.page_shift)
 
 #define ERR_COND_MSG_ACTION(m_cond, m_message, m_action)                                                                                                     \
 	{                                                                                                                                                        \
@@ -3,3 +3,10 @@ def can_build(env, platform):
 
 def configure(env):
     pass
+
+def get_opts(platform):
+    from SCons.Variables import BoolVariable
+
+    return [
+        BoolVariable("cacheserv_tests", "Build the cacheserv tests and benchmarks, see tests/run_tests.gd", False),
+    ]
@@ -31,13 +31,15 @@
 #ifndef CTRL_QUEUE_H
 #define CTRL_QUEUE_H
 
-#include "core/list.h"
-#include "core/os/mutex.h"
+#include "core/os/memory.h"
+#include "core/os/os.h"
 #include "core/os/semaphore.h"
 #include "core/rid.h"
 
 #include "data_helpers.h"
 
+#include <atomic>
+
 class CachedResourceHandle : public RID_Data {};
 
 struct CtrlOp {
@@ -49,22 +51,44 @@ struct CtrlOp {
 		FLUSH_CLOSE,
 	};
 
+	// Workers serve the highest class first. Within a class, ops are served in the order they were pushed.
+	enum Priority {
+		// Loads someone is about to wait on, stores of pages that are being evicted, and closes.
+		PRIORITY_DEMAND,
+		// Readahead and prefetch loads.
+		PRIORITY_READAHEAD,
+		// Background stores, for pages a flush has to write again, see FileCacheManager::finish_store.
+		PRIORITY_WRITE_BACK,
+		// Flushes nobody waits on.
+		PRIORITY_FLUSH,
+		PRIORITY_MAX,
+	};
+
 	DescriptorInfo *di;
+	// The frame a STORE writes back. Workers check it still holds the page, since the page may have been dropped from the file's index.
 	frame_id frame;
 	size_t offset;
 	uint8_t type;
+	uint8_t priority;
+	// In OS ticks (usec). Once it has passed, the op is served ahead of every class, so no class can starve the others.
+	uint64_t deadline;
 
 	CtrlOp() :
 			di(NULL),
 			frame(CS_MEM_VAL_BAD),
 			offset(CS_MEM_VAL_BAD),
-			type(QUIT) {}
+			type(QUIT),
+			priority(PRIORITY_DEMAND),
+			deadline(0) {}
 
-	CtrlOp(DescriptorInfo *i_di, frame_id frame, size_t i_offset, uint8_t i_type) :
+	// A deadline of 0 means the default for the priority class, see CS_QUEUE_AGING_USEC.
+	CtrlOp(DescriptorInfo *i_di, frame_id frame, size_t i_offset, uint8_t i_type, uint8_t i_priority = PRIORITY_DEMAND, uint64_t i_deadline = 0) :
 			di(i_di),
 			frame(frame),
 			offset(i_offset),
-			type(i_type) {}
+			type(i_type),
+			priority(i_priority),
+			deadline(i_deadline) {}
 
 	String as_string() const {
 		return String("type: ") + (type == LOAD ? "LOAD" : type == STORE ? "STORE" : type == QUIT ? "QUIT" : type == FLUSH ? "FLUSH" : "FLUSH_CLOSE") +
@@ -74,69 +98,323 @@ struct CtrlOp {
 	}
 };
 
+// A bounded lock free ring of CtrlOps, for any number of producers and consumers.
+//
+// Every cell has a sequence number that says whose turn it is. At position pos, the cell is free for
+// the producer when seq == pos, and holds that producer's op for the consumer when seq == pos + 1.
+// The consumer hands the cell back to the producer one lap later by setting seq to pos + capacity.
+//
+// Queued ops can be cancelled in place. Each cell also has a state word, (pos << 2) | QUEUED/TAKEN/CANCELLED,
+// that a consumer and a canceller race on with a CAS. Whoever wins owns the op. Since the state includes
+// the position, a CAS that comes in after the cell was reused always fails.
+class CtrlRing {
+	enum {
+		QUEUED,
+		TAKEN,
+		CANCELLED,
+	};
+
+	struct Cell {
+		std::atomic<uint64_t> seq;
+		std::atomic<uint64_t> state;
+		CtrlOp op;
+	};
+
+	Cell *cells;
+	uint64_t mask;
+	// Padded apart, since producers and consumers hammer on them from different threads.
+	// alignas would be neater, but memnew doesn't honour extended alignment.
+	uint8_t pad0[64];
+	std::atomic<uint64_t> enqueue_pos;
+	uint8_t pad1[64];
+	std::atomic<uint64_t> dequeue_pos;
+	uint8_t pad2[64];
+
+public:
+	void init(uint32_t capacity) {
+		capacity = next_power_of_2(capacity);
+		cells = memnew_arr(Cell, capacity);
+		mask = capacity - 1;
+		for (uint32_t i = 0; i < capacity; ++i) {
+			cells[i].seq.store(i, std::memory_order_relaxed);
+			cells[i].state.store(CANCELLED, std::memory_order_relaxed);
+		}
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	// Returns false if the ring is full.
+	bool push(const CtrlOp &op) {
+		uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		Cell *c;
+		while (true) {
+			c = &cells[pos & mask];
+			int64_t dif = (int64_t)c->seq.load(std::memory_order_acquire) - (int64_t)pos;
+			if (dif == 0) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		c->op = op;
+		c->state.store(pos << 2 | QUEUED, std::memory_order_relaxed);
+		c->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Pops the oldest op that hasn't been cancelled. Returns false if there isn't one.
+	bool pop(CtrlOp &r_op) {
+		while (true) {
+			uint64_t pos = dequeue_pos.load(std::memory_order_relaxed);
+			Cell *c;
+			while (true) {
+				c = &cells[pos & mask];
+				int64_t dif = (int64_t)c->seq.load(std::memory_order_acquire) - (int64_t)(pos + 1);
+				if (dif == 0) {
+					if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+				} else if (dif < 0) {
+					return false;
+				} else {
+					pos = dequeue_pos.load(std::memory_order_relaxed);
+				}
+			}
+
+			uint64_t expected = pos << 2 | QUEUED;
+			bool mine = c->state.compare_exchange_strong(expected, pos << 2 | TAKEN, std::memory_order_acq_rel);
+			if (mine) r_op = c->op;
+			c->seq.store(pos + mask + 1, std::memory_order_release);
+
+			// A cancelled op is just dropped.
+			if (mine) return true;
+		}
+	}
+
+	// The range of positions that may hold queued ops, for walking the ring with peek and cancel.
+	_FORCE_INLINE_ uint64_t head() const { return dequeue_pos.load(std::memory_order_acquire); }
+	_FORCE_INLINE_ uint64_t tail() const { return enqueue_pos.load(std::memory_order_acquire); }
+
+	// Copies the op at the given position. Returns false if there's no queued op there any more.
+	bool peek(uint64_t pos, CtrlOp &r_op) const {
+		const Cell &c = cells[pos & mask];
+		if (c.seq.load(std::memory_order_acquire) != pos + 1) return false;
+		if (c.state.load(std::memory_order_acquire) != (pos << 2 | QUEUED)) return false;
+		r_op = c.op;
+		// If the cell was popped and reused while we copied it, the state has moved on.
+		return c.state.load(std::memory_order_acquire) == (pos << 2 | QUEUED);
+	}
+
+	// Cancels the op at the given position. Returns false if a consumer got to it first.
+	bool cancel(uint64_t pos) {
+		uint64_t expected = pos << 2 | QUEUED;
+		return cells[pos & mask].state.compare_exchange_strong(expected, pos << 2 | CANCELLED, std::memory_order_acq_rel);
+	}
+
+	// The deadline of the oldest queued op, without popping it. Returns false if the ring is empty.
+	bool front_deadline(uint64_t &r_deadline) const {
+		uint64_t pos = dequeue_pos.load(std::memory_order_acquire);
+		const Cell &c = cells[pos & mask];
+		if (c.seq.load(std::memory_order_acquire) != pos + 1) return false;
+		r_deadline = c.op.deadline;
+		return true;
+	}
+
+	CtrlRing() :
+			cells(NULL),
+			mask(0) {
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	~CtrlRing() {
+		if (cells) memdelete_arr(cells);
+	}
+};
+
 class CtrlQueue {
 
 	friend class FileCacheManager;
 
 private:
-	List<CtrlOp> queue;
-	Mutex *mut;
+	// One ring per priority class.
+	CtrlRing queue[CtrlOp::PRIORITY_MAX];
 	Semaphore *sem;
+	// Workers parked on sem. Producers only post it if there is one, and only once until it wakes up.
+	std::atomic<uint32_t> sleepers;
+	std::atomic<bool> wake_pending;
+	// Producers parked on room_sem, waiting for a full class to drain. Workers post it after taking ops while there are any.
+	Semaphore *room_sem;
+	std::atomic<uint32_t> blocked;
+
+	// Picks the next op. Returns false if all classes are empty.
+	bool take(CtrlOp &r_op) {
+		bool taken = take_next(r_op);
+
+		// Even if nothing was taken, cancelled ops may have been dropped to make room.
+		// Pairs with the fence in push_wait, so either we see the producer or it sees the room.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (blocked.load(std::memory_order_relaxed)) room_sem->post();
+
+		return taken;
+	}
+
+	// Does the picking for take.
+	bool take_next(CtrlOp &r_op) {
+		// A lower class whose oldest op is past its deadline goes first. Each class is in push order,
+		// so its front holds the earliest default deadline.
+		uint64_t earliest = OS::get_singleton()->get_ticks_usec();
+		int aged = -1;
+		for (int i = CtrlOp::PRIORITY_DEMAND + 1; i < CtrlOp::PRIORITY_MAX; ++i) {
+			uint64_t deadline;
+			if (queue[i].front_deadline(deadline) && deadline <= earliest) {
+				aged = i;
+				earliest = deadline;
+			}
+		}
+
+		if (aged >= 0 && queue[aged].pop(r_op)) return true;
+
+		for (int i = 0; i < CtrlOp::PRIORITY_MAX; ++i) {
+			if (queue[i].pop(r_op)) return true;
+		}
+		return false;
+	}
+
+	void wake() {
+		// Pairs with the fence in pop, so either we see the sleeper or it sees our op.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_relaxed) && !wake_pending.exchange(true)) sem->post();
+	}
 
 	CtrlOp pop() {
-		// We keep this loop to catch the case where the semaphore is triggered even when the queue is empty.
+		CtrlOp op;
 		while (true) {
+			if (sig_quit) return CtrlOp();
+			if (take(op)) return op;
 
-			while (queue.empty()) {
-				sem->wait();
+			sleepers.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			// Something may have been pushed before the producer could see us parked.
+			if (take(op)) {
+				sleepers.fetch_sub(1);
+				return op;
 			}
 
-			if (sig_quit) return CtrlOp();
+			sem->wait();
+			wake_pending.store(false);
+			sleepers.fetch_sub(1);
+		}
+	}
 
-			{ // We only need to lock when accessing the queue.
-				MutexLock ml(mut);
-				// If the queue isn't empty, we can pop. otherwise, loop back around and wait for the queue to be filled.
-				if (!queue.empty()) {
-					CtrlOp op = queue.front()->get();
-					queue.pop_front();
-					return op;
-				}
+	// Pops without waiting. Returns false if the queue is empty.
+	bool try_pop(CtrlOp &r_op) {
+		return take(r_op);
+	}
+
+	// Pushes to the op's class, parking until a worker makes room if it is full.
+	void push_wait(const CtrlOp &op) {
+		CtrlRing &ring = queue[op.priority];
+		while (!ring.push(op)) {
+			// The class is full, so the worker has plenty to do, but it may not have been woken for it yet.
+			wake();
+
+			blocked.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			// The worker may have made room before it could see us parked.
+			if (ring.push(op)) {
+				blocked.fetch_sub(1);
+				break;
 			}
+
+			// A post may be meant for another producer, or come after the room was taken again. Either way we just try again.
+			room_sem->wait();
+			blocked.fetch_sub(1);
 		}
 	}
 
 public:
-	bool sig_quit;
+	std::atomic<bool> sig_quit;
 
 	CtrlQueue() {
-		mut = Mutex::create();
+		for (int i = 0; i < CtrlOp::PRIORITY_MAX; ++i) {
+			queue[i].init(CS_QUEUE_CAPACITY);
+		}
 		sem = Semaphore::create();
+		sleepers.store(0);
+		wake_pending.store(false);
+		room_sem = Semaphore::create();
+		blocked.store(0);
 		sig_quit = false;
 	}
 
 	~CtrlQueue() {
-		memdelete(mut);
 		memdelete(sem);
+		memdelete(room_sem);
+	}
+
+	// The deadline an op of the given class gets if it's pushed now without one.
+	static _FORCE_INLINE_ uint64_t default_deadline(uint8_t priority) {
+		static const uint64_t aging[CtrlOp::PRIORITY_MAX] = CS_QUEUE_AGING_USEC;
+		return OS::get_singleton()->get_ticks_usec() + aging[priority];
+	}
+
+	// Pushes ops in order, with a single wakeup at the end. The ops must all have deadlines.
+	// Pushing a run of consecutive pages this way lets the worker find the whole run when it wakes up, and merge it into one read.
+	void push_batch(const CtrlOp *ops, uint32_t count) {
+		for (uint32_t i = 0; i < count; ++i) {
+			push_wait(ops[i]);
+		}
+
+		wake();
 	}
 
-	// Pushes to the back ofthe queue.
+	// Pushes to the back of the op's priority class.
 	void push(CtrlOp op) {
-		MutexLock ml = MutexLock(mut);
-		queue.push_back(op);
-		// for (List<CtrlOp>::Element *i = queue.front(); i; i = i->next())
-		// 	WARN_PRINTS("Curr op: " + String(i->get().type == CtrlOp::LOAD ? "load" : "other") + " op with page: " + itoh(i->get().offset) + " and frame: " + itoh(i->get().frame))
-		sem->post();
+		if (op.deadline == 0) op.deadline = default_deadline(op.priority);
 
+		push_wait(op);
+		wake();
 		// WARN_PRINTS("Pushed " + String(op.type == CtrlOp::LOAD ? "load" : "other") + " op with page: " + itoh(op.offset) + " and frame: " + itoh(op.frame))
 	}
 
-	// Pushes to the queue's front, so the pushed operation is processed ASAP.
+	// Like push, but returns false instead of waiting if the op's class is full. For workers putting an op back on their own queue.
+	bool try_push(CtrlOp op) {
+		if (op.deadline == 0) op.deadline = default_deadline(op.priority);
+		if (!queue[op.priority].push(op)) return false;
+
+		wake();
+		return true;
+	}
+
+	// Pushes to the demand class, so the op is served ahead of everything but other demand ops.
 	void priority_push(CtrlOp op) {
-		MutexLock ml = MutexLock(mut);
-		queue.push_front(op);
-		sem->post();
+		op.priority = CtrlOp::PRIORITY_DEMAND;
+		push(op);
 		// WARN_PRINTS("Priority pushed op.")
 	}
+
+	// Moves a queued load of the given page into a higher priority class, for when someone starts waiting on a page that was only read ahead.
+	// Returns false if the load wasn't found, because a worker has already picked it up.
+	bool promote(DescriptorInfo *di, size_t offset, uint8_t priority) {
+		for (int i = priority + 1; i < CtrlOp::PRIORITY_MAX; ++i) {
+			CtrlRing &ring = queue[i];
+			for (uint64_t pos = ring.head(); pos != ring.tail(); ++pos) {
+				CtrlOp op;
+				if (!ring.peek(pos, op) || op.di != di || op.offset != offset || op.type != CtrlOp::LOAD) continue;
+
+				// If a worker beat us to it, the load is already under way.
+				if (!ring.cancel(pos)) return false;
+
+				op.priority = priority;
+				op.deadline = 0;
+				push(op);
+				return true;
+			}
+		}
+		return false;
+	}
 };
 
 #endif //CTRL_QUEUE_H
@@ -33,7 +33,18 @@
 #include "file_cache_manager.h"
 
 DescriptorInfo::DescriptorInfo(FileAccess *fa, page_id new_range, int cache_policy) :
-		offset(0), guid_prefix(new_range), cache_policy(cache_policy), valid(true) {
+		pages(new_range),
+		queue(NULL),
+		pending_loads(0),
+		load_waiters(0),
+		fd(-1),
+		direct_io(false),
+		durability(CS_DURABILITY_FLUSH),
+		io_error(OK),
+		mode(FileAccess::READ),
+		offset(0),
+		handle_count(0),
+		guid_prefix(new_range), cache_policy(cache_policy), valid(true), dirty(false), drop_on_close(false) {
 	ERR_FAIL_COND(!fa);
 	internal_data_source = fa;
 	switch (cache_policy) {
@@ -46,20 +57,44 @@ DescriptorInfo::DescriptorInfo(FileAccess *fa, page_id new_range, int cache_poli
 		case _FileCacheManager::FIFO:
 			max_pages = CS_FIFO_THRESH_DEFAULT;
 			break;
+		case _FileCacheManager::CLOCK:
+			max_pages = CS_CLOCK_THRESH_DEFAULT;
+			break;
+		case _FileCacheManager::ARC:
+			max_pages = CS_ARC_THRESH_DEFAULT;
+			break;
+		case _FileCacheManager::TWOQ:
+			max_pages = CS_TWOQ_THRESH_DEFAULT;
+			break;
 	}
 	total_size = internal_data_source->get_len();
 	path = internal_data_source->get_path();
 	ready_sem = Semaphore::create();
-	dirty_sem = Semaphore::create();
-	lock = RWLock::create();
+	loads_sem = Semaphore::create();
+	io_lock = Mutex::create();
+}
+
+void DescriptorInfo::wait_for_loads() {
+	// Both counters are sequentially consistent, so either the last load sees us waiting and posts, or we see
+	// pending_loads at 0. A post that comes in after we're done just makes the next wait check again.
+	load_waiters.fetch_add(1);
+	while (pending_loads.load()) {
+		loads_sem->wait();
+	}
+	load_waiters.fetch_sub(1);
 }
 
 Variant DescriptorInfo::to_variant(const FileCacheManager &p) {
 
 	Dictionary d;
 
-	for(int i = 0; i < pages.size(); ++i) {
-		d[itoh(pages[i]) + " # " + itoh(p.page_frame_map[pages[i]])] = (p.frames[p.page_frame_map[pages[i]]]->to_variant());
+	for (page_id i = pages.first(); i != (page_id)CS_MEM_VAL_BAD; i = pages.next(i)) {
+		d[itoh(i) + " # " + itoh(pages.get(i))] = (p.frames[pages.get(i)]->to_variant());
+	}
+
+	Array h;
+	for (int i = 0; i < handles.size(); ++i) {
+		h.push_back(handles[i]->to_variant());
 	}
 
 	Dictionary out;
@@ -67,9 +102,22 @@ Variant DescriptorInfo::to_variant(const FileCacheManager &p) {
 	out["total_size"] = Variant(itoh(total_size));
 	out["guid_prefix"] = Variant(itoh(guid_prefix));
 	out["pages"] = Variant(d);
+	out["handles"] = Variant(h);
 	out["cache_policy"] = Variant(cache_policy);
 
 
 	return Variant(out);
 
 }
+
+Variant FileHandle::to_variant() const {
+
+	Dictionary out;
+	out["offset"] = Variant(itoh(offset));
+	out["eof"] = Variant(error == ERR_FILE_EOF);
+	out["readahead_window"] = Variant(ra_window);
+	out["prefetch_predictions"] = Variant(prefetcher.get_predictions());
+	out["prefetch_hits"] = Variant(prefetcher.get_hits());
+
+	return Variant(out);
+}
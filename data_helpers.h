@@ -34,7 +34,8 @@
 #include "core/map.h"
 #include "core/object.h"
 #include "core/os/file_access.h"
-#include "core/os/rw_lock.h"
+#include "core/os/mutex.h"
+#include "core/os/os.h"
 #include "core/os/semaphore.h"
 #include "core/os/thread.h"
 #include "core/reference.h"
@@ -44,6 +45,9 @@
 #include "core/vector.h"
 
 #include "cacheserv_defines.h"
+#include "frame_wait.h"
+#include "residency_index.h"
+#include "stream_prefetcher.h"
 
 // Int to hex string.
 _FORCE_INLINE_ String itoh(size_t num) {
@@ -52,75 +56,188 @@ _FORCE_INLINE_ String itoh(size_t num) {
 	return String(x);
 }
 
-typedef uint32_t data_descriptor;
-typedef uint32_t frame_id;
-typedef uint64_t page_id;
-
 struct CacheInfoTable;
 struct Frame;
 struct DescriptorInfo;
+struct FileHandle;
 
 class FileCacheManager;
+class CtrlQueue;
 
 struct DescriptorInfo {
 	String path;
-	Vector<page_id> pages;
+	ResidencyIndex pages;
 	FileAccess *internal_data_source;
+	// Posted when the file has been closed, see FileCacheManager::close. Waits on single pages go through the frames.
 	Semaphore *ready_sem;
-	Semaphore *dirty_sem;
-	RWLock *lock;
+	// The queue of the IO worker this file was assigned to. Stores and flushes always go through it, so they run in order.
+	CtrlQueue *queue;
+	// The queues of every worker on the file's device. With positional IO, loads are spread over these by page.
+	Vector<CtrlQueue *> load_queues;
+	// Loads that have been queued but haven't finished yet. The file can't be closed until this drops to 0, see wait_for_loads.
+	std::atomic<uint32_t> pending_loads;
+	// Set while a close waits on loads_sem for pending_loads to drop to 0.
+	std::atomic<uint32_t> load_waiters;
+	Semaphore *loads_sem;
+	// Serialises seek + read/write pairs on internal_data_source, when positional IO has to be emulated.
+	Mutex *io_lock;
+	// A raw descriptor for the same file, used for all page IO when there is one. -1 where that wouldn't be safe, see FileCacheManager::open_raw_source.
+	int fd;
+	// The file was opened with O_DIRECT. fd then belongs to internal_data_source, and page writes must cover whole blocks.
+	bool direct_io;
+	// One of CacheDurability.
+	uint8_t durability;
+	// The last error the IO workers ran into on the file, OK if there hasn't been one.
+	// Every handle to the file reports it from get_error, the way a FileAccess reports its own IO errors.
+	Error io_error;
+	// The FileAccess mode the backing file is open in. Further handles can only share it if they don't need more, see FileCacheManager::open.
+	int mode;
+	// Where the last handle was when the file was closed. The first handle to reopen it starts there.
 	size_t offset;
 	size_t total_size;
+	// The handles that have the file open. Only changed under the manager's mutex.
+	Vector<FileHandle *> handles;
+	// The number of handles, for readers that don't hold the manager's mutex.
+	std::atomic<uint32_t> handle_count;
 	page_id guid_prefix;
 	int cache_policy;
 	int max_pages;
 	bool valid;
 	bool dirty;
+	// Set by FileCacheManager::permanent_close. The file is dropped from the cache once its last handle is closed.
+	bool drop_on_close;
 
 	// Create a new DescriptorInfo with a new random namespace defined by 24 most significant bits.
 	DescriptorInfo(FileAccess *fa, page_id new_guid_prefix, int cache_policy);
 	~DescriptorInfo() {
-		while (dirty) dirty_sem->wait();
+		while (dirty) ready_sem->wait();
 		memdelete(ready_sem);
-		memdelete(dirty_sem);
-		memdelete(lock);
+		memdelete(loads_sem);
+		memdelete(io_lock);
+	}
+
+	// Called when a queued load has finished, or was dropped along with its page.
+	_FORCE_INLINE_ void finish_load() {
+		if (pending_loads.fetch_sub(1) == 1 && load_waiters.load()) loads_sem->post();
 	}
 
+	// Blocks until every queued load has finished.
+	void wait_for_loads();
+
 	Variant to_variant(const FileCacheManager &p);
 };
 
+// One open handle to a cached file, behind the RID returned by FileCacheManager::open.
+// Every handle has its own position, error state and readahead, while the pages and the
+// backing file are shared by all handles to the file through its DescriptorInfo.
+struct FileHandle : public RID_Data {
+	DescriptorInfo *desc_info;
+	// The handle's own RID, so it can still be freed when the manager closes a handle nobody closed.
+	RID rid;
+	size_t offset;
+	// ERR_FILE_EOF once a read has run past the end of the file, until the next seek.
+	Error error;
+	// Page views made through the handle that haven't been released yet. The handle can't be closed until they are.
+	std::atomic<uint32_t> views;
+	// Readahead state, see FileCacheManager::update_readahead.
+	// Where the next read starts if the file is being read sequentially.
+	size_t ra_next;
+	// Pages have been read ahead up to here.
+	size_t ra_end;
+	// The next window is read ahead once a sequential read reaches this page.
+	size_t ra_marker;
+	// The size of the next window, in pages.
+	uint32_t ra_window;
+	// Picks up strided and interleaved reads, which the readahead window sees as random.
+	StreamPrefetcher prefetcher;
+
+	FileHandle(DescriptorInfo *p_desc_info, size_t p_offset, uint32_t p_ra_window) :
+			desc_info(p_desc_info),
+			offset(p_offset),
+			error(OK),
+			views(0),
+			ra_next(p_offset),
+			ra_end(0),
+			ra_marker(0),
+			ra_window(p_ra_window) {}
+
+	Variant to_variant() const;
+};
+
 struct Frame {
 	friend class FileCacheManager;
+	friend class FrameList;
+
+	// The bits of Frame::state.
+	enum {
+		STATE_READY = 1,
+		STATE_DIRTY = 2,
+		STATE_USED = 4,
+		// Set on every hit for pages under the CLOCK policy, and cleared as the clock hand sweeps past.
+		STATE_REFERENCED = 8,
+		// Someone is parked waiting for the frame to become ready or clean, see FrameWait.
+		STATE_WAITERS = 16,
+		// The bits above the flags are a sequence number for the frame's memory, which is odd while a writer is
+		// changing it. Readers copy data out without any lock and retry if the number moved under them, see copy_out.
+		STATE_SEQ_ONE = 256,
+		STATE_SEQ_MASK = ~(uint32_t)(STATE_SEQ_ONE - 1),
+	};
 
 private:
 	uint8_t *const memory_region;
 	page_id owning_page;
+	// Links for the policy list this frame is in, see FrameList.
+	frame_id list_prev;
+	frame_id list_next;
+	uint8_t list_tag;
 	uint32_t ts_last_use;
-	uint16_t used_size;
-	volatile bool dirty;
-	volatile bool ready;
-	volatile bool used;
+	uint32_t used_size;
+	// The number of page views holding the frame, see FileCacheManager::pin. Only changed under the shard's lock.
+	uint32_t pins;
+	std::atomic<uint32_t> state;
+
+	_FORCE_INLINE_ bool has(uint32_t bit) const {
+		return state.load(std::memory_order_acquire) & bit;
+	}
+
+	// Sets and clears state bits in one go, and wakes anyone waiting on the frame.
+	_FORCE_INLINE_ void change(uint32_t set, uint32_t clear) {
+		uint32_t prev = state.load(std::memory_order_relaxed);
+		while (!state.compare_exchange_weak(prev, (prev | set) & ~(clear | STATE_WAITERS), std::memory_order_acq_rel))
+			;
+		if (prev & STATE_WAITERS) FrameWait::wake_all(&state);
+	}
+
+	// Flags that nobody waits for don't need to wake anyone.
+	_FORCE_INLINE_ void change_quiet(uint32_t set, uint32_t clear) {
+		if (set) state.fetch_or(set, std::memory_order_acq_rel);
+		if (clear) state.fetch_and(~clear, std::memory_order_acq_rel);
+	}
 
 public:
 	Frame() :
 			memory_region(NULL),
 			owning_page(0),
+			list_prev(CS_MEM_VAL_BAD),
+			list_next(CS_MEM_VAL_BAD),
+			list_tag(0),
 			ts_last_use(0),
 			used_size(0),
-			dirty(false),
-			ready(false),
-			used(false) {}
+			pins(0),
+			state(0) {}
 
 	explicit Frame(
 			uint8_t *i_memory_region) :
 
 			memory_region(i_memory_region),
 			owning_page(0),
+			list_prev(CS_MEM_VAL_BAD),
+			list_next(CS_MEM_VAL_BAD),
+			list_tag(0),
 			ts_last_use(0),
 			used_size(0),
-			dirty(false),
-			ready(false),
-			used(false) {}
+			pins(0),
+			state(0) {}
 
 	~Frame() {
 	}
@@ -131,62 +248,78 @@ public:
 
 	_FORCE_INLINE_ Frame &set_owning_page(page_id page) {
 		// A frame whose owning page is changing should not be dirty and should be in a non-ready state.
-		CRASH_COND(dirty || ready)
+		CRASH_COND(has(STATE_DIRTY | STATE_READY))
 		owning_page = page;
 		return *this;
 	}
 
 	_FORCE_INLINE_ bool get_dirty() {
-		return dirty;
+		return has(STATE_DIRTY);
 	}
 
 	_FORCE_INLINE_ Frame &set_dirty_true() {
 		// A page that isn't ready can't become dirty.
-		CRASH_COND(!ready)
-		dirty = true;
-		String a;
-		a.parse_utf8((const char *)(this->memory_region), 4095);
-		// WARN_PRINTS("Dirty page.\n\n" + a + "\n\n");
+		CRASH_COND(!has(STATE_READY))
+		change_quiet(STATE_DIRTY, 0);
 		return *this;
 	}
 
-	_FORCE_INLINE_ Frame &set_dirty_false(Semaphore *dirty_sem, frame_id frame) {
+	// Marks the page clean after a write back that started at the given version. Returns false, and leaves the page
+	// dirty, if it was written to in the meantime, since what went to the file may be missing that write. The caller has
+	// to write it again then, see FileCacheManager::finish_store.
+	_FORCE_INLINE_ bool set_dirty_false(uint32_t version) {
 		// A page which is dirty as well as not ready is in an invalid state.
-		CRASH_COND(!ready)
-		dirty = false;
-		// WARN_PRINTS("Dirty page " + itoh(frame) + " is clean.");
-		dirty_sem->post();
-		return *this;
+		CRASH_COND(!has(STATE_READY))
+		uint32_t prev = state.load(std::memory_order_relaxed);
+		do {
+			if ((prev & STATE_SEQ_MASK) != version) return false;
+		} while (!state.compare_exchange_weak(prev, prev & ~(STATE_DIRTY | STATE_WAITERS), std::memory_order_acq_rel));
+
+		if (prev & STATE_WAITERS) FrameWait::wake_all(&state);
+		// WARN_PRINTS("Dirty page " + itoh(owning_page) + " is clean.");
+		return true;
 	}
 
 	_FORCE_INLINE_ bool get_used() {
-		return used;
+		return has(STATE_USED);
 	}
 
 	_FORCE_INLINE_ Frame &set_used(bool in) {
 		// All io ops must be completed (page must not be dirty) for this transition to be valid.
-		CRASH_COND(dirty)
-		used = in;
+		CRASH_COND(has(STATE_DIRTY))
+		change_quiet(in ? STATE_USED : 0u, in ? 0u : STATE_USED);
 		return *this;
 	}
 
 	_FORCE_INLINE_ bool get_ready() {
-		return ready;
+		return has(STATE_READY);
 	}
 
-	_FORCE_INLINE_ Frame &set_ready_true(Semaphore *ready_sem) {
+	_FORCE_INLINE_ Frame &set_ready_true() {
 		// A page cannot be dirty before it is ready.
-		CRASH_COND(!ready && dirty)
-		ready = true;
-		ready_sem->post();
-		// WARN_PRINTS("Part ready for page " + itoh(page) + " and frame " + itoh(frame) + " .");
+		CRASH_COND((state.load(std::memory_order_acquire) & (STATE_READY | STATE_DIRTY)) == STATE_DIRTY)
+		change(STATE_READY, 0);
+		// WARN_PRINTS("Part ready for page " + itoh(owning_page) + " .");
 		return *this;
 	}
 
 	_FORCE_INLINE_ Frame &set_ready_false() {
 		// A page that is dirty must always be ready.
-		CRASH_COND(dirty)
-		ready = false;
+		CRASH_COND(has(STATE_DIRTY))
+		// The frame is about to hold another page, so a reader still copying out of it has to notice.
+		uint32_t prev = state.load(std::memory_order_relaxed);
+		while (!state.compare_exchange_weak(prev, (prev & ~STATE_READY) + 2 * STATE_SEQ_ONE, std::memory_order_acq_rel))
+			;
+		return *this;
+	}
+
+	_FORCE_INLINE_ bool get_referenced() {
+		return has(STATE_REFERENCED);
+	}
+
+	_FORCE_INLINE_ Frame &set_referenced(bool in) {
+		// Checked first, so CLOCK hits on a referenced page don't bounce the cache line around.
+		if (in != has(STATE_REFERENCED)) change_quiet(in ? STATE_REFERENCED : 0u, in ? 0u : STATE_REFERENCED);
 		return *this;
 	}
 
@@ -201,29 +334,75 @@ public:
 		return *this;
 	}
 
-	_FORCE_INLINE_ Frame &wait_clean(Semaphore *sem) {
-		while (dirty != false)
-			sem->wait();
+	_FORCE_INLINE_ Frame &wait_clean() {
+		FrameWait::wait_for(&state, STATE_DIRTY, 0, STATE_WAITERS);
 		// ERR_PRINTS("Page is clean.")
 		return *this;
 	}
 
-	_FORCE_INLINE_ Frame &wait_ready(Semaphore *sem) {
-		while (ready != true)
-			sem->wait();
-		// ERR_PRINTS("Page is clean.")
+	_FORCE_INLINE_ Frame &wait_ready() {
+		FrameWait::wait_for(&state, STATE_READY, STATE_READY, STATE_WAITERS);
+		// ERR_PRINTS("Page is ready.")
 		return *this;
 	}
 
-	_FORCE_INLINE_ uint16_t get_used_size() {
+	// Waits out any writer, and returns the version of the memory that can then be read.
+	_FORCE_INLINE_ uint32_t read_begin() {
+		uint32_t s;
+		for (int i = 0; (s = state.load(std::memory_order_acquire)) & STATE_SEQ_ONE; ++i) {
+			if (i >= CS_FRAME_WAIT_SPIN) OS::get_singleton()->delay_usec(0);
+		}
+		return s & STATE_SEQ_MASK;
+	}
+
+	// True if the memory may have changed since read_begin returned version, so whatever was read must be thrown away.
+	_FORCE_INLINE_ bool read_retry(uint32_t version) {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return (state.load(std::memory_order_relaxed) & STATE_SEQ_MASK) != version;
+	}
+
+	// Copies len bytes from offset in the frame. Only ever waits for writers of this frame, and never holds them up.
+	_FORCE_INLINE_ void copy_out(uint8_t *dst, uint32_t offset, size_t len) {
+		uint32_t version;
+		do {
+			version = read_begin();
+			memcpy(dst, memory_region + offset, len);
+		} while (read_retry(version));
+	}
+
+	// Writers of a frame exclude each other, and readers of that frame only.
+	_FORCE_INLINE_ void write_begin() {
+		uint32_t s = state.load(std::memory_order_relaxed);
+		for (int i = 0;; ++i) {
+			if (!(s & STATE_SEQ_ONE) && state.compare_exchange_weak(s, s + STATE_SEQ_ONE, std::memory_order_acquire)) break;
+			if (i >= CS_FRAME_WAIT_SPIN) OS::get_singleton()->delay_usec(0);
+			s = state.load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	_FORCE_INLINE_ void write_end() {
+		state.fetch_add(STATE_SEQ_ONE, std::memory_order_release);
+	}
+
+	_FORCE_INLINE_ uint32_t get_used_size() {
 		return used_size;
 	}
 
-	_FORCE_INLINE_ Frame &set_used_size(uint16_t in) {
+	_FORCE_INLINE_ Frame &set_used_size(uint32_t in) {
 		used_size = in;
 		return *this;
 	}
 
+	_FORCE_INLINE_ uint32_t get_pins() {
+		return pins;
+	}
+
+	_FORCE_INLINE_ Frame &set_pins(uint32_t in) {
+		pins = in;
+		return *this;
+	}
+
 	Variant to_variant() const {
 		Dictionary a;
 		char s[101] = {0};
@@ -232,50 +411,19 @@ public:
 		a["memory_region"] = Variant(itoh(reinterpret_cast<size_t>(memory_region)) +  " # " + s + " ... ");
 		a["used_size"] = Variant(itoh(used_size));
 		a["time_since_last_use"] = Variant(itoh(ts_last_use));
-		a["used"] = Variant(used);
-		a["dirty"] = Variant(dirty);
-		a["ready"] = Variant(ready);
+		a["used"] = Variant(has(STATE_USED));
+		a["dirty"] = Variant(has(STATE_DIRTY));
+		a["ready"] = Variant(has(STATE_READY));
+		a["referenced"] = Variant(has(STATE_REFERENCED));
+		a["pins"] = Variant(pins);
+		a["version"] = Variant(itoh(state.load(std::memory_order_relaxed) / STATE_SEQ_ONE));
 
 		return Variant(a);
 	}
 
-	class DataRead {
-	private:
-		RWLock *rwl;
-		const uint8_t *mem;
-
-	public:
-		_FORCE_INLINE_ const uint8_t &operator[](int p_index) const { return mem[p_index]; }
-		_FORCE_INLINE_ const uint8_t *ptr() const { return mem; }
-
-		void acquire() {
-			rwl->read_lock();
-		}
-
-		DataRead() :
-				rwl(NULL),
-				mem(NULL) {}
-
-		DataRead(const Frame *alloc, DescriptorInfo *desc_info) :
-				rwl(desc_info->lock),
-				mem(alloc->memory_region) {
-			while (!(alloc->ready))
-				desc_info->ready_sem->wait();
-			// WARN_PRINT(("Acquiring data READ lock in thread ID "  + itoh(Thread::get_caller_id()) ).utf8().get_data());
-			acquire();
-		}
-
-		~DataRead() {
-			if (rwl) {
-				rwl->read_unlock();
-				// WARN_PRINT(("Releasing data READ lock in thread ID " + itoh(Thread::get_caller_id())).utf8().get_data());
-			}
-		}
-	};
-
 	class DataWrite {
 	private:
-		RWLock *rwl;
+		Frame *frame;
 		uint8_t *mem;
 
 	public:
@@ -284,26 +432,25 @@ public:
 
 		void acquire() {
 			// WARN_PRINT(("Acquiring data WRITE lock in thread ID " + itoh(Thread::get_caller_id())).utf8().get_data());
-			rwl->write_lock();
+			frame->write_begin();
 		}
 
 		DataWrite() :
-				rwl(NULL),
+				frame(NULL),
 				mem(NULL) {}
 
 		// We must wait for the page to become clean if we want to write to this page from a file. But, if we're writing from the main thread, we can safely allow this operation to occur.
-		DataWrite(Frame *const p_alloc, DescriptorInfo *desc_info, bool is_io_op) :
-				rwl(desc_info->lock),
+		DataWrite(Frame *const p_alloc, bool is_io_op) :
+				frame(p_alloc),
 				mem(p_alloc->memory_region) {
 			if (is_io_op)
-				while (p_alloc->dirty)
-					desc_info->dirty_sem->wait();
+				p_alloc->wait_clean();
 			acquire();
 		}
 
 		~DataWrite() {
-			if (rwl) {
-				rwl->write_unlock();
+			if (frame) {
+				frame->write_end();
 				// WARN_PRINT(("Releasing data WRITE lock in thread ID " + itoh(Thread::get_caller_id())).utf8().get_data());
 			}
 		}
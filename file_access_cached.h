@@ -61,7 +61,9 @@ private:
 
 protected:
 	Error cached_open(const String &p_path, int p_mode_flags, int cache_policy) {
+		// Every FileAccessCached gets its own handle, even if the file is already open elsewhere.
 		cached_file = cache_mgr->open(p_path, p_mode_flags, cache_policy);
+		last_error = cached_file.is_valid() ? OK : ERR_CANT_OPEN;
 		ERR_FAIL_COND_V(cached_file.is_valid() == false, ERR_CANT_OPEN);
 		return OK;
 	}
@@ -108,13 +110,13 @@ public:
 	void close() {
 		if (cached_file.is_valid()) {
 			cache_mgr->close(cached_file);
+			cached_file = RID();
 		}
 	} ///< close a file
 
-	// Completely removes the file from the cache, including cached pages.
+	// Completely removes the file from the cache, including cached pages, once no other handle has it open.
 	void permanent_close() {
 		if (cached_file.is_valid()) {
-			cache_mgr->close(cached_file);
 			cache_mgr->permanent_close(cached_file);
 			cached_file = RID();
 		}
@@ -133,7 +135,7 @@ public:
 
 	virtual void seek_end(int64_t p_position) { cache_mgr->seek_end(cached_file, p_position); } ///< seek from the end of file
 
-	virtual size_t get_position() const { return cache_mgr->get_len(cached_file); } ///< get position in the file
+	virtual size_t get_position() const { return cache_mgr->get_position(cached_file); } ///< get position in the file
 
 	virtual size_t get_len() const { return cache_mgr->get_len(cached_file); } ///< get size of the file
 
@@ -145,30 +147,36 @@ public:
 		int o_length = 0;
 		//ERR_PRINTS("Initial offset: " + itoh(cache_mgr->get_position(cached_file)));
 
-		// Read 4 pages of data at a time. This is so that it will always be
+		// Read 2 pages of data at a time. This is so that it will always be
 		// possible to have pages of a file present in the cache without worrying
 		// about not being able to add new pages to the cache or reading from invalid pages.
+		// Pages further ahead are loaded by the cache manager's readahead, see FileCacheManager::update_readahead.
 
 		// This reads blocks of bytes at a time rather than calling get_8 a bunch of times.
 
-		for (int i = 0; i < p_length - (p_length % (CS_PAGE_SIZE * 4)); i += CS_PAGE_SIZE * 2) {
+		for (int i = 0; i < p_length; i += CS_PAGE_SIZE * 2) {
+			int len = MIN(p_length - i, (int)CS_PAGE_SIZE * 2);
 			//ERR_PRINTS("Current offset: " + itoh(cache_mgr->get_position(cached_file) + i));
-			cache_mgr->check_cache(cached_file, CS_PAGE_SIZE * 4);
-			o_length += cache_mgr->read(cached_file, p_dst + i, CS_PAGE_SIZE * 2);
+			cache_mgr->check_cache(cached_file, len);
+			o_length += cache_mgr->read(cached_file, p_dst + i, len);
 		}
 
-		if ((p_length % (CS_PAGE_SIZE * 4)) > 0) {
-			//ERR_PRINTS("Current offset: " + itoh(cache_mgr->get_position(cached_file)));
-			cache_mgr->check_cache(cached_file, CS_PAGE_SIZE * 4);
-			o_length += cache_mgr->read(cached_file, p_dst + (p_length - (p_length % (CS_PAGE_SIZE * 4))), (p_length % (4 * CS_PAGE_SIZE)));
-		}
 		if (p_length > o_length) {
 			ERR_PRINTS("Read less than " + itos(p_length) + " bytes.\n");
 		}
 		return o_length;
 	} ///< get an array of bytes
 
-	virtual Error get_error() const { return last_error; } ///< get last error
+	// Like get_buffer, but points r_view at the data in the cache instead of copying it, see FileCacheManager::pin.
+	// The view has to be released before the file is closed.
+	Error get_buffer_view(int p_length, FileCacheManager::PageView &r_view) {
+		cache_mgr->check_cache(cached_file, p_length);
+		Error err = cache_mgr->pin(cached_file, cache_mgr->get_position(cached_file), p_length, r_view);
+		if (err == OK) cache_mgr->seek(cached_file, (int64_t)r_view.get_length(), SEEK_CUR);
+		return err;
+	}
+
+	virtual Error get_error() const { return cached_file.is_valid() ? cache_mgr->get_error(cached_file) : last_error; } ///< get last error
 
 	virtual void flush() { cache_mgr->flush(cached_file); }
 
@@ -178,16 +186,11 @@ public:
 
 		int o_length = 0;
 
-		for (int i = 0; i < p_length - (p_length % (CS_PAGE_SIZE * 4)); i += CS_PAGE_SIZE * 2) {
+		for (int i = 0; i < p_length; i += CS_PAGE_SIZE * 2) {
+			int len = MIN(p_length - i, (int)CS_PAGE_SIZE * 2);
 			//ERR_PRINTS("Current offset: " + itoh(cache_mgr->get_position(cached_file) + i));
-			cache_mgr->check_cache(cached_file, CS_PAGE_SIZE * 4);
-			o_length += cache_mgr->write(cached_file, p_src + i, CS_PAGE_SIZE * 2);
-		}
-
-		if ((p_length % (CS_PAGE_SIZE * 4)) > 0) {
-			//ERR_PRINTS("Current offset: " + itoh(cache_mgr->get_position(cached_file)));
-			cache_mgr->check_cache(cached_file, CS_PAGE_SIZE * 4);
-			o_length += cache_mgr->write(cached_file, p_src + (p_length - (p_length % (CS_PAGE_SIZE * 4))), (p_length % (4 * CS_PAGE_SIZE)));
+			cache_mgr->check_cache(cached_file, len);
+			o_length += cache_mgr->write(cached_file, p_src + i, len);
 		}
 
 		if (p_length > o_length) {
@@ -207,6 +210,7 @@ public:
 
 		cache_mgr = FileCacheManager::get_singleton();
 		CRASH_COND(!cache_mgr);
+		last_error = OK;
 		sem = Semaphore::create();
 		CRASH_COND(!sem);
 	}
@@ -8,7 +8,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #ifndef ANDROID_ENABLED
@@ -61,16 +64,19 @@ Error FileAccessUnbufferedUnix::_open(const String &p_path, int p_mode_flags) {
 	int mode;
 
 	if (p_mode_flags == READ)
-		mode = O_RDONLY | O_SYNC | O_RSYNC | O_DSYNC;
+		mode = O_RDONLY;
 	else if (p_mode_flags == WRITE)
-		mode = O_WRONLY | O_TRUNC | O_CREAT | O_SYNC | O_RSYNC | O_DSYNC;
+		mode = O_WRONLY | O_TRUNC | O_CREAT;
 	else if (p_mode_flags == READ_WRITE)
-		mode = O_RDWR | O_SYNC | O_RSYNC | O_DSYNC;
+		mode = O_RDWR;
 	else if (p_mode_flags == WRITE_READ)
-		mode = O_RDWR | O_TRUNC | O_CREAT | O_SYNC | O_RSYNC | O_DSYNC;
+		mode = O_RDWR | O_TRUNC | O_CREAT;
 	else
 		return ERR_INVALID_PARAMETER;
 
+	if (durability == CS_DURABILITY_DSYNC && (p_mode_flags & WRITE))
+		mode |= O_DSYNC;
+
 	//printf("opening %s as %s\n", p_path.utf8().get_data(), path.utf8().get_data());
 	int err = stat(path.utf8().get_data(), &st);
 	if (!err) {
@@ -89,8 +95,26 @@ Error FileAccessUnbufferedUnix::_open(const String &p_path, int p_mode_flags) {
 		path = path + ".tmp";
 	}
 
+#ifdef O_DIRECT
+	if (direct_io) {
+		fd = ::open(path.utf8().get_data(), mode | O_DIRECT);
+		// tmpfs and some network file systems refuse O_DIRECT, fall back to normal IO for those.
+		if (fd < 0 && errno == EINVAL) direct_io = false;
+	}
+
+	if (!direct_io)
+		fd = ::open(path.utf8().get_data(), mode);
+#else
 	fd = ::open(path.utf8().get_data(), mode);
 
+#ifdef F_NOCACHE
+	// macOS has no O_DIRECT, F_NOCACHE keeps the file's data out of the unified buffer cache instead.
+	if (direct_io && fd >= 0 && fcntl(fd, F_NOCACHE, 1) < 0) direct_io = false;
+#else
+	direct_io = false;
+#endif
+#endif
+
 	if (fd < 0) {
 		last_error = ERR_FILE_CANT_OPEN;
 		return last_error;
@@ -110,6 +134,13 @@ void FileAccessUnbufferedUnix::close() {
 	if (fd < 0)
 		return;
 
+	if ((flags & WRITE) && (durability == CS_DURABILITY_FLUSH || durability == CS_DURABILITY_CLOSE)) {
+		if (fsync(fd) < 0) {
+			ERR_PRINTS("fsync failed for " + path);
+			last_error = ERR_FILE_CANT_WRITE;
+		}
+	}
+
 	::close(fd);
 	fd = -1;
 
@@ -225,9 +256,118 @@ uint8_t FileAccessUnbufferedUnix::get_8() const {
 int FileAccessUnbufferedUnix::get_buffer(uint8_t *p_dst, int p_length) const {
 
 	CRASH_COND(fd < 0);
-	return read(fd, p_dst, p_length);
+	if (!direct_io) return read(fd, p_dst, p_length);
+
+	off_t position = ::lseek(fd, 0, SEEK_CUR);
+	ERR_FAIL_COND_V(position < 0, -1);
+
+	int ret = direct_read(p_dst, p_length, position);
+	if (ret > 0) ::lseek(fd, position + ret, SEEK_SET);
+	return ret;
 };
 
+int FileAccessUnbufferedUnix::read_at(uint8_t *p_dst, int p_length, uint64_t p_position) const {
+
+	ERR_FAIL_COND_V(fd < 0, -1);
+	if (direct_io) return direct_read(p_dst, p_length, p_position);
+
+	int done = 0;
+	while (done < p_length) {
+		ssize_t ret = pread(fd, p_dst + done, p_length - done, p_position + done);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret < 0) return -1;
+		if (ret == 0) break;
+		done += ret;
+	}
+	return done;
+}
+
+int FileAccessUnbufferedUnix::write_at(const uint8_t *p_src, int p_length, uint64_t p_position) {
+
+	ERR_FAIL_COND_V(fd < 0, -1);
+	if (direct_io) return direct_write(p_src, p_length, p_position);
+
+	int done = 0;
+	while (done < p_length) {
+		ssize_t ret = pwrite(fd, p_src + done, p_length - done, p_position + done);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) return -1;
+		done += ret;
+	}
+	return done;
+}
+
+#define CS_IS_DIRECT_ALIGNED(a) ((((uint64_t)(a)) & (CS_DIRECT_IO_ALIGNMENT - 1)) == 0)
+#define CS_DIRECT_ROUND_DOWN(a) (((uint64_t)(a)) & ~(uint64_t)(CS_DIRECT_IO_ALIGNMENT - 1))
+#define CS_DIRECT_ROUND_UP(a) CS_DIRECT_ROUND_DOWN((uint64_t)(a) + CS_DIRECT_IO_ALIGNMENT - 1)
+
+int FileAccessUnbufferedUnix::direct_read(uint8_t *p_dst, int p_length, uint64_t p_position) const {
+
+	if (CS_IS_DIRECT_ALIGNED(p_dst) && CS_IS_DIRECT_ALIGNED(p_position) && CS_IS_DIRECT_ALIGNED(p_length)) {
+		return pread(fd, p_dst, p_length, p_position);
+	}
+
+	uint64_t start = CS_DIRECT_ROUND_DOWN(p_position);
+	uint64_t len = CS_DIRECT_ROUND_UP(p_position + p_length) - start;
+
+	void *bounce = NULL;
+	ERR_FAIL_COND_V(posix_memalign(&bounce, CS_DIRECT_IO_ALIGNMENT, len) != 0, -1);
+
+	ssize_t got = pread(fd, bounce, len, start);
+	int copied = 0;
+	if (got > (ssize_t)(p_position - start)) {
+		copied = MIN((int64_t)p_length, (int64_t)(got - (p_position - start)));
+		memcpy(p_dst, (uint8_t *)bounce + (p_position - start), copied);
+	}
+	free(bounce);
+
+	return got < 0 ? -1 : copied;
+}
+
+int FileAccessUnbufferedUnix::direct_write(const uint8_t *p_src, int p_length, uint64_t p_position) {
+
+	if (CS_IS_DIRECT_ALIGNED(p_src) && CS_IS_DIRECT_ALIGNED(p_position) && CS_IS_DIRECT_ALIGNED(p_length)) {
+		return pwrite(fd, p_src, p_length, p_position);
+	}
+
+	struct stat file_st;
+	ERR_FAIL_COND_V(fstat(fd, &file_st) < 0, -1);
+
+	uint64_t start = CS_DIRECT_ROUND_DOWN(p_position);
+	uint64_t len = CS_DIRECT_ROUND_UP(p_position + p_length) - start;
+
+	void *bounce = NULL;
+	ERR_FAIL_COND_V(posix_memalign(&bounce, CS_DIRECT_IO_ALIGNMENT, len) != 0, -1);
+
+	// Whole blocks are written, so the bytes around our data in the first and last block are read in first.
+	memset(bounce, 0, len);
+	if ((uint64_t)file_st.st_size > start) {
+		ssize_t got = pread(fd, bounce, len, start);
+		if (got < 0) {
+			free(bounce);
+			return -1;
+		}
+	}
+	memcpy((uint8_t *)bounce + (p_position - start), p_src, p_length);
+
+	ssize_t written = pwrite(fd, bounce, len, start);
+	free(bounce);
+
+	if (written < (ssize_t)len) return -1;
+
+	// The padding in the last block must not make the file longer than it should be.
+	uint64_t end = MAX((uint64_t)file_st.st_size, p_position + p_length);
+	if (end < start + len) {
+		ERR_FAIL_COND_V(ftruncate(fd, end) < 0, -1);
+	}
+
+	return p_length;
+}
+
+#undef CS_IS_DIRECT_ALIGNED
+#undef CS_DIRECT_ROUND_DOWN
+#undef CS_DIRECT_ROUND_UP
+
 Error FileAccessUnbufferedUnix::get_error() const {
 
 	return last_error;
@@ -241,9 +381,21 @@ void FileAccessUnbufferedUnix::store_8(uint8_t p_byte) {
 
 void FileAccessUnbufferedUnix::store_buffer(const uint8_t *p_src, int p_length) {
 	CRASH_COND(fd < 0);
+	if (direct_io) {
+		off_t position = ::lseek(fd, 0, SEEK_CUR);
+		ERR_FAIL_COND(position < 0);
+		ERR_FAIL_COND(direct_write(p_src, p_length, position) < p_length);
+		::lseek(fd, position + p_length, SEEK_SET);
+		return;
+	}
 	ERR_FAIL_COND(write(fd, p_src, p_length) < p_length);
 }
 
+void FileAccessUnbufferedUnix::set_direct_io(bool p_enable) {
+	ERR_FAIL_COND_MSG(fd >= 0, "Direct IO can only be changed before the file is opened.");
+	direct_io = p_enable;
+}
+
 bool FileAccessUnbufferedUnix::file_exists(const String &p_path) {
 
 	int err;
@@ -289,10 +441,28 @@ Error FileAccessUnbufferedUnix::_chmod(const String &p_path, int p_mod) {
 	return FAILED;
 }
 
-// Flush does not make sense for unbuffered IO so it has only checks and does not actually do anything.
+// There is nothing buffered to write out, so flushing only makes the data durable, if the durability mode asks for that.
 void FileAccessUnbufferedUnix::flush() {
 
 	ERR_FAIL_COND(fd < 0);
+
+	if (durability != CS_DURABILITY_FLUSH || !(flags & WRITE))
+		return;
+
+#if defined(__APPLE__)
+	int err = fsync(fd);
+#else
+	int err = fdatasync(fd);
+#endif
+	if (err < 0) {
+		ERR_PRINTS("fdatasync failed for " + path);
+		last_error = ERR_FILE_CANT_WRITE;
+	}
+}
+
+void FileAccessUnbufferedUnix::set_durability(CacheDurability p_durability) {
+	ERR_FAIL_COND_MSG(fd >= 0, "The durability mode can only be changed before the file is opened.");
+	durability = p_durability;
 }
 
 FileAccess *FileAccessUnbufferedUnix::create_unbuf_unix() {
@@ -304,8 +474,10 @@ CloseNotificationFunc FileAccessUnbufferedUnix::close_notification_func = NULL;
 
 FileAccessUnbufferedUnix::FileAccessUnbufferedUnix() :
 		fd(-1),
-		flags(0),
 		pos(0),
+		flags(0),
+		direct_io(false),
+		durability(CS_DURABILITY_FLUSH),
 		last_error(OK) {
 }
 
@@ -38,6 +38,8 @@
 
 #if defined(UNIX_ENABLED)
 
+#include "drivers/unix/file_access_unix.h"
+
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -52,6 +54,8 @@ class FileAccessUnbufferedUnix : public FileAccess {
 	int fd;
 	int pos;
 	int flags;
+	bool direct_io;
+	CacheDurability durability;
 	struct stat st;
 	void check_errors() const;
 	void check_errors(int val, int expected, int mode);
@@ -62,7 +66,24 @@ class FileAccessUnbufferedUnix : public FileAccess {
 
 	static FileAccess *create_unbuf_unix();
 
+	// Direct IO needs block aligned buffers, positions and lengths. These go through an aligned bounce buffer when a transfer isn't aligned.
+	int direct_read(uint8_t *p_dst, int p_length, uint64_t p_position) const;
+	int direct_write(const uint8_t *p_src, int p_length, uint64_t p_position);
+
 public:
+	static CloseNotificationFunc close_notification_func;
+
+	// Must be called before the file is opened.
+	// With direct IO, data moves straight between the caller's memory and the device, bypassing the kernel's page cache.
+	// If the file system doesn't support it, the file is opened normally and is_direct_io() returns false.
+	void set_direct_io(bool p_enable);
+	_FORCE_INLINE_ bool is_direct_io() const { return direct_io; }
+
+	// Must be called before the file is opened. Defaults to CS_DURABILITY_FLUSH.
+	void set_durability(CacheDurability p_durability);
+	_FORCE_INLINE_ CacheDurability get_durability() const { return durability; }
+
+	_FORCE_INLINE_ int get_fd() const { return fd; }
 
 	Error unbuffered_open(const String &p_path, int p_mode_flags);
 	Error _open(const String &p_path, int p_mode_flags); ///< open a file
@@ -87,6 +108,10 @@ public:
 
 	Error get_error() const; ///< get last error
 
+	// Positional reads and writes. These don't use or move the file position, so several threads can use them at once.
+	int read_at(uint8_t *p_dst, int p_length, uint64_t p_position) const;
+	int write_at(const uint8_t *p_src, int p_length, uint64_t p_position);
+
 	void flush();
 	void store_8(uint8_t p_byte); ///< store a byte
 	void store_buffer(const uint8_t *p_src, int p_length); ///< store an array of bytes
@@ -31,43 +31,78 @@
 #include "file_cache_manager.h"
 #include "file_access_cached.h"
 
+#include "core/io/file_access_pack.h"
 #include "core/os/os.h"
+#include "core/project_settings.h"
 
+#include <errno.h>
 #include <time.h>
 
+#ifdef UNIX_ENABLED
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+// Runs are still described with iovecs where there's no sys/uio.h, they just never reach vec_transfer there.
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
+
 #define RID_TO_DD(op) (uint64_t) rid op get_id() & 0x0000000000FFFFFF
 #define RID_PTR_TO_DD RID_TO_DD(->)
 #define RID_REF_TO_DD RID_TO_DD(.)
 
+// Only valid after FileCacheManager::init() has been called.
+CacheGeometry cs_geometry = {
+	CS_PAGE_SIZE_DEFAULT,
+	CS_PAGE_SIZE_DEFAULT - 1,
+	12,
+	0,
+	0
+};
+
 FileCacheManager::FileCacheManager() {
 	mutex = Mutex::create();
-	rng.set_seed(OS::get_singleton()->get_ticks_usec());
+	files_lock = RWLock::create();
 
-	memory_region = memnew_arr(uint8_t, CS_CACHE_SIZE);
-	page_frame_map.clear();
-	// pages.clear();
 	frames.clear();
 
-	available_space = CS_CACHE_SIZE;
+	available_space = 0;
 	used_space = 0;
-	total_space = CS_CACHE_SIZE;
+	total_space = 0;
 
-	for (int i = 0; i < CS_NUM_FRAMES; ++i) {
-		frames.push_back(
-				memnew(Frame(memory_region + i * CS_PAGE_SIZE)));
-	}
+	range_seq.store(0, std::memory_order_relaxed);
 
 	singleton = this;
 }
 
 FileCacheManager::~FileCacheManager() {
 	//// WARN_PRINT("Destructor running.");
-	if (memory_region) memdelete(memory_region);
 
-	if (rids.size()) {
-		for (const String *key = rids.next(NULL); key; key = rids.next(key)) {
-			permanent_close(rids[*key]);
+	// Handles that are still open are closed for good, and take their files with them.
+	List<String> paths;
+	rids.get_key_list(&paths);
+	for (List<String>::Element *E = paths.front(); E; E = E->next()) {
+		DescriptorInfo *desc_info = files[rids[E->get()].get_id()];
+		desc_info->drop_on_close = true;
+
+		if (desc_info->handles.size() == 0) {
+			drop_file(desc_info);
+			continue;
+		}
+
+		while (desc_info->handles.size() > 1) {
+			file_handle_owner.free(desc_info->handles[0]->rid);
+			close_handle(desc_info->handles[0]);
 		}
+		// The last handle drops the file, and the descriptor with it.
+		file_handle_owner.free(desc_info->handles[0]->rid);
+		close_handle(desc_info->handles[0]);
 	}
 
 	if (files.size()) {
@@ -77,20 +112,188 @@ FileCacheManager::~FileCacheManager() {
 		}
 	}
 
+	exit_thread = true;
+
+	for (const uint64_t *dev = device_groups.next(NULL); dev; dev = device_groups.next(dev)) {
+		DeviceGroup *group = device_groups[*dev];
+
+		for (int i = 0; i < group->workers.size(); ++i) {
+			group->workers[i]->queue.sig_quit = true;
+			// Only there to wake the worker. If its queue is full it's awake anyway, and will see sig_quit before its next op.
+			group->workers[i]->queue.try_push(CtrlOp());
+		}
+
+		for (int i = 0; i < group->workers.size(); ++i) {
+			Thread::wait_to_finish(group->workers[i]->thread);
+			memdelete(group->workers[i]->thread);
+			memdelete(group->workers[i]);
+		}
+
+		memdelete(group);
+	}
+	device_groups.clear();
+
+	// The frames can only be freed once the IO threads can no longer touch them.
 	for (int i = 0; i < frames.size(); ++i) {
 		memdelete(frames[i]);
 	}
 
-	op_queue.sig_quit = true;
-	op_queue.push(CtrlOp());
-	exit_thread = true;
+	if (memory_region_base) memdelete_arr(memory_region_base);
 
-	Thread::wait_to_finish(this->thread);
+	for (int i = 0; i < shards.size(); ++i) {
+		memdelete(shards[i]->lock);
+		memdelete(shards[i]);
+	}
 
-	memdelete(thread);
+	memdelete(files_lock);
 	memdelete(mutex);
 }
 
+// Returns the size of the file on disk, or 0 if it isn't a plain file.
+static uint64_t get_file_size(const String &path) {
+#ifdef UNIX_ENABLED
+	struct stat st;
+	String real_path = ProjectSettings::get_singleton()->globalize_path(path);
+	if (stat(real_path.utf8().get_data(), &st) == 0)
+		return (uint64_t)st.st_size;
+#endif
+	return 0;
+}
+
+// Opens a second, raw descriptor for a file, so its pages can be read and written by position.
+// Returns -1 if the file isn't a plain file on disk (inside a pack, for example).
+static int open_raw_fd(const String &path, int p_mode, bool dsync) {
+#ifdef UNIX_ENABLED
+	String real_path = ProjectSettings::get_singleton()->globalize_path(path);
+	// The FileAccess has already created or truncated the file as needed, so only the access mode has to match its own.
+	int flags = O_CLOEXEC;
+	switch (p_mode) {
+		case FileAccess::READ:
+			flags |= O_RDONLY;
+			break;
+		case FileAccess::WRITE:
+			flags |= O_WRONLY;
+			break;
+		default:
+			flags |= O_RDWR;
+	}
+	if (p_mode != FileAccess::READ && dsync) flags |= O_DSYNC;
+	return ::open(real_path.utf8().get_data(), flags);
+#else
+	return -1;
+#endif
+}
+
+// Opens a descriptor that can only be used to sync a file that is written through its FileAccess.
+// With backup saves, that's path.tmp until the file is closed. Returns -1 where files can't be synced.
+static int open_sync_fd(const String &path, int p_mode) {
+#ifdef UNIX_ENABLED
+	String real_path = ProjectSettings::get_singleton()->globalize_path(path);
+	if (p_mode == FileAccess::WRITE && FileAccess::is_backup_save_enabled()) real_path += ".tmp";
+	return ::open(real_path.utf8().get_data(), O_RDONLY | O_CLOEXEC);
+#else
+	return -1;
+#endif
+}
+
+// Reads or writes len bytes at pos on a raw descriptor, starting done bytes in and resuming short transfers.
+// Returns the total number of bytes moved, which is less than len only at the end of the file, or -1 on error.
+static int64_t raw_transfer(bool write, int fd, uint8_t *buf, size_t len, uint64_t pos, size_t done = 0) {
+#ifdef UNIX_ENABLED
+	while (done < len) {
+		ssize_t ret = write ? ::pwrite(fd, buf + done, len - done, pos + done) : ::pread(fd, buf + done, len - done, pos + done);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (ret == 0) break;
+		done += ret;
+	}
+	return done;
+#else
+	return -1;
+#endif
+}
+
+// Like raw_transfer, but for a run of buffers that sit back to back in the file. iov is used up as the transfer goes.
+// Returns the total number of bytes moved, or -1 on error.
+static int64_t vec_transfer(bool write, int fd, struct iovec *iov, int iovcnt, uint64_t pos) {
+#ifdef UNIX_ENABLED
+	int64_t done = 0;
+	while (iovcnt > 0) {
+		ssize_t ret = write ? ::pwritev(fd, iov, iovcnt, pos + done) : ::preadv(fd, iov, iovcnt, pos + done);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (ret == 0) break;
+		done += ret;
+
+		// Skip the buffers that were filled, and resume partway through the one that wasn't.
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return done;
+#else
+	return -1;
+#endif
+}
+
+// Direct IO writes must cover whole blocks. A page that ends mid-block is padded out to the end of the block
+// with whatever is on disk there, and once the write is done the file is cut back to its real size.
+// Sets r_len to the number of bytes to write, and r_truncate to the size to cut the file to, or 0 if it doesn't need it.
+// Returns false if what's on disk couldn't be read. r_len is then the unpadded size, which either goes out as is
+// or fails the write, but never puts junk over the rest of the block.
+static bool pad_direct_write(int fd, uint8_t *mem, uint32_t used, uint64_t pos, uint32_t &r_len, uint64_t &r_truncate) {
+	r_truncate = 0;
+	r_len = (used + CS_DIRECT_IO_ALIGNMENT - 1) & ~(uint32_t)(CS_DIRECT_IO_ALIGNMENT - 1);
+	if (r_len == used) return true;
+
+#ifdef UNIX_ENABLED
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		r_len = used;
+		return false;
+	}
+
+	// The last block is read into an aligned bounce buffer, since the frame already holds our data at its start.
+	uint32_t block = used & ~(uint32_t)(CS_DIRECT_IO_ALIGNMENT - 1);
+	alignas(CS_DIRECT_IO_ALIGNMENT) uint8_t bounce[CS_DIRECT_IO_ALIGNMENT];
+
+	ssize_t got = ::pread(fd, bounce, CS_DIRECT_IO_ALIGNMENT, pos + block);
+	if (got < 0) {
+		r_len = used;
+		return false;
+	}
+	if (got > (ssize_t)(used - block))
+		memcpy(mem + used, bounce + (used - block), got - (used - block));
+	if ((uint64_t)st.st_size < pos + r_len) r_truncate = MAX((uint64_t)st.st_size, pos + used);
+#endif
+
+	return true;
+}
+
+uint32_t FileCacheManager::prepare_store(DescriptorInfo *desc_info, Frame *f, uint64_t pos, uint64_t &r_truncate) {
+	r_truncate = 0;
+	if (!desc_info->direct_io) return f->get_used_size();
+
+	// Padding fills in the frame past its used size, which a write to the page could be extending right now.
+	uint32_t len;
+	f->write_begin();
+	if (!pad_direct_write(desc_info->fd, f->memory_region, f->get_used_size(), pos, len, r_truncate)) {
+		WARN_PRINTS("Could not pad the write at " + itoh(pos) + " of " + desc_info->path + " out to a whole block.");
+	}
+	f->write_end();
+	return len;
+}
+
 RID FileCacheManager::open(const String &path, int p_mode, int cache_policy) {
 
 	//  WARN_PRINTS(path + " " + itoh(p_mode) + " " + itoh(cache_policy));
@@ -107,30 +310,48 @@ RID FileCacheManager::open(const String &path, int p_mode, int cache_policy) {
 		rid = rids[path];
 		DescriptorInfo *desc_info = files[RID_REF_TO_DD];
 
-		ERR_FAIL_COND_V_MSG(
-				desc_info->valid,
-				RID(),
-				"The file " + path + " is already open.");
+		if (desc_info->valid) {
+			// The new handle shares the backing file, so it can't truncate it under the other handles or write to a read only file.
+			bool truncates = p_mode == FileAccess::WRITE || p_mode == FileAccess::WRITE_READ;
+			bool writes = p_mode != FileAccess::READ;
+			ERR_FAIL_COND_V_MSG(
+					truncates || (writes && desc_info->mode == FileAccess::READ) || (!writes && desc_info->mode == FileAccess::WRITE),
+					RID(),
+					"The file " + path + " is already open in a mode that can't be shared.");
+
+			// WARN_PRINTS("Opening another handle to " + path)
+			return add_handle(desc_info, 0);
+		}
 
 		CRASH_COND_MSG(desc_info->internal_data_source != NULL, "Descriptor in invalid state, internal data source is apparently valid!");
 
-		desc_info->internal_data_source = FileAccess::open(desc_info->path, p_mode);
-
-		// Seek to the previous offset.
-		seek(rid, files[RID_REF_TO_DD]->offset);
-		check_cache(rid, 8 * CS_PAGE_SIZE);
+		desc_info->internal_data_source = open_data_source(desc_info->path, p_mode, desc_info->direct_io);
+		ERR_FAIL_COND_V_MSG(!desc_info->internal_data_source, RID(), "Could not open file.");
+		desc_info->mode = p_mode;
+		open_raw_source(desc_info, p_mode);
+		desc_info->io_error = OK;
 		desc_info->valid = true;
 
 		if (desc_info->cache_policy != cache_policy) {
-			for (int i = 0; i < desc_info->pages.size(); ++i) {
+			for (page_id i = desc_info->pages.first(); i != (page_id)CS_MEM_VAL_BAD; i = desc_info->pages.next(i)) {
+				Shard &s = get_shard(i);
+				MutexLock sl(s.lock);
+				frame_id curr_frame = s.page_frame_map.get(i);
+				// Pinned pages aren't in any policy list, they join the new policy's once they are unpinned.
+				if (curr_frame == (frame_id)CS_MEM_VAL_BAD || is_transient(curr_frame) || frames[curr_frame]->get_pins()) continue;
 				CS_GET_CACHE_POLICY_FN(cache_removal_policies, desc_info->cache_policy)
-				(desc_info->pages[i]);
+				(s, i);
 				CS_GET_CACHE_POLICY_FN(cache_insertion_policies, cache_policy)
-				(desc_info->pages[i]);
+				(s, i);
 			}
 			desc_info->cache_policy = cache_policy;
 		}
 
+		// Pick up at the offset the file was closed at.
+		RID handle = add_handle(desc_info, desc_info->offset);
+		check_cache(handle, CS_LEN_UNSPECIFIED);
+		return handle;
+
 	} else {
 		// Will be freed when permanent_close is called with the corresponding RID.
 		CachedResourceHandle *hdl = memnew(CachedResourceHandle);
@@ -142,21 +363,57 @@ RID FileCacheManager::open(const String &path, int p_mode, int cache_policy) {
 
 		//Fail with a bad RID if we can't open the file.
 		FileAccess *fa = NULL;
-		ERR_COND_MSG_ACTION((fa = FileAccess::open(path, p_mode)) == NULL, "Could not open file.", { handle_owner.free(rid); memdelete(hdl); return RID(); });
+		bool direct_io = false;
+		ERR_COND_MSG_ACTION((fa = open_data_source(path, p_mode, direct_io)) == NULL, "Could not open file.", { handle_owner.free(rid); memdelete(hdl); return RID(); });
 
-		rids[path] = (add_data_source(rid, fa, cache_policy));
+		rids[path] = (add_data_source(rid, fa, p_mode, cache_policy, direct_io));
 		//  WARN_PRINTS("open file " + path + " with mode " + itoh(p_mode) + "\nGot RID " + itoh(RID_REF_TO_DD) + "\n");
+
+		DescriptorInfo *desc_info = files[RID_REF_TO_DD];
+		RID handle = add_handle(desc_info, 0);
+		check_cache(handle, desc_info->max_pages * CS_PAGE_SIZE);
+		return handle;
 	}
+}
+
+RID FileCacheManager::add_handle(DescriptorInfo *desc_info, size_t offset) {
+	FileHandle *handle = memnew(FileHandle(desc_info, offset, MIN((uint32_t)CS_READAHEAD_INIT_PAGES, max_readahead_pages)));
+	RID rid = file_handle_owner.make_rid(handle);
+	handle->rid = rid;
+
+	desc_info->handles.push_back(handle);
+	desc_info->handle_count.fetch_add(1, std::memory_order_relaxed);
 
 	return rid;
 }
 
 void FileCacheManager::close(const RID rid) {
 
-	DescriptorInfo *const *elem = files.getptr(RID_REF_TO_DD);
-	ERR_FAIL_COND_MSG(!elem, String("No such file"))
+	FileHandle *handle = get_handle(rid);
+	ERR_FAIL_COND_MSG(!handle, String("No such file"))
+	ERR_FAIL_COND_MSG(handle->views.load(std::memory_order_acquire), "The handle still has page views, they must be released first.")
+
+	MutexLock ml = MutexLock(mutex);
+	file_handle_owner.free(rid);
+	close_handle(handle);
+}
+
+void FileCacheManager::close_handle(FileHandle *handle) {
+	DescriptorInfo *desc_info = handle->desc_info;
+
+	desc_info->handles.erase(handle);
+	desc_info->handle_count.fetch_sub(1, std::memory_order_relaxed);
+
+	if (desc_info->handles.size()) {
+		// The file stays open for the other handles. Whatever this one wrote still goes out, as it would on a close.
+		if (desc_info->dirty) enqueue_flush(desc_info);
+		memdelete(handle);
+		return;
+	}
 
-	DescriptorInfo *desc_info = *elem;
+	// A reopened file picks up where its last handle left off.
+	desc_info->offset = handle->offset;
+	memdelete(handle);
 
 	if (desc_info->internal_data_source)
 		enqueue_flush_close(desc_info);
@@ -168,12 +425,25 @@ void FileCacheManager::close(const RID rid) {
 		desc_info->ready_sem->wait();
 
 	//  WARN_PRINTS("Closed file " + desc_info->path);
+
+	if (desc_info->drop_on_close) drop_file(desc_info);
 }
 
 void FileCacheManager::permanent_close(const RID rid) {
 	//  WARN_PRINTS("permanently closed file with RID " + itoh(RID_REF_TO_DD));
+	FileHandle *handle = get_handle(rid);
+	ERR_FAIL_COND_MSG(!handle, String("No such file"))
+	ERR_FAIL_COND_MSG(handle->views.load(std::memory_order_acquire), "The handle still has page views, they must be released first.")
+
 	MutexLock ml = MutexLock(mutex);
-	close(rid);
+	// If other handles still have the file open, the last of them to close drops it.
+	handle->desc_info->drop_on_close = true;
+	file_handle_owner.free(rid);
+	close_handle(handle);
+}
+
+void FileCacheManager::drop_file(DescriptorInfo *desc_info) {
+	RID rid = rids[desc_info->path];
 	remove_data_source(rid);
 	handle_owner.free(rid);
 	memdelete(static_cast<CachedResourceHandle *>(rid.get_data()));
@@ -195,109 +465,292 @@ void FileCacheManager::permanent_close(const RID rid) {
 // This function takes a pointer to a FileAccess object,
 // so anything that implements the FileAccess API (from the file system, or from the network)
 // can act as a data source.
-RID FileCacheManager::add_data_source(RID rid, FileAccess *data_source, int cache_policy) {
+FileAccess *FileCacheManager::open_data_source(const String &path, int p_mode, bool &r_direct_io) {
+	r_direct_io = false;
+
+#ifdef UNIX_ENABLED
+	// Files opened for writing only start out empty, so they never qualify.
+	if (direct_io_min_size && p_mode != FileAccess::WRITE && p_mode != FileAccess::WRITE_READ && get_file_size(path) >= direct_io_min_size) {
+		FileAccessUnbufferedUnix *ufa = memnew(FileAccessUnbufferedUnix);
+		ufa->set_direct_io(true);
+		ufa->set_durability(durability);
+
+		if (ufa->_open(path, p_mode) == OK && ufa->is_direct_io()) {
+			r_direct_io = true;
+			return ufa;
+		}
+
+		memdelete(ufa);
+	}
+#endif
+
+	return FileAccess::open(path, p_mode);
+}
+
+void FileCacheManager::open_raw_source(DescriptorInfo *desc_info, int p_mode) {
+	desc_info->fd = -1;
+#ifdef UNIX_ENABLED
+	if (desc_info->direct_io) {
+		// Positional IO on the direct descriptor doesn't disturb its file position, so it can be shared.
+		desc_info->fd = static_cast<FileAccessUnbufferedUnix *>(desc_info->internal_data_source)->get_fd();
+		return;
+	}
+
+	// A file inside a pack has nothing on disk to open, whatever its path globalizes to.
+	PackedData *packed = PackedData::get_singleton();
+	if (packed && !packed->is_disabled() && packed->has_path(desc_info->path)) return;
+
+	// With backup saves, the FileAccess writes to path.tmp and only renames it over the file on close.
+	// A descriptor for path itself would write to the old file.
+	if (p_mode == FileAccess::WRITE && FileAccess::is_backup_save_enabled()) return;
+
+	// Every other file on disk gets one, so runs of pages can be moved with preadv/pwritev even without io_uring.
+	desc_info->fd = open_raw_fd(desc_info->path, p_mode, desc_info->durability == CS_DURABILITY_DSYNC);
+#endif
+}
+
+RID FileCacheManager::add_data_source(RID rid, FileAccess *data_source, int p_mode, int cache_policy, bool direct_io) {
 
 	CRASH_COND(rid.is_valid() == false);
 	data_descriptor dd = RID_REF_TO_DD;
 
-	files[dd] = memnew(DescriptorInfo(data_source, (page_id)dd << 40, cache_policy));
-	files[dd]->valid = true;
+	DescriptorInfo *desc_info = memnew(DescriptorInfo(data_source, CS_GET_GUID_PREFIX(dd), cache_policy));
+	desc_info->valid = true;
 
-	CRASH_COND(files[dd] == NULL);
+	CRASH_COND(desc_info == NULL);
 
-	seek(rid, 0, SEEK_SET);
-	check_cache(rid, (cache_policy == _FileCacheManager::KEEP ? CS_KEEP_THRESH_DEFAULT : cache_policy == _FileCacheManager::LRU ? CS_LRU_THRESH_DEFAULT : CS_FIFO_THRESH_DEFAULT) * CS_PAGE_SIZE);
+	desc_info->mode = p_mode;
+	desc_info->direct_io = direct_io;
+	desc_info->durability = durability;
+	open_raw_source(desc_info, p_mode);
+	assign_queues(desc_info);
+
+	// Only published once it's set up, other threads may find it through files as soon as it's in there.
+	files_lock->write_lock();
+	files[dd] = desc_info;
+	files_lock->write_unlock();
 
 	return rid;
 }
 
+// Returns the device the file lives on, or 0 if that can't be found out.
+static uint64_t get_device_id(const String &path) {
+#ifdef UNIX_ENABLED
+	struct stat st;
+	String real_path = ProjectSettings::get_singleton()->globalize_path(path);
+	if (stat(real_path.utf8().get_data(), &st) == 0)
+		return (uint64_t)st.st_dev;
+#endif
+	return 0;
+}
+
+void FileCacheManager::assign_queues(DescriptorInfo *desc_info) {
+	uint64_t dev = get_device_id(desc_info->path);
+
+	DeviceGroup **elem = device_groups.getptr(dev);
+	DeviceGroup *group;
+
+	if (elem) {
+		group = *elem;
+	} else {
+		group = memnew(DeviceGroup);
+		group->next_worker = 0;
+
+		for (int i = 0; i < workers_per_device; ++i) {
+			IOWorker *worker = memnew(IOWorker);
+			worker->manager = this;
+			if (use_io_uring && !worker->ring.init(CS_IO_URING_QUEUE_DEPTH, memory_region, CS_CACHE_SIZE)) {
+				WARN_PRINT("Could not set up an io_uring ring, this IO worker will block on each op.");
+			}
+			worker->thread = Thread::create(FileCacheManager::thread_func, worker);
+			group->workers.push_back(worker);
+			group->queues.push_back(&worker->queue);
+		}
+
+		device_groups[dev] = group;
+		//  WARN_PRINTS("Started " + itoh(workers_per_device) + " IO workers for device " + itoh(dev));
+	}
+
+	// Files on the same device are spread over its workers round robin.
+	desc_info->queue = group->queues[group->next_worker];
+	desc_info->load_queues = group->queues;
+	group->next_worker = (group->next_worker + 1) % group->workers.size();
+}
+
 void FileCacheManager::remove_data_source(RID rid) {
 	DescriptorInfo *di = files[RID_REF_TO_DD];
 
-	for (int i = 0; i < di->pages.size(); i++) {
+	for (page_id i = di->pages.first(); i != (page_id)CS_MEM_VAL_BAD; i = di->pages.next(i)) {
+		Shard &s = get_shard(i);
+		MutexLock ml(s.lock);
 
-		frames[page_frame_map[di->pages[i]]]->wait_clean(di->dirty_sem).set_ready_false().set_used(false).set_owning_page(0);
+		// The page is dropped from its shard too, or the shard would hand its frame out twice.
+		frame_id curr_frame = s.page_frame_map.get(i);
+		if (curr_frame == (frame_id)CS_MEM_VAL_BAD) continue;
+		untrack_page(s, di, i);
 
 		memset(
 				Frame::DataWrite(
-						frames[page_frame_map[di->pages[i]]],
-						di,
+						frames[curr_frame],
 						true)
 						.ptr(),
 				0,
-				4096);
+				CS_PAGE_SIZE);
 	}
 
 	rids.erase(di->path);
-	files.erase(di->guid_prefix >> 40);
+	files_lock->write_lock();
+	files.erase(CS_GET_DESCRIPTOR_FROM_GUID(di->guid_prefix));
+	files_lock->write_unlock();
+
+	// A thread evicting one of our pages may have looked the file up before it was erased.
+	// Evictions hold their shard until they're done with the file, so going through every shard waits them out.
+	for (int i = 0; i < shards.size(); ++i) {
+		shards[i]->lock->lock();
+		shards[i]->lock->unlock();
+	}
+
 	memdelete(di);
 }
 
-void FileCacheManager::enqueue_load(DescriptorInfo *desc_info, frame_id curr_frame, size_t offset) {
+void FileCacheManager::enqueue_load(DescriptorInfo *desc_info, frame_id curr_frame, size_t offset, uint8_t priority) {
 	//WARN_PRINTS("Enqueueing load for file " + desc_info->path + " at frame " + itoh(curr_frame) + " at offset " + itoh(offset))
 
-	if (offset > desc_info->total_size) {
+	if (offset > desc_info->total_size || desc_info->mode == FileAccess::WRITE) {
 
 		// We can zero fill the current frame and return if the
 		// current page is higher than the size of the file, to
 		// prevent accidentally reading old data.
+		// A write only file can't be read at all, neither through its descriptor nor its FileAccess.
 
 		//  WARN_PRINTS("Accessed out of bounds, reading zeroes.");
-		memset(Frame::DataWrite(frames[curr_frame], desc_info, true).ptr(), 0, CS_PAGE_SIZE);
-		frames[curr_frame]->set_ready_true(desc_info->ready_sem);
+		memset(Frame::DataWrite(frames[curr_frame], true).ptr(), 0, CS_PAGE_SIZE);
+		frames[curr_frame]->set_ready_true();
 		//  WARN_PRINTS("Finished OOB access.");
 	} else {
-		op_queue.push(CtrlOp(desc_info, curr_frame, offset, CtrlOp::LOAD));
+		desc_info->pending_loads.fetch_add(1);
+		get_load_queue(desc_info, frames[curr_frame]->get_owning_page())->push(CtrlOp(desc_info, curr_frame, offset, CtrlOp::LOAD, priority));
 		// WARN_PRINTS("file " + desc_info->path + " at offset " + itoh(offset) + " with frame " + itoh(curr_frame));
 	}
 }
 
-void FileCacheManager::enqueue_store(DescriptorInfo *desc_info, frame_id curr_frame, size_t offset) {
-	op_queue.push(CtrlOp(desc_info, curr_frame, offset, CtrlOp::STORE));
+void FileCacheManager::enqueue_store(DescriptorInfo *desc_info, frame_id curr_frame, size_t offset, uint8_t priority) {
+	desc_info->queue->push(CtrlOp(desc_info, curr_frame, offset, CtrlOp::STORE, priority));
 	//  WARN_PRINTS("Enqueue store op for file " + desc_info->path + " at offset " + itoh(offset) + " with frame " + itoh(curr_frame));
 }
 
+void FileCacheManager::enqueue_write_back(DescriptorInfo *desc_info, page_id curr_page) {
+	// The dirty pages next to the one being evicted are written along with it, so eviction
+	// makes one sequential write instead of many scattered ones. The neighbours stay cached, clean.
+	// Every page but the last of a run must be full, see write_run.
+	page_id first = curr_page;
+	uint32_t count = 1;
+
+	// The neighbours are in other shards, so they are looked up in the file's index, and may be evicted under us.
+	while (count < max_write_pages && CS_GET_FILE_OFFSET_FROM_GUID(first) > 0) {
+		frame_id f = desc_info->pages.get(first - CS_PAGE_SIZE);
+		if (f == (frame_id)CS_MEM_VAL_BAD || !frames[f]->get_dirty() || frames[f]->get_used_size() < CS_PAGE_SIZE) break;
+		first -= CS_PAGE_SIZE;
+		count += 1;
+	}
+
+	page_id last = curr_page;
+	frame_id last_frame = desc_info->pages.get(curr_page);
+	while (count < max_write_pages && frames[last_frame]->get_used_size() == CS_PAGE_SIZE) {
+		frame_id f = desc_info->pages.get(last + CS_PAGE_SIZE);
+		if (f == (frame_id)CS_MEM_VAL_BAD || !frames[f]->get_dirty()) break;
+		last += CS_PAGE_SIZE;
+		last_frame = f;
+		count += 1;
+	}
+
+	// Pushed in file order, so the worker finds them back to back and can merge them.
+	for (page_id i = first; i <= last; i += CS_PAGE_SIZE) {
+		frame_id f = desc_info->pages.get(i);
+		if (f != (frame_id)CS_MEM_VAL_BAD) enqueue_store(desc_info, f, CS_GET_FILE_OFFSET_FROM_GUID(i), CtrlOp::PRIORITY_DEMAND);
+	}
+}
+
 void FileCacheManager::enqueue_flush(DescriptorInfo *desc_info) {
 
 	{
-		MutexLock ml(op_queue.mut);
-		for (List<CtrlOp>::Element *e = op_queue.queue.front(); e;) {
-			List<CtrlOp>::Element *next = e->next();
-			if (e->get().di == desc_info && e->get().type == CtrlOp::STORE) {
-				//  WARN_PRINTS("Deleting store op with offset: " + itoh(e->get().offset) + " frame: " + itoh(e->get().frame) + " file:  " + e->get().di->path)
-
-				e->erase();
+		// The flush writes back every dirty page anyway. Stores of evicted pages are left alone, their evictions are waiting on them.
+		CtrlRing &ring = desc_info->queue->queue[CtrlOp::PRIORITY_WRITE_BACK];
+		for (uint64_t pos = ring.head(); pos != ring.tail(); ++pos) {
+			CtrlOp op;
+			if (ring.peek(pos, op) && op.di == desc_info && op.type == CtrlOp::STORE) {
+				//  WARN_PRINTS("Deleting store op with offset: " + itoh(op.offset) + " frame: " + itoh(op.frame) + " file:  " + op.di->path)
+
+				ring.cancel(pos);
 			}
-			e = next;
 		}
 	}
 
-	op_queue.priority_push(CtrlOp(desc_info, CS_MEM_VAL_BAD, CS_MEM_VAL_BAD, CtrlOp::FLUSH));
+	// Nobody waits on a flush, so it goes behind everything else. Aging still gets it done in time.
+	desc_info->queue->push(CtrlOp(desc_info, CS_MEM_VAL_BAD, CS_MEM_VAL_BAD, CtrlOp::FLUSH, CtrlOp::PRIORITY_FLUSH));
 	//  WARN_PRINTS("Enqueue flush op")
 }
 
 void FileCacheManager::enqueue_flush_close(DescriptorInfo *desc_info) {
 
 	// WARN_PRINTS("Enqueue flush & close op")
-	{
-		MutexLock ml(op_queue.mut);
-		for (List<CtrlOp>::Element *e = op_queue.queue.front(); e;) {
-			List<CtrlOp>::Element *next = e->next();
-			if (e->get().di == desc_info) {
+	// Loads may be waiting on any of the device's workers.
+	for (int q = 0; q < desc_info->load_queues.size(); ++q) {
+		CtrlQueue *queue = desc_info->load_queues[q];
+		for (int c = 0; c < CtrlOp::PRIORITY_MAX; ++c) {
+			CtrlRing &ring = queue->queue[c];
+			for (uint64_t pos = ring.head(); pos != ring.tail(); ++pos) {
+				CtrlOp op;
+				// An op a worker picks up before we can cancel it just runs, close waits for it.
+				if (!ring.peek(pos, op) || op.di != desc_info || !ring.cancel(pos)) continue;
 
 				// Make it so the page frame mapping is removed as well.
 
-				if (e->get().type == CtrlOp::LOAD) {
-					DescriptorInfo *desc_info = e->get().di;
-					untrack_page(desc_info, frames[e->get().frame]->owning_page);
+				if (op.type == CtrlOp::LOAD) {
+					page_id curr_page = get_page_guid(desc_info, op.offset, false);
+					Shard &s = get_shard(curr_page);
+					MutexLock ml(s.lock);
+					untrack_page(s, desc_info, curr_page);
+					desc_info->finish_load();
 				}
-
-				e->erase();
 			}
-			e = next;
 		}
 	}
-	op_queue.priority_push(CtrlOp(desc_info, CS_MEM_VAL_BAD, CS_MEM_VAL_BAD, CtrlOp::FLUSH_CLOSE));
+	// close() waits for this one.
+	desc_info->queue->priority_push(CtrlOp(desc_info, CS_MEM_VAL_BAD, CS_MEM_VAL_BAD, CtrlOp::FLUSH_CLOSE));
+}
+
+int64_t FileCacheManager::read_at(DescriptorInfo *desc_info, uint8_t *buf, size_t len, uint64_t pos) {
+	io_stats.read_calls.fetch_add(1, std::memory_order_relaxed);
+	io_stats.pages_read.fetch_add(1, std::memory_order_relaxed);
+
+	if (desc_info->fd >= 0) {
+		// Files with a raw descriptor never go through the FileAccess buffers, see open_raw_source.
+		return raw_transfer(false, desc_info->fd, buf, len, pos);
+	}
+
+	MutexLock ml(desc_info->io_lock);
+	desc_info->internal_data_source->seek(pos);
+	return desc_info->internal_data_source->get_buffer(buf, len);
+}
+
+int64_t FileCacheManager::write_at(DescriptorInfo *desc_info, const uint8_t *buf, size_t len, uint64_t pos) {
+	io_stats.write_calls.fetch_add(1, std::memory_order_relaxed);
+	io_stats.pages_written.fetch_add(1, std::memory_order_relaxed);
+
+	if (desc_info->fd >= 0) {
+		return raw_transfer(true, desc_info->fd, const_cast<uint8_t *>(buf), len, pos);
+	}
+
+	MutexLock ml(desc_info->io_lock);
+	desc_info->internal_data_source->seek(pos);
+	desc_info->internal_data_source->store_buffer(buf, len);
+	return desc_info->internal_data_source->get_error() == OK ? (int64_t)len : -1;
+}
+
+void FileCacheManager::set_io_error(DescriptorInfo *desc_info, Error p_error, const String &p_what) {
+	ERR_PRINTS("Could not " + p_what + " " + desc_info->path + ".");
+	desc_info->io_error = p_error;
 }
 
 void FileCacheManager::do_load_op(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame, size_t offset) {
@@ -305,29 +758,25 @@ void FileCacheManager::do_load_op(DescriptorInfo *desc_info, page_id curr_page,
 
 	CRASH_COND_MSG(desc_info->valid != true, "File not open!")
 
-	desc_info->internal_data_source->seek(CS_GET_FILE_OFFSET_FROM_GUID(curr_page));
-	int64_t used_size;
-	{
-		Frame::DataWrite w(
-				frames[curr_frame],
-				desc_info,
-				true);
+	Frame *f = frames[curr_frame];
 
-		used_size = desc_info->internal_data_source->get_buffer(
-				w.ptr(),
-				CS_PAGE_SIZE);
-		//ERR_PRINTS("File read returned " + itoh(used_size));
+	// A frame being loaded isn't ready, so no reader or writer can look at it until we're done.
+	// That's why loads don't need to take the frame's write side.
+	f->wait_clean();
+
+	int64_t used_size = read_at(desc_info, f->memory_region, CS_PAGE_SIZE, CS_GET_FILE_OFFSET_FROM_GUID(curr_page));
+	//ERR_PRINTS("File read returned " + itoh(used_size));
 
-		// Error has occurred.
-		CRASH_COND(used_size < 0);
-		(frames[curr_frame])
-				->set_used_size(used_size)
-				.set_ready_true(desc_info->ready_sem);
+	if (used_size < 0) {
+		set_io_error(desc_info, ERR_FILE_CANT_READ, "read page " + itoh(curr_page) + " of");
+		memset(f->memory_region, 0, CS_PAGE_SIZE);
+		used_size = 0;
 	}
+	f->set_used_size(used_size).set_ready_true();
 	// ERR_PRINTS(itoh(used_size) + " from offset " + itoh(offset) + " with page " + itoh(curr_page) + " mapped to frame " + itoh(curr_frame))
 }
 
-void FileCacheManager::do_store_op(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame, size_t offset) {
+void FileCacheManager::do_store_op(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame, size_t offset, uint8_t priority) {
 	// store back to data source somehow...
 
 	// ERR_PRINTS("Start store op with file: " + desc_info->path + " page: " + itoh(curr_page) + " frame: " + itoh(curr_frame))
@@ -342,48 +791,413 @@ void FileCacheManager::do_store_op(DescriptorInfo *desc_info, page_id curr_page,
 		CRASH_NOW() //(!desc_info->valid)
 	}
 
-	desc_info->internal_data_source->seek(CS_GET_PAGE(offset));
 	{
-		Frame::DataRead r(frames[curr_frame], desc_info);
+		Frame *f = frames[curr_frame];
 
-		desc_info->internal_data_source->store_buffer(r.ptr(), frames[curr_frame]->get_used_size());
-		frames[curr_frame]->set_dirty_false(desc_info->dirty_sem, curr_frame);
+		// The op carries the frame it was queued for. If the frame has moved on to another page since, there's nothing to write.
+		if (f->get_owning_page() != curr_page) return;
+		f->wait_ready();
+
+		// Already written back along with a neighbouring page.
+		if (!f->get_dirty()) return;
+
+		uint64_t truncate_to = 0;
+		uint32_t len = prepare_store(desc_info, f, CS_GET_PAGE(offset), truncate_to);
+		uint32_t version = f->read_begin();
+
+		if (write_at(desc_info, f->memory_region, len, CS_GET_PAGE(offset)) < 0) {
+			set_io_error(desc_info, ERR_FILE_CANT_WRITE, "write page " + itoh(curr_page) + " of");
+		}
+#ifdef UNIX_ENABLED
+		else if (truncate_to && ftruncate(desc_info->fd, truncate_to) < 0) {
+			set_io_error(desc_info, ERR_FILE_CANT_WRITE, "truncate");
+		}
+#endif
+		finish_store(desc_info, curr_page, curr_frame, version, priority);
 	}
 
 	// ERR_PRINTS("End store op with file: " + desc_info->path + " page: " + itoh(curr_page) + " frame: " + itoh(curr_frame))
 }
 
+void FileCacheManager::finish_store(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame, uint32_t version, uint8_t priority) {
+	// The index bit is cleared first, so a writer dirtying the page after the CAS can't have its bit cleared by us.
+	// One that got in before the CAS changed the sequence number, and the bit is put back below.
+	desc_info->pages.set_dirty(curr_page, false);
+	if (frames[curr_frame]->set_dirty_false(version)) return;
+	desc_info->pages.set_dirty(curr_page, true);
+
+	// We may be the worker of the file's queue, which can't wait for room in it. If it's full, the page is written again right away.
+	size_t offset = CS_GET_FILE_OFFSET_FROM_GUID(curr_page);
+	if (!desc_info->queue->try_push(CtrlOp(desc_info, curr_frame, offset, CtrlOp::STORE, priority))) {
+		do_store_op(desc_info, curr_page, curr_frame, offset, priority);
+	}
+}
+
+bool FileCacheManager::do_batched_io(IOWorker &worker, CtrlOp &op) {
+	struct InFlight {
+		DescriptorInfo *di;
+		page_id page;
+		frame_id frame;
+		uint32_t len;
+		uint32_t version;
+		uint64_t truncate_to;
+		bool store;
+		uint8_t priority;
+	};
+
+	InFlight batch[CS_IO_URING_QUEUE_DEPTH];
+	uint32_t count = 0;
+	bool have_next = false;
+
+	while (true) {
+		page_id curr_page = get_page_guid(op.di, op.offset, false);
+		// A store goes to the frame it was queued for, see thread_func.
+		frame_id curr_frame = op.type == CtrlOp::STORE ? op.frame : op.di->pages.get(curr_page);
+
+		// Two ops on the same page must not be in flight together, or their order would be lost.
+		bool conflict = false;
+		for (uint32_t i = 0; i < count; ++i) {
+			if (batch[i].page == curr_page) conflict = true;
+		}
+
+		if (conflict) {
+			have_next = true;
+			break;
+		}
+
+		if (curr_frame != (frame_id)CS_MEM_VAL_BAD && op.type == CtrlOp::STORE) {
+			if (frames[curr_frame]->get_owning_page() == curr_page) frames[curr_frame]->wait_ready();
+			// The frame has moved on to another page, or was already written back along with a neighbouring page.
+			if (frames[curr_frame]->get_owning_page() != curr_page || !frames[curr_frame]->get_dirty()) curr_frame = CS_MEM_VAL_BAD;
+		}
+
+		if (curr_frame != (frame_id)CS_MEM_VAL_BAD) {
+			Frame *f = frames[curr_frame];
+			InFlight &e = batch[count];
+			e.di = op.di;
+			e.page = curr_page;
+			e.frame = curr_frame;
+			e.store = op.type == CtrlOp::STORE;
+			e.priority = op.priority;
+			e.truncate_to = 0;
+
+			if (e.store) {
+				e.len = prepare_store(op.di, f, CS_GET_FILE_OFFSET_FROM_GUID(curr_page), e.truncate_to);
+				e.version = f->read_begin();
+				worker.ring.queue_write(op.di->fd, f->memory_region, e.len, CS_GET_FILE_OFFSET_FROM_GUID(curr_page), count);
+			} else {
+				// A frame being loaded isn't ready, so nobody else can look at its memory until we're done.
+				f->wait_clean();
+				e.len = CS_PAGE_SIZE;
+				worker.ring.queue_read(op.di->fd, f->memory_region, e.len, CS_GET_FILE_OFFSET_FROM_GUID(curr_page), count);
+			}
+
+			count += 1;
+		} else if (op.type == CtrlOp::LOAD) {
+			// The page was dropped while the load was queued.
+			op.di->finish_load();
+		}
+
+		if (count == worker.ring.get_capacity() || count == CS_IO_URING_QUEUE_DEPTH) break;
+		if (!worker.queue.try_pop(op)) break;
+
+		if (op.type == CtrlOp::QUIT || !op.di || !op.di->valid || op.di->fd < 0 || (op.type != CtrlOp::LOAD && op.type != CtrlOp::STORE)) {
+			have_next = true;
+			break;
+		}
+	}
+
+	IOUringEngine::Completion done[CS_IO_URING_QUEUE_DEPTH];
+	uint32_t completed = 0;
+
+	while (completed < count) {
+		int ret = worker.ring.submit_and_wait(count - completed);
+		io_stats.ring_submits.fetch_add(1, std::memory_order_relaxed);
+
+		uint32_t n = worker.ring.reap(done, CS_IO_URING_QUEUE_DEPTH);
+
+		if (ret < 0 && ret != -EBUSY) {
+			// The ops the ring couldn't take are done synchronously, as failed ones are below.
+			// Those the kernel already has still complete through the ring, and are all that's left to wait for then.
+			uint64_t unsubmitted[CS_IO_URING_QUEUE_DEPTH];
+			uint32_t taken = worker.ring.take_unsubmitted(unsubmitted, CS_IO_URING_QUEUE_DEPTH - n);
+			for (uint32_t i = 0; i < taken; ++i) {
+				done[n + i].user_data = unsubmitted[i];
+				done[n + i].res = -1;
+			}
+			if (!n && !taken) OS::get_singleton()->delay_usec(100);
+			n += taken;
+		}
+
+		for (uint32_t i = 0; i < n; ++i) {
+			InFlight &e = batch[done[i].user_data];
+			Frame *f = frames[e.frame];
+
+			// Failed ops are retried synchronously, as are short writes. A short read just means we hit the end of the file.
+			int64_t res = done[i].res;
+			if (res < 0)
+				res = raw_transfer(e.store, e.di->fd, f->memory_region, e.len, CS_GET_FILE_OFFSET_FROM_GUID(e.page));
+			else if (e.store && res < e.len)
+				res = raw_transfer(true, e.di->fd, f->memory_region, e.len, CS_GET_FILE_OFFSET_FROM_GUID(e.page), res);
+
+			if (e.store) {
+				io_stats.pages_written.fetch_add(1, std::memory_order_relaxed);
+				if (res < 0) {
+					set_io_error(e.di, ERR_FILE_CANT_WRITE, "write page " + itoh(e.page) + " of");
+				} else if (e.truncate_to && ftruncate(e.di->fd, e.truncate_to) < 0) {
+					set_io_error(e.di, ERR_FILE_CANT_WRITE, "truncate");
+				}
+				finish_store(e.di, e.page, e.frame, e.version, e.priority);
+			} else {
+				io_stats.pages_read.fetch_add(1, std::memory_order_relaxed);
+				if (res < 0) {
+					set_io_error(e.di, ERR_FILE_CANT_READ, "read page " + itoh(e.page) + " of");
+					memset(f->memory_region, 0, CS_PAGE_SIZE);
+					res = 0;
+				}
+				f->set_used_size(res).set_ready_true();
+				e.di->finish_load();
+			}
+		}
+
+		completed += n;
+	}
+
+	return have_next;
+}
+
+void FileCacheManager::write_run(DescriptorInfo *desc_info, page_id first_page, const frame_id *run, uint32_t count, uint8_t priority) {
+	uint64_t pos = CS_GET_FILE_OFFSET_FROM_GUID(first_page);
+	uint64_t truncate_to = 0;
+
+	uint32_t last_len = prepare_store(desc_info, frames[run[count - 1]], pos + (uint64_t)(count - 1) * CS_PAGE_SIZE, truncate_to);
+
+	// Writers aren't held off while the run is out, see Frame::set_dirty_false.
+	uint32_t versions[CS_IO_MAX_RUN];
+	for (uint32_t i = 0; i < count; ++i) {
+		versions[i] = frames[run[i]]->read_begin();
+	}
+
+	bool ok;
+	if (desc_info->fd >= 0) {
+		struct iovec iov[CS_IO_MAX_RUN];
+		for (uint32_t i = 0; i < count; ++i) {
+			iov[i].iov_base = frames[run[i]]->memory_region;
+			iov[i].iov_len = i == count - 1 ? last_len : CS_PAGE_SIZE;
+		}
+
+		ok = vec_transfer(true, desc_info->fd, iov, count, pos) >= 0;
+	} else {
+		// Without a raw descriptor the run is gathered into one buffer, so it still goes out as a single write.
+		size_t len = (size_t)(count - 1) * CS_PAGE_SIZE + last_len;
+		uint8_t *staging = (uint8_t *)memalloc(len);
+		for (uint32_t i = 0; i < count; ++i) {
+			memcpy(staging + (size_t)i * CS_PAGE_SIZE, frames[run[i]]->memory_region, i == count - 1 ? last_len : CS_PAGE_SIZE);
+		}
+
+		MutexLock ml(desc_info->io_lock);
+		desc_info->internal_data_source->seek(pos);
+		desc_info->internal_data_source->store_buffer(staging, len);
+		memfree(staging);
+		ok = desc_info->internal_data_source->get_error() == OK;
+	}
+
+	io_stats.write_calls.fetch_add(1, std::memory_order_relaxed);
+	io_stats.pages_written.fetch_add(count, std::memory_order_relaxed);
+
+	if (!ok) {
+		set_io_error(desc_info, ERR_FILE_CANT_WRITE, "write pages " + itoh(first_page) + " to " + itoh(first_page + (page_id)(count - 1) * CS_PAGE_SIZE) + " of");
+	}
+#ifdef UNIX_ENABLED
+	else if (truncate_to && ftruncate(desc_info->fd, truncate_to) < 0) {
+		set_io_error(desc_info, ERR_FILE_CANT_WRITE, "truncate");
+	}
+#endif
+
+	for (uint32_t i = 0; i < count; ++i) {
+		finish_store(desc_info, first_page + (page_id)i * CS_PAGE_SIZE, run[i], versions[i], priority);
+	}
+}
+
+bool FileCacheManager::do_vectored_io(IOWorker &worker, CtrlOp &op) {
+	DescriptorInfo *desc_info = op.di;
+	bool store = op.type == CtrlOp::STORE;
+	uint32_t max_run = store ? max_write_pages : CS_IO_MAX_RUN;
+	// The most urgent op in the run, for stores that have to go out again, see finish_store.
+	uint8_t priority = op.priority;
+	page_id first_page = CS_MEM_VAL_BAD;
+	frame_id run[CS_IO_MAX_RUN];
+	uint32_t count = 0;
+	bool have_next = false;
+
+	while (true) {
+		page_id curr_page = get_page_guid(desc_info, op.offset, false);
+		// A store goes to the frame it was queued for, see thread_func.
+		frame_id curr_frame = store ? op.frame : desc_info->pages.get(curr_page);
+
+		if (curr_frame != (frame_id)CS_MEM_VAL_BAD && store) {
+			if (frames[curr_frame]->get_owning_page() == curr_page) frames[curr_frame]->wait_ready();
+			// The frame has moved on to another page, or was already written back along with a neighbouring page.
+			if (frames[curr_frame]->get_owning_page() != curr_page || !frames[curr_frame]->get_dirty()) curr_frame = CS_MEM_VAL_BAD;
+		}
+
+		if (curr_frame == (frame_id)CS_MEM_VAL_BAD) {
+			// The page was dropped while the op was queued.
+			if (!store) desc_info->finish_load();
+		} else if (count && curr_page != first_page + count * CS_PAGE_SIZE) {
+			have_next = true;
+			break;
+		} else {
+			Frame *f = frames[curr_frame];
+			if (count == 0) first_page = curr_page;
+
+			// A frame being loaded isn't ready, so nobody else can look at its memory until we're done.
+			if (!store) f->wait_clean();
+			run[count++] = curr_frame;
+			priority = MIN(priority, op.priority);
+
+			// A page that isn't full is the last one that can go in a write, or the file would get a hole of junk.
+			if (store && f->get_used_size() < CS_PAGE_SIZE) break;
+		}
+
+		if (count == max_run) break;
+		if (!worker.queue.try_pop(op)) break;
+
+		if (op.type != (store ? CtrlOp::STORE : CtrlOp::LOAD) || op.di != desc_info || !desc_info->valid) {
+			have_next = true;
+			break;
+		}
+	}
+
+	if (count && store) {
+		write_run(desc_info, first_page, run, count, priority);
+	} else if (count) {
+		struct iovec iov[CS_IO_MAX_RUN];
+		for (uint32_t i = 0; i < count; ++i) {
+			iov[i].iov_base = frames[run[i]]->memory_region;
+			iov[i].iov_len = CS_PAGE_SIZE;
+		}
+
+		int64_t res = vec_transfer(false, desc_info->fd, iov, count, CS_GET_FILE_OFFSET_FROM_GUID(first_page));
+		if (res < 0) {
+			set_io_error(desc_info, ERR_FILE_CANT_READ, "read pages " + itoh(first_page) + " to " + itoh(first_page + (page_id)(count - 1) * CS_PAGE_SIZE) + " of");
+			for (uint32_t i = 0; i < count; ++i) {
+				memset(frames[run[i]]->memory_region, 0, CS_PAGE_SIZE);
+			}
+			res = 0;
+		}
+		io_stats.read_calls.fetch_add(1, std::memory_order_relaxed);
+		io_stats.pages_read.fetch_add(count, std::memory_order_relaxed);
+
+		for (uint32_t i = 0; i < count; ++i) {
+			// A read that stops short has hit the end of the file, the pages after that are empty.
+			int64_t left = res - (int64_t)i * CS_PAGE_SIZE;
+			frames[run[i]]->set_used_size(CLAMP(left, 0, (int64_t)CS_PAGE_SIZE)).set_ready_true();
+			desc_info->finish_load();
+		}
+	}
+
+	return have_next;
+}
+
+void FileCacheManager::write_back(DescriptorInfo *desc_info) {
+	// The dirty set is kept in file order, so runs fall out of a single walk over it.
+	frame_id run[CS_IO_MAX_RUN];
+	page_id first_page = CS_MEM_VAL_BAD;
+	uint32_t count = 0;
+
+	for (page_id i = desc_info->pages.first_dirty(); i != (page_id)CS_MEM_VAL_BAD; i = desc_info->pages.next_dirty(i)) {
+		frame_id curr_frame = desc_info->pages.get(i);
+		if (curr_frame == (frame_id)CS_MEM_VAL_BAD) continue;
+		Frame *f = frames[curr_frame];
+		if (!f->get_dirty()) continue;
+
+		if (count && i != first_page + count * CS_PAGE_SIZE) {
+			write_run(desc_info, first_page, run, count, CtrlOp::PRIORITY_WRITE_BACK);
+			count = 0;
+		}
+
+		if (count == 0) first_page = i;
+		run[count++] = curr_frame;
+
+		// A page that isn't full ends a run, see do_vectored_io.
+		if (count == max_write_pages || f->get_used_size() < CS_PAGE_SIZE) {
+			write_run(desc_info, first_page, run, count, CtrlOp::PRIORITY_WRITE_BACK);
+			count = 0;
+		}
+	}
+
+	if (count) write_run(desc_info, first_page, run, count, CtrlOp::PRIORITY_WRITE_BACK);
+}
+
 void FileCacheManager::flush(RID rid) {
-	enqueue_flush(files[RID_REF_TO_DD]);
+	FileHandle *handle = get_handle(rid);
+	ERR_FAIL_COND_MSG(!handle, "No such file")
+	enqueue_flush(handle->desc_info);
 }
 
 void FileCacheManager::do_flush_op(DescriptorInfo *desc_info) {
 	CRASH_COND(!(desc_info->internal_data_source));
 
-	int j = 0;
-	for (int i = 0; i < desc_info->pages.size(); i++) {
-		if (frames[page_frame_map[desc_info->pages[i]]]->get_dirty()) {
-			do_store_op(desc_info, page_frame_map[desc_info->pages[i]], desc_info->pages[i], page_frame_map[desc_info->pages[i]]);
+	write_back(desc_info);
+	sync_data_source(desc_info, false);
+	// ERR_PRINTS("flushed file " + desc_info->path)
+}
 
-			j += 1;
-		}
+void FileCacheManager::sync_data_source(DescriptorInfo *desc_info, bool closing) {
+	if (desc_info->durability == CS_DURABILITY_NONE || desc_info->mode == FileAccess::READ) return;
+	// Every write through the raw descriptor was already synchronous. Files without one are synced like with Flush.
+	if (desc_info->durability == CS_DURABILITY_DSYNC && desc_info->fd >= 0) return;
+	if (desc_info->durability == CS_DURABILITY_CLOSE && !closing) return;
+	// A direct IO data source does its own fsync when it's closed, see FileAccessUnbufferedUnix::close.
+	if (closing && desc_info->direct_io) return;
+
+	int fd = desc_info->fd;
+	if (fd < 0) {
+		// The data source's buffers have to reach the OS first. Then they are synced through a descriptor of our own.
+		desc_info->internal_data_source->flush();
+		fd = open_sync_fd(desc_info->path, desc_info->mode);
 	}
-	// ERR_PRINTS("flushed file " + desc_info->path)
+
+#ifdef UNIX_ENABLED
+	if (fd < 0) {
+		ERR_PRINTS("Could not open " + desc_info->path + " to sync it to disk.");
+		return;
+	}
+
+	// File size changes only need fsync when the file is closed, fdatasync is enough for a flush.
+#if defined(__APPLE__)
+	int err = fsync(fd);
+#else
+	int err = closing ? fsync(fd) : fdatasync(fd);
+#endif
+	if (err < 0) ERR_PRINTS("Could not sync " + desc_info->path + " to disk.");
+
+	if (fd != desc_info->fd) ::close(fd);
+#endif
 }
 
 void FileCacheManager::do_flush_close_op(DescriptorInfo *desc_info) {
 	CRASH_COND(!(desc_info->internal_data_source));
 
-	for (int i = 0; i < desc_info->pages.size(); i++) {
-		if (frames[page_frame_map[desc_info->pages[i]]]->get_dirty()) {
-			do_store_op(desc_info, desc_info->pages[i], page_frame_map[desc_info->pages[i]], CS_GET_FILE_OFFSET_FROM_GUID(desc_info->pages[i]));
-		}
-	}
+	// Loads of this file may still be running on other workers, they need the descriptor until they finish.
+	desc_info->wait_for_loads();
+
+	write_back(desc_info);
+	sync_data_source(desc_info, true);
 
 	desc_info->internal_data_source->close();
 	memdelete(desc_info->internal_data_source);
 	desc_info->internal_data_source = NULL;
 
+#ifdef UNIX_ENABLED
+	// A direct IO file's descriptor was closed along with its data source.
+	if (desc_info->fd >= 0 && !desc_info->direct_io) {
+		::close(desc_info->fd);
+	}
+	desc_info->fd = -1;
+#endif
+
 	desc_info->dirty = false;
 	desc_info->valid = false;
 	// Posting on this semaphore allows FileCacheManager::close to continue executing.
@@ -395,57 +1209,49 @@ void FileCacheManager::do_flush_close_op(DescriptorInfo *desc_info) {
 // Perform a read operation.
 size_t FileCacheManager::read(const RID rid, void *const buffer, size_t length) {
 
-	DescriptorInfo **elem = files.getptr(RID_REF_TO_DD);
-
-	ERR_FAIL_COND_V_MSG(!elem, CS_MEM_VAL_BAD, "No such file")
+	FileHandle *handle = get_handle(rid);
 
-	DescriptorInfo *desc_info = *elem;
+	ERR_FAIL_COND_V_MSG(!handle, CS_MEM_VAL_BAD, "No such file")
+	DescriptorInfo *desc_info = handle->desc_info;
 	size_t read_length = length;
 
 	// If we try to read a region partially outside the file.
 	{
-		size_t end_offset = desc_info->offset + read_length;
+		size_t end_offset = handle->offset + read_length;
 		if (end_offset > desc_info->total_size) {
 			//// WARN_PRINTS("Reached EOF before reading " + itoh(read_length) + " bytes.");
-			read_length = desc_info->total_size - desc_info->offset;
+			read_length = desc_info->total_size - handle->offset;
+			handle->error = ERR_FILE_EOF;
 		}
 	}
 
-	size_t initial_start_offset = desc_info->offset;
+	size_t initial_start_offset = handle->offset;
 	size_t initial_end_offset = CS_GET_PAGE(initial_start_offset + CS_PAGE_SIZE);
 	page_id curr_page;
-	frame_id curr_frame;
 	size_t buffer_offset = 0;
 
 	// We need to handle the first and last frames differently,
 	// because the data to be copied may not start at a page boundary, and may not end on a page boundary.
 	{
 
-		//  WARN_PRINTS("Getting page for offset " + itoh(desc_info->offset + buffer_offset) + " with start offset " + itoh(desc_info->offset))
-		// Query for the page with the current offset.
-		CRASH_COND((curr_page = get_page_guid(desc_info, desc_info->offset + buffer_offset, true)) == (page_id)CS_MEM_VAL_BAD);
-		// Get frame mapped to page.
-		CRASH_COND((curr_frame = page_frame_map[curr_page]) == (frame_id)CS_MEM_VAL_BAD);
+		//  WARN_PRINTS("Getting page for offset " + itoh(handle->offset + buffer_offset) + " with start offset " + itoh(handle->offset))
+		// The page with the current offset. check_cache mapped it, but another thread may have evicted it since, see copy_from_page.
+		curr_page = get_page_guid(desc_info, handle->offset + buffer_offset, false);
 
 		// The end offset of the first page may not be greater than the start offset of the next page.
 		initial_end_offset = MIN(initial_start_offset + read_length, initial_end_offset);
 
 		//  WARN_PRINTS("Reading first page with values:\ninitial_start_offset: " + itoh(initial_start_offset) + "\ninitial_end_offset: " + itoh(initial_end_offset) + "\n read size: " + itoh(initial_end_offset - initial_start_offset));
 
-		{ // Lock the page holder for the operation.
-			//  WARN_PRINTS("Locking frame " + itoh(curr_frame) + " with page " + itoh(curr_page))
-
-			// wait before locking. Not after.
-			frames[curr_frame]->wait_ready(desc_info->ready_sem);
-			Frame::DataRead r(frames[curr_frame], desc_info);
-
-			// Here, frames[curr_frame].memory_region + CS_PARTIAL_SIZE(desc_info->offset)
-			//  gives us the address of the first byte to copy which may or may not be on a page boundary.
-			memcpy(
-					(uint8_t *)buffer + buffer_offset,
-					r.ptr() + CS_PARTIAL_SIZE(initial_start_offset),
-					initial_end_offset - initial_start_offset);
-		}
+		// Here, CS_PARTIAL_SIZE(handle->offset) gives us the offset in the frame
+		//  of the first byte to copy which may or may not be on a page boundary.
+		copy_from_page(
+				desc_info,
+				curr_page,
+				(uint8_t *)buffer + buffer_offset,
+				CS_PARTIAL_SIZE(initial_start_offset),
+				initial_end_offset - initial_start_offset,
+				false);
 
 		buffer_offset += (initial_end_offset - initial_start_offset);
 		read_length -= buffer_offset;
@@ -454,26 +1260,12 @@ size_t FileCacheManager::read(const RID rid, void *const buffer, size_t length)
 	// Pages in the middle must be copied in full.
 	while (buffer_offset < CS_GET_PAGE(length) && read_length > CS_PAGE_SIZE) {
 
-		// Query for the page with the current offset.
-		CRASH_COND((curr_page = get_page_guid(desc_info, desc_info->offset + buffer_offset, true)) == (page_id)CS_MEM_VAL_BAD);
-		// Get frame mapped to page.
-		CRASH_COND((curr_frame = page_frame_map[curr_page]) == (frame_id)CS_MEM_VAL_BAD);
+		// The page with the current offset.
+		curr_page = get_page_guid(desc_info, handle->offset + buffer_offset, false);
 
-		//  WARN_PRINTS("Reading intermediate page.\nbuffer_offset: " + itoh(buffer_offset) + "\nread_length: " + itoh(read_length) + "\ncurrent offset: " + itoh(desc_info->offset));
+		//  WARN_PRINTS("Reading intermediate page.\nbuffer_offset: " + itoh(buffer_offset) + "\nread_length: " + itoh(read_length) + "\ncurrent offset: " + itoh(handle->offset));
 
-		// Lock current frame.
-		{
-			//  WARN_PRINTS("Locking frame " + itoh(curr_frame) + " with page " + itoh(curr_page))
-
-			// wait before locking.
-			frames[curr_frame]->wait_ready(desc_info->ready_sem);
-			Frame::DataRead r(frames[curr_frame], desc_info);
-
-			memcpy(
-					(uint8_t *)buffer + buffer_offset,
-					r.ptr(),
-					CS_PAGE_SIZE);
-		}
+		copy_from_page(desc_info, curr_page, (uint8_t *)buffer + buffer_offset, 0, CS_PAGE_SIZE, false);
 
 		buffer_offset += CS_PAGE_SIZE;
 		read_length -= CS_PAGE_SIZE;
@@ -482,57 +1274,42 @@ size_t FileCacheManager::read(const RID rid, void *const buffer, size_t length)
 	// For final potentially partially filled page
 	if (read_length) {
 
-		// Query for the page with the current offset.
-		CRASH_COND((curr_page = get_page_guid(desc_info, desc_info->offset + buffer_offset, true)) == (page_id)CS_MEM_VAL_BAD);
-		// Get frame mapped to page.
-		CRASH_COND((curr_frame = page_frame_map[curr_page]) == (frame_id)CS_MEM_VAL_BAD);
+		// The page with the current offset.
+		curr_page = get_page_guid(desc_info, handle->offset + buffer_offset, false);
 
-		// This is if
-		size_t temp_read_len = MIN(read_length, frames[curr_frame]->get_used_size());
+		// The last page may hold less than read_length bytes.
+		size_t temp_read_len = copy_from_page(desc_info, curr_page, (uint8_t *)buffer + buffer_offset, 0, read_length, true);
 
 		//  WARN_PRINTS("Reading last page.\nread_length: " + itoh(read_length) + "\ntemp_read_len: " + itoh(temp_read_len));
 
-		{ // Lock last page for reading data.
-			//  WARN_PRINTS("Locking frame " + itoh(curr_frame) + " with page " + itoh(curr_page))
-
-			// wait before locking.
-			frames[curr_frame]->wait_ready(desc_info->ready_sem);
-			Frame::DataRead r(frames[curr_frame], desc_info);
-
-			memcpy(
-					(uint8_t *)buffer + buffer_offset,
-					r.ptr(),
-					temp_read_len);
-		}
 		buffer_offset += temp_read_len;
 		read_length -= temp_read_len;
 	}
 
 	if (read_length > 0) // WARN_PRINTS("Unread length: " + itoh(length - read_length) + " bytes.")
 
-		ERR_PRINTS("Read only " + itos(length - read_length) + " of " + itos(length) + "  bytes.\nFinal page: " + itoh(curr_page) + " Final frame: " + itoh(curr_frame));
+		ERR_PRINTS("Read only " + itos(length - read_length) + " of " + itos(length) + "  bytes.\nFinal page: " + itoh(curr_page));
 
 	// TODO: Document this. Reads that exceed EOF will cause the remaining buffer space to be zeroed out.
-	if ((desc_info->offset + length) / desc_info->total_size > 0) {
-		memset((uint8_t *)buffer + (desc_info->total_size - desc_info->offset), '\0', length - read_length);
+	if ((handle->offset + length) / desc_info->total_size > 0) {
+		memset((uint8_t *)buffer + (desc_info->total_size - handle->offset), '\0', length - read_length);
 	}
 
 	// We update the current offset at the end of the operation.
-	desc_info->offset += buffer_offset;
+	handle->offset += buffer_offset;
 
 	return buffer_offset;
 }
 
 // Similar to the read operation but opposite data flow.
 size_t FileCacheManager::write(const RID rid, const void *const data, size_t length) {
-	DescriptorInfo **elem = files.getptr(RID_REF_TO_DD);
+	FileHandle *handle = get_handle(rid);
 
-	ERR_FAIL_COND_V_MSG(!elem, CS_MEM_VAL_BAD, "No such file")
-
-	DescriptorInfo *desc_info = *elem;
+	ERR_FAIL_COND_V_MSG(!handle, CS_MEM_VAL_BAD, "No such file")
+	DescriptorInfo *desc_info = handle->desc_info;
 	size_t write_length = length;
 
-	size_t initial_start_offset = desc_info->offset;
+	size_t initial_start_offset = handle->offset;
 	size_t initial_end_offset = CS_GET_PAGE(initial_start_offset + CS_PAGE_SIZE);
 	page_id curr_page;
 	frame_id curr_frame;
@@ -542,26 +1319,27 @@ size_t FileCacheManager::write(const RID rid, const void *const data, size_t len
 	// because the data to be copied may not start at a page boundary, and may not end on a page boundary.
 	{
 
-		//// WARN_PRINTS("Getting page for offset " + itoh(desc_info->offset + data_offset) + " with start offset " + itoh(desc_info->offset))
-		// Query for the page with the current offset.
-		CRASH_COND((curr_page = get_page_guid(desc_info, desc_info->offset + data_offset, true)) == (page_id)CS_MEM_VAL_BAD);
-		// Get frame mapped to page.
-		CRASH_COND((curr_frame = page_frame_map[curr_page]) == (frame_id)CS_MEM_VAL_BAD);
+		//// WARN_PRINTS("Getting page for offset " + itoh(handle->offset + data_offset) + " with start offset " + itoh(handle->offset))
+		// The page with the current offset.
+		curr_page = get_page_guid(desc_info, handle->offset + data_offset, false);
 
 		// The end offset of the first page may not be greater than the start offset of the next page.
 		initial_end_offset = MIN(initial_start_offset + write_length, initial_end_offset);
 		//  WARN_PRINTS("Reading first page with values:\ninitial_start_offset: " + itoh(initial_start_offset) + "\ninitial_end_offset: " + itoh(initial_end_offset) + "\n read size: " + itoh(initial_end_offset - initial_start_offset));
 
-		{ // Lock the page holder for the operation.
+		{ // Lock the page's shard for the operation, so the page can't be evicted while we write to it.
+			Shard &s = get_shard(curr_page);
+			MutexLock ml(s.lock);
+			curr_frame = get_page_frame(s, desc_info, curr_page);
 
 			// wait before locking. not after.
-			frames[curr_frame]->wait_ready(desc_info->ready_sem);
-			Frame::DataWrite w(frames[curr_frame], desc_info, false);
+			frames[curr_frame]->wait_ready();
+			Frame::DataWrite w(frames[curr_frame], false);
 
-			// Here, frames[curr_frame].memory_region + PARTIAL_SIZE(desc_info->offset)
+			// Here, frames[curr_frame].memory_region + PARTIAL_SIZE(handle->offset)
 			//  gives us the address of the first byte to copy which may or may not be on a page boundary.
 			//
-			// We can copy only CS_PAGE_SIZE - PARTIAL_SIZE(desc_info->offset) which gives us the number
+			// We can copy only CS_PAGE_SIZE - PARTIAL_SIZE(handle->offset) which gives us the number
 			//  of bytes from the current offset to the end of the page.
 			memcpy(
 					w.ptr() + CS_PARTIAL_SIZE(initial_start_offset),
@@ -577,6 +1355,7 @@ size_t FileCacheManager::write(const RID rid, const void *const data, size_t len
 				frames[curr_frame]->set_used_size(CS_PARTIAL_SIZE(initial_end_offset));
 			}
 			frames[curr_frame]->set_dirty_true();
+			desc_info->pages.set_dirty(curr_page, true);
 		}
 
 		// If we've reached here, it means the cached file is dirty.
@@ -588,19 +1367,21 @@ size_t FileCacheManager::write(const RID rid, const void *const data, size_t len
 	// Pages in the middle must be copied in full.
 	while (data_offset < CS_GET_PAGE(write_length) && write_length > CS_PAGE_SIZE) {
 
-		// Query for the page with the current offset.
-		CRASH_COND((curr_page = get_page_guid(desc_info, desc_info->offset + data_offset, true)) == (page_id)CS_MEM_VAL_BAD);
-		// Get frame mapped to page.
-		CRASH_COND((curr_frame = page_frame_map[curr_page]) == (frame_id)CS_MEM_VAL_BAD);
+		// The page with the current offset.
+		curr_page = get_page_guid(desc_info, handle->offset + data_offset, false);
 
-		// Here, frames[curr_frame].memory_region + PARTIAL_SIZE(desc_info->offset) gives us the start
-		//  WARN_PRINTS("Writing intermediate page. data_offset: " + itoh(data_offset) + "\nwrite_length: " + itoh(write_length) + "\ncurrent offset: " + itoh(desc_info->offset));
+		// Here, frames[curr_frame].memory_region + PARTIAL_SIZE(handle->offset) gives us the start
+		//  WARN_PRINTS("Writing intermediate page. data_offset: " + itoh(data_offset) + "\nwrite_length: " + itoh(write_length) + "\ncurrent offset: " + itoh(handle->offset));
 
-		// Lock current page holder.
+		// Lock the current page's shard.
 		{
+			Shard &s = get_shard(curr_page);
+			MutexLock ml(s.lock);
+			curr_frame = get_page_frame(s, desc_info, curr_page);
+
 			// wait before locking.
-			frames[curr_frame]->wait_ready(desc_info->ready_sem);
-			Frame::DataWrite w(frames[curr_frame], desc_info, false);
+			frames[curr_frame]->wait_ready();
+			Frame::DataWrite w(frames[curr_frame], false);
 
 			memcpy(
 					w.ptr(),
@@ -608,6 +1389,7 @@ size_t FileCacheManager::write(const RID rid, const void *const data, size_t len
 					CS_PAGE_SIZE);
 
 			frames[curr_frame]->set_dirty_true();
+			desc_info->pages.set_dirty(curr_page, true);
 		}
 
 		data_offset += CS_PAGE_SIZE;
@@ -617,19 +1399,22 @@ size_t FileCacheManager::write(const RID rid, const void *const data, size_t len
 	// For final potentially partially filled page
 	if (write_length) {
 
-		// Query for the page with the current offset.
-		CRASH_COND((curr_page = get_page_guid(desc_info, desc_info->offset + data_offset, true)) == (page_id)CS_MEM_VAL_BAD);
-		// Get frame mapped to page.
-		CRASH_COND((curr_frame = page_frame_map[curr_page]) == (frame_id)CS_MEM_VAL_BAD);
+		// The page with the current offset.
+		curr_page = get_page_guid(desc_info, handle->offset + data_offset, false);
 
-		size_t temp_write_len = CLAMP(write_length, 0, frames[curr_frame]->get_used_size());
-		//  WARN_PRINTS("Writing last page.\nwrite_length: " + itoh(write_length) + "\ntemp_write_len: " + itoh(temp_write_len));
+		size_t temp_write_len;
 
-		{ // Lock last page for reading data.
+		{ // Lock the last page's shard.
+			Shard &s = get_shard(curr_page);
+			MutexLock ml(s.lock);
+			curr_frame = get_page_frame(s, desc_info, curr_page);
 
 			// wait before locking.
-			frames[curr_frame]->wait_ready(desc_info->ready_sem);
-			Frame::DataWrite w(frames[curr_frame], desc_info, false);
+			frames[curr_frame]->wait_ready();
+			Frame::DataWrite w(frames[curr_frame], false);
+
+			temp_write_len = CLAMP(write_length, 0, frames[curr_frame]->get_used_size());
+			//  WARN_PRINTS("Writing last page.\nwrite_length: " + itoh(write_length) + "\ntemp_write_len: " + itoh(temp_write_len));
 
 			memcpy(
 					w.ptr(),
@@ -645,13 +1430,14 @@ size_t FileCacheManager::write(const RID rid, const void *const data, size_t len
 			}
 
 			frames[curr_frame]->set_dirty_true();
+			desc_info->pages.set_dirty(curr_page, true);
 		}
 		data_offset += temp_write_len;
 		write_length -= temp_write_len;
 	}
 	if (write_length > 0) ERR_PRINTS("Wrote only: " + itos(length - write_length) + " bytes.")
 
-	desc_info->offset += data_offset;
+	handle->offset += data_offset;
 
 	return data_offset;
 }
@@ -659,12 +1445,11 @@ size_t FileCacheManager::write(const RID rid, const void *const data, size_t len
 // The seek operation just uses the POSIX seek modes.
 size_t FileCacheManager::seek(const RID rid, int64_t new_offset, int mode) {
 
-	DescriptorInfo **elem = files.getptr(RID_REF_TO_DD);
-
-	ERR_FAIL_COND_V_MSG(!elem, CS_MEM_VAL_BAD, "No such file")
+	FileHandle *handle = get_handle(rid);
 
-	DescriptorInfo *desc_info = *elem;
-	size_t curr_offset = desc_info->offset;
+	ERR_FAIL_COND_V_MSG(!handle, CS_MEM_VAL_BAD, "No such file")
+	DescriptorInfo *desc_info = handle->desc_info;
+	size_t curr_offset = handle->offset;
 	size_t end_offset = desc_info->total_size;
 	int64_t eff_offset = 0;
 	switch (mode) {
@@ -699,58 +1484,57 @@ size_t FileCacheManager::seek(const RID rid, int64_t new_offset, int mode) {
 	 * of waiting for a load to occur.
 	 *
 	 * Maybe this behaviour could be toggled.
+	 *
+	 * Readahead queued for a file with more than one handle
+	 * may belong to another handle, so it is left alone then.
 	 */
-	{
-		// Lock to prevent any other threads from changing the queue.
-		MutexLock ml(op_queue.mut);
-		if (!op_queue.queue.empty()) {
-
-			//  WARN_PRINT("Acquired client side queue lock.");
-
-			// Look for load ops with the same file that are farther than a threshold distance away from our effective offset and remove them.
-			for (List<CtrlOp>::Element *i = op_queue.queue.front(); i;) {
-				if (
-						// If the operation is being performed on the same file...
-						i->get().di->guid_prefix == desc_info->guid_prefix &&
-						// And the type of operation is a load...
-						i->get().type == CtrlOp::LOAD &&
-						// And the distance between the pages in the vicinity of the new region and the current offset is large enough...
-						ABSDIFF(
-								eff_offset + (CS_FIFO_THRESH_DEFAULT * CS_PAGE_SIZE / 2),
-								(int64_t)i->get().offset) > CS_FIFO_THRESH_DEFAULT) {
-
-					CtrlOp l = i->get();
-
-					// We can unmap the pages.
-					//  WARN_PRINTS("Unmapping out of range page " + itoh(CS_GET_PAGE(l.offset)) + " and frame " + itoh(l.frame) + " for file with RID " + itoh(rid.get_id()));
-
-					untrack_page(l.di, CS_GET_PAGE(l.offset));
-
-					List<CtrlOp>::Element *next = i->next();
-					// FIXME: Why is this causing an exception on windows?
-					i->erase();
-					i = next;
-
-				} else
-					i = i->next();
+	for (int q = 0; desc_info->handle_count.load(std::memory_order_relaxed) == 1 && q < desc_info->load_queues.size(); ++q) {
+		CtrlQueue *queue = desc_info->load_queues[q];
+		// Only speculative loads are dropped. Nobody waits on them, and demand loads are always for pages someone is about to read.
+		CtrlRing &readahead = queue->queue[CtrlOp::PRIORITY_READAHEAD];
+
+		// Look for load ops with the same file that are farther than a threshold distance away from our effective offset and cancel them.
+		for (uint64_t pos = readahead.head(); pos != readahead.tail(); ++pos) {
+			CtrlOp l;
+			if (
+					readahead.peek(pos, l) &&
+					// If the operation is being performed on the same file...
+					l.di->guid_prefix == desc_info->guid_prefix &&
+					// And the type of operation is a load...
+					l.type == CtrlOp::LOAD &&
+					// And the distance between the pages in the vicinity of the new region and the current offset is large enough...
+					ABSDIFF(
+							eff_offset + (CS_FIFO_THRESH_DEFAULT * CS_PAGE_SIZE / 2),
+							(int64_t)l.offset) > CS_FIFO_THRESH_DEFAULT * CS_PAGE_SIZE &&
+					// And no worker has picked it up yet...
+					readahead.cancel(pos)) {
+
+				// We can unmap the pages.
+				//  WARN_PRINTS("Unmapping out of range page " + itoh(CS_GET_PAGE(l.offset)) + " and frame " + itoh(l.frame) + " for file with RID " + itoh(rid.get_id()));
+
+				page_id curr_page = get_page_guid(l.di, l.offset, false);
+				Shard &s = get_shard(curr_page);
+				MutexLock ml(s.lock);
+				untrack_page(s, l.di, curr_page);
+				l.di->finish_load();
 			}
 		}
 		//// WARN_PRINT("Released client side queue lock.");
 	}
 
 	// Update the offset.
-	desc_info->offset = eff_offset;
+	handle->offset = eff_offset;
+	handle->error = OK;
 
 	return eff_offset;
 }
 
 size_t FileCacheManager::get_len(const RID rid) const {
 
-	DescriptorInfo *const *elem = files.getptr(RID_REF_TO_DD);
-
-	ERR_FAIL_COND_V_MSG(!elem, CS_MEM_VAL_BAD, "No such file");
+	FileHandle *handle = get_handle(rid);
 
-	DescriptorInfo *desc_info = *elem;
+	ERR_FAIL_COND_V_MSG(!handle, CS_MEM_VAL_BAD, "No such file");
+	DescriptorInfo *desc_info = handle->desc_info;
 
 	size_t size = desc_info->internal_data_source->get_len();
 	if (size > desc_info->total_size) {
@@ -769,81 +1553,207 @@ bool FileCacheManager::file_exists(const String &p_name) const {
 
 bool FileCacheManager::eof_reached(const RID rid) const {
 
-	DescriptorInfo *const *elem = files.getptr(RID_REF_TO_DD);
+	FileHandle *handle = get_handle(rid);
+
+	ERR_FAIL_COND_V_MSG(!handle, true, "No such file");
+
+	// The data source's own position belongs to the IO workers, so it says nothing about this handle.
+	return handle->error == ERR_FILE_EOF;
+}
+
+Error FileCacheManager::get_error(const RID rid) const {
+
+	FileHandle *handle = get_handle(rid);
+
+	ERR_FAIL_COND_V_MSG(!handle, ERR_FILE_CANT_OPEN, "No such file");
 
-	ERR_FAIL_COND_V_MSG(!elem, true, "No such file");
+	// An IO error on the file outweighs reaching its end.
+	return handle->desc_info->io_error != OK ? handle->desc_info->io_error : handle->error;
+}
 
-	return (*elem)->internal_data_source->eof_reached();
+page_id FileCacheManager::take_page(FrameList &list, frame_id frame) {
+	list.remove(frame);
+	return frames[frame]->get_owning_page();
 }
 
-void FileCacheManager::rmp_lru(page_id curr_page) {
+void FileCacheManager::rmp_lru(Shard &s, page_id curr_page) {
 	//  WARN_PRINTS("Removing LRU page " + itoh(curr_page));
-	if (lru_cached_pages.find(curr_page) != NULL)
-		lru_cached_pages.erase(curr_page);
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	if (s.lru_cached_pages.has(curr_frame))
+		s.lru_cached_pages.remove(curr_frame);
 }
 
-void FileCacheManager::rmp_fifo(page_id curr_page) {
+void FileCacheManager::rmp_fifo(Shard &s, page_id curr_page) {
 	//  WARN_PRINTS("Removing FIFO page " + itoh(curr_page));
-	if (fifo_cached_pages.find(curr_page) != NULL)
-		fifo_cached_pages.erase(curr_page);
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	if (s.fifo_cached_pages.has(curr_frame))
+		s.fifo_cached_pages.remove(curr_frame);
 }
 
-void FileCacheManager::rmp_keep(page_id curr_page) {
+void FileCacheManager::rmp_keep(Shard &s, page_id curr_page) {
 	//  WARN_PRINTS("Removing permanent page " + itoh(curr_page));
-	if (permanent_cached_pages.find(curr_page) != NULL)
-		permanent_cached_pages.erase(curr_page);
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	if (s.permanent_cached_pages.has(curr_frame))
+		s.permanent_cached_pages.remove(curr_frame);
 }
 
-void FileCacheManager::ip_lru(page_id curr_page) {
+void FileCacheManager::rmp_clock(Shard &s, page_id curr_page) {
+	//  WARN_PRINTS("Removing CLOCK page " + itoh(curr_page));
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	if (s.clock_cached_pages.has(curr_frame)) {
+		if (s.clock_hand == curr_frame)
+			s.clock_hand = s.clock_cached_pages.size() > 1 ? clock_advance(s, curr_frame) : CS_MEM_VAL_BAD;
+		s.clock_cached_pages.remove(curr_frame);
+	}
+}
+
+void FileCacheManager::rmp_arc(Shard &s, page_id curr_page) {
+	//  WARN_PRINTS("Removing ARC page " + itoh(curr_page));
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	if (s.arc_t1.has(curr_frame))
+		s.arc_t1.remove(curr_frame);
+	else if (s.arc_t2.has(curr_frame))
+		s.arc_t2.remove(curr_frame);
+}
+
+void FileCacheManager::rmp_twoq(Shard &s, page_id curr_page) {
+	//  WARN_PRINTS("Removing 2Q page " + itoh(curr_page));
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	if (s.twoq_a1in.has(curr_frame))
+		s.twoq_a1in.remove(curr_frame);
+	else if (s.twoq_am.has(curr_frame))
+		s.twoq_am.remove(curr_frame);
+}
+
+void FileCacheManager::ip_lru(Shard &s, page_id curr_page) {
 	//  WARN_PRINT("LRU cached.");
-	lru_cached_pages.insert(curr_page);
+	s.lru_cached_pages.push_front(s.page_frame_map.get(curr_page));
 }
 
-void FileCacheManager::ip_fifo(page_id curr_page) {
+void FileCacheManager::ip_fifo(Shard &s, page_id curr_page) {
 	//  WARN_PRINT("FIFO cached.");
-	fifo_cached_pages.push_front(curr_page);
+	s.fifo_cached_pages.push_front(s.page_frame_map.get(curr_page));
 }
 
-void FileCacheManager::ip_keep(page_id curr_page) {
+void FileCacheManager::ip_keep(Shard &s, page_id curr_page) {
 	//  WARN_PRINT("Permanent cached.");
-	permanent_cached_pages.insert(curr_page);
+	s.permanent_cached_pages.push_front(s.page_frame_map.get(curr_page));
 }
 
-void FileCacheManager::up_lru(page_id curr_page) {
+// New pages go just behind the hand so they get a full sweep before they can be evicted.
+void FileCacheManager::ip_clock(Shard &s, page_id curr_page) {
+	//  WARN_PRINT("CLOCK cached.");
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	frames[curr_frame]->set_referenced(false);
+	s.clock_cached_pages.insert_before(s.clock_hand, curr_frame);
+	if (s.clock_hand == (frame_id)CS_MEM_VAL_BAD)
+		s.clock_hand = curr_frame;
+}
+
+bool FileCacheManager::arc_adapt(Shard &s, page_id curr_page) {
+	if (s.arc_b1.has(curr_page)) {
+		// We evicted a recently used page too early, so make room for more of them.
+		uint32_t delta = MAX(s.arc_b2.size() / MAX(s.arc_b1.size(), 1u), 1u);
+		s.arc_p = MIN(s.arc_p + delta, (uint32_t)s.cached_frames);
+		s.arc_b1.remove(curr_page);
+		return true;
+	} else if (s.arc_b2.has(curr_page)) {
+		// We evicted a frequently used page too early, so make room for more of them.
+		uint32_t delta = MAX(s.arc_b1.size() / MAX(s.arc_b2.size(), 1u), 1u);
+		s.arc_p = s.arc_p > delta ? s.arc_p - delta : 0;
+		s.arc_b2.remove(curr_page);
+		return true;
+	}
+	return false;
+}
+
+// Pages seen for the first time go to T1. Pages we remember evicting have been used at least twice, so they go to T2.
+void FileCacheManager::ip_arc(Shard &s, page_id curr_page) {
+	//  WARN_PRINT("ARC cached.");
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+
+	bool ghost_hit = s.arc_ghost_hit == curr_page || arc_adapt(s, curr_page);
+	s.arc_ghost_hit = CS_MEM_VAL_BAD;
+
+	if (ghost_hit)
+		s.arc_t2.push_front(curr_frame);
+	else
+		s.arc_t1.push_front(curr_frame);
+}
+
+// Readiness is only ever set by the load path, a hit must not mark a page that is still loading as ready.
+void FileCacheManager::up_lru(Shard &s, page_id curr_page) {
 	//  WARN_PRINTS("Updating LRU page " + itoh(curr_page));
-	lru_cached_pages.erase(curr_page);
-	frames[page_frame_map[curr_page]]->set_last_use(step).set_ready_true(files[curr_page >> 40]->ready_sem);
-	lru_cached_pages.insert(curr_page);
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	frames[curr_frame]->set_last_use(s.step);
+	s.lru_cached_pages.move_to_front(curr_frame);
 }
-void FileCacheManager::up_fifo(page_id curr_page) {
+void FileCacheManager::up_fifo(Shard &s, page_id curr_page) {
 	//  WARN_PRINTS("Updating FIFO page " + itoh(curr_page));
-	frames[page_frame_map[curr_page]]->set_last_use(step).set_ready_true(files[curr_page >> 40]->ready_sem);
+	frames[s.page_frame_map.get(curr_page)]->set_last_use(s.step);
 }
-void FileCacheManager::up_keep(page_id curr_page) {
+void FileCacheManager::up_keep(Shard &s, page_id curr_page) {
 	//  WARN_PRINTS("Updating Permanent page " + itoh(curr_page));
-	permanent_cached_pages.erase(curr_page);
-	frames[page_frame_map[curr_page]]->set_last_use(step).set_ready_true(files[curr_page >> 40]->ready_sem);
-	permanent_cached_pages.insert(curr_page);
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	frames[curr_frame]->set_last_use(s.step);
+	s.permanent_cached_pages.move_to_front(curr_frame);
+}
+
+// A hit under CLOCK is a single store, the frame is not moved.
+void FileCacheManager::up_clock(Shard &s, page_id curr_page) {
+	//  WARN_PRINTS("Updating CLOCK page " + itoh(curr_page));
+	frames[s.page_frame_map.get(curr_page)]->set_referenced(true);
+}
+
+// Pages we remember evicting from A1in were reused after their first pass, so they go straight to Am.
+void FileCacheManager::ip_twoq(Shard &s, page_id curr_page) {
+	//  WARN_PRINT("2Q cached.");
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+
+	if (s.twoq_a1out.remove(curr_page))
+		s.twoq_am.push_front(curr_frame);
+	else
+		s.twoq_a1in.push_front(curr_frame);
+}
+
+// A second use promotes a page from T1 to T2.
+void FileCacheManager::up_arc(Shard &s, page_id curr_page) {
+	//  WARN_PRINTS("Updating ARC page " + itoh(curr_page));
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	frames[curr_frame]->set_last_use(s.step);
+	if (s.arc_t1.has(curr_frame)) {
+		s.arc_t1.remove(curr_frame);
+		s.arc_t2.push_front(curr_frame);
+	} else if (s.arc_t2.has(curr_frame)) {
+		s.arc_t2.move_to_front(curr_frame);
+	}
+}
+
+// Hits in A1in don't promote the page, that only happens if it comes back after being evicted.
+void FileCacheManager::up_twoq(Shard &s, page_id curr_page) {
+	//  WARN_PRINTS("Updating 2Q page " + itoh(curr_page));
+	frame_id curr_frame = s.page_frame_map.get(curr_page);
+	frames[curr_frame]->set_last_use(s.step);
+	if (s.twoq_am.has(curr_frame))
+		s.twoq_am.move_to_front(curr_frame);
 }
 
 /**
  * LRU replacement policy.
  */
-page_id FileCacheManager::rp_lru(DescriptorInfo *desc_info) {
+page_id FileCacheManager::rp_lru(Shard &s, DescriptorInfo *desc_info, page_id incoming_page) {
 
 	page_id page_to_evict = CS_MEM_VAL_BAD;
 
 	bool cond_flag = false;
 
-	if (lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
+	if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
 
-		Frame *f = frames[page_frame_map[lru_cached_pages.back()->get()]];
+		Frame *f = frames[s.lru_cached_pages.back()];
 
-		if (step - f->get_last_use() > CS_LRU_THRESH_DEFAULT) {
+		if (s.step - f->get_last_use() > CS_LRU_THRESH_DEFAULT) {
 
-			page_to_evict = (rng.randi() % 2) ? lru_cached_pages.back()->get() : lru_cached_pages.back()->prev()->get();
-
-			lru_cached_pages.erase(page_to_evict);
+			page_to_evict = take_page(s.lru_cached_pages, (s.rng.randi() % 2) ? s.lru_cached_pages.back() : s.lru_cached_pages.prev(s.lru_cached_pages.back()));
 
 		} else
 			cond_flag = true;
@@ -851,196 +1761,634 @@ page_id FileCacheManager::rp_lru(DescriptorInfo *desc_info) {
 
 	if (cond_flag) {
 
-		if (fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
+		if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
+
+			page_to_evict = take_page(s.fifo_cached_pages, s.fifo_cached_pages.back());
+
+		} else if (s.lru_cached_pages.size() > 2) {
+
+			page_to_evict = take_page(s.lru_cached_pages, s.lru_cached_pages.back());
+
+		} else {
+			CRASH_NOW_MSG("CANNOT ADD LRU PAGE TO CACHE; INSUFFICIENT SPACE.")
+		}
+	}
+
+	return page_to_evict;
+}
+
+page_id FileCacheManager::rp_keep(Shard &s, DescriptorInfo *desc_info, page_id incoming_page) {
 
-			page_to_evict = fifo_cached_pages.back()->get();
+	page_id page_to_evict = CS_MEM_VAL_BAD;
 
-			fifo_cached_pages.erase(fifo_cached_pages.back());
+	if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
 
-		} else if (lru_cached_pages.size() > 2) {
+		page_to_evict = take_page(s.fifo_cached_pages, s.fifo_cached_pages.back());
 
-			page_to_evict = lru_cached_pages.back()->get();
+	} else if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
 
-			lru_cached_pages.erase(page_to_evict);
+		Frame *f = frames[s.lru_cached_pages.back()];
+
+		// The difference between the step and the last_use value of a frame gives us the frame's age.
+		if (s.step - f->get_last_use() > CS_LRU_THRESH_DEFAULT) {
+
+			page_to_evict = take_page(s.lru_cached_pages, (s.rng.randi() % 2) ? s.lru_cached_pages.back() : s.lru_cached_pages.prev(s.lru_cached_pages.back()));
 
 		} else {
-			CRASH_NOW_MSG("CANNOT ADD LRU PAGE TO CACHE; INSUFFICIENT SPACE.")
+			page_to_evict = take_page(s.lru_cached_pages, s.lru_cached_pages.back());
 		}
+
+	} else if (s.permanent_cached_pages.size() > CS_KEEP_THRESH_DEFAULT / 2) {
+
+		page_to_evict = take_page(s.permanent_cached_pages, (s.rng.randi() % 2) ? s.permanent_cached_pages.back() : s.permanent_cached_pages.prev(s.permanent_cached_pages.back()));
+
+	} else {
+		CRASH_NOW_MSG("CANNOT ADD PERMANENT PAGE TO CACHE; INSUFFICIENT SPACE.")
 	}
 
 	return page_to_evict;
 }
 
-page_id FileCacheManager::rp_keep(DescriptorInfo *desc_info) {
+page_id FileCacheManager::rp_fifo(Shard &s, DescriptorInfo *desc_info, page_id incoming_page) {
 
 	page_id page_to_evict = CS_MEM_VAL_BAD;
 
-	if (fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
+	if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
 
-		page_to_evict = fifo_cached_pages.back()->get();
+		page_to_evict = take_page(s.fifo_cached_pages, s.fifo_cached_pages.back());
 
-		fifo_cached_pages.erase(fifo_cached_pages.back());
+	} else if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
 
-	} else if (lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
+		Frame *f = frames[s.lru_cached_pages.back()];
 
-		Frame *f = frames[page_frame_map[lru_cached_pages.back()->get()]];
+		if (s.step - f->get_last_use() > CS_LRU_THRESH_DEFAULT) {
 
-		// The difference between the step and the last_use value of a frame gives us the frame's age.
-		if (step - f->get_last_use() > CS_LRU_THRESH_DEFAULT) {
+			page_to_evict = take_page(s.lru_cached_pages, (s.rng.randi() % 2) ? s.lru_cached_pages.back() : s.lru_cached_pages.prev(s.lru_cached_pages.back()));
+		}
+	} else if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT / 2) {
+
+		page_to_evict = take_page(s.fifo_cached_pages, s.fifo_cached_pages.back());
 
-			page_to_evict = (rng.randi() % 2) ? lru_cached_pages.back()->get() : permanent_cached_pages.back()->prev()->get();
+	} else {
+		CRASH_NOW_MSG("CANNOT ADD FIFO PAGE TO CACHE; INSUFFICIENT SPACE.")
+	}
 
-			lru_cached_pages.erase(page_to_evict);
+	return page_to_evict;
+}
 
-		} else {
-			page_to_evict = lru_cached_pages.back()->get();
-			lru_cached_pages.erase(page_to_evict);
+/**
+ * CLOCK replacement policy.
+ *
+ * The hand sweeps the clock, clearing reference bits, until it finds a frame that hasn't been used since the last sweep.
+ */
+page_id FileCacheManager::rp_clock(Shard &s, DescriptorInfo *desc_info, page_id incoming_page) {
+
+	page_id page_to_evict = CS_MEM_VAL_BAD;
+
+	if (s.clock_cached_pages.size() > CS_CLOCK_THRESH_DEFAULT) {
+
+		// After two full turns every reference bit has been cleared, so this always terminates.
+		for (uint32_t i = 0; i <= 2 * s.clock_cached_pages.size(); ++i) {
+			Frame *f = frames[s.clock_hand];
+
+			if (!f->get_referenced()) break;
+
+			f->set_referenced(false);
+			s.clock_hand = clock_advance(s, s.clock_hand);
 		}
 
-	} else if (permanent_cached_pages.size() > CS_KEEP_THRESH_DEFAULT / 2) {
+		frame_id frame_to_evict = s.clock_hand;
+		s.clock_hand = s.clock_cached_pages.size() > 1 ? clock_advance(s, frame_to_evict) : CS_MEM_VAL_BAD;
+		page_to_evict = take_page(s.clock_cached_pages, frame_to_evict);
+
+	} else if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
 
-		page_to_evict = (rng.randi() % 2) ? permanent_cached_pages.back()->get() : permanent_cached_pages.back()->prev()->get();
+		page_to_evict = take_page(s.fifo_cached_pages, s.fifo_cached_pages.back());
 
-		permanent_cached_pages.erase(page_to_evict);
+	} else if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
+
+		page_to_evict = take_page(s.lru_cached_pages, s.lru_cached_pages.back());
+
+	} else if (s.clock_cached_pages.size() > CS_CLOCK_THRESH_DEFAULT / 2) {
+
+		frame_id frame_to_evict = s.clock_hand;
+		s.clock_hand = s.clock_cached_pages.size() > 1 ? clock_advance(s, frame_to_evict) : CS_MEM_VAL_BAD;
+		page_to_evict = take_page(s.clock_cached_pages, frame_to_evict);
 
 	} else {
-		CRASH_NOW_MSG("CANNOT ADD PERMANENT PAGE TO CACHE; INSUFFICIENT SPACE.")
+		CRASH_NOW_MSG("CANNOT ADD CLOCK PAGE TO CACHE; INSUFFICIENT SPACE.")
 	}
 
 	return page_to_evict;
 }
 
-page_id FileCacheManager::rp_fifo(DescriptorInfo *desc_info) {
+/**
+ * ARC replacement policy.
+ *
+ * Evicts from T1 while it is larger than its target size p, otherwise from T2.
+ * The evicted page is remembered in the matching ghost list.
+ */
+page_id FileCacheManager::rp_arc(Shard &s, DescriptorInfo *desc_info, page_id incoming_page) {
 
 	page_id page_to_evict = CS_MEM_VAL_BAD;
 
-	if (fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
+	// p must reflect the incoming page before we pick a victim, ip_arc will see that it was a ghost hit.
+	bool in_b2 = s.arc_b2.has(incoming_page);
+	if (arc_adapt(s, incoming_page))
+		s.arc_ghost_hit = incoming_page;
+
+	if (s.arc_t1.size() + s.arc_t2.size() > CS_ARC_THRESH_DEFAULT) {
+
+		if (!s.arc_t1.empty() && (s.arc_t1.size() > s.arc_p || (in_b2 && s.arc_t1.size() == s.arc_p) || s.arc_t2.empty())) {
+
+			page_to_evict = take_page(s.arc_t1, s.arc_t1.back());
+			s.arc_b1.push_front(page_to_evict);
+
+		} else {
+
+			page_to_evict = take_page(s.arc_t2, s.arc_t2.back());
+			s.arc_b2.push_front(page_to_evict);
+		}
+
+	} else if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
+
+		page_to_evict = take_page(s.fifo_cached_pages, s.fifo_cached_pages.back());
+
+	} else if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
+
+		page_to_evict = take_page(s.lru_cached_pages, s.lru_cached_pages.back());
+
+	} else if (s.arc_t1.size() + s.arc_t2.size() > CS_ARC_THRESH_DEFAULT / 2) {
+
+		page_to_evict = s.arc_t1.empty() ? take_page(s.arc_t2, s.arc_t2.back()) : take_page(s.arc_t1, s.arc_t1.back());
+
+	} else {
+		CRASH_NOW_MSG("CANNOT ADD ARC PAGE TO CACHE; INSUFFICIENT SPACE.")
+	}
+
+	return page_to_evict;
+}
+
+/**
+ * 2Q replacement policy.
+ *
+ * Evicts from A1in while it holds more than its share of the resident pages, remembering the page in A1out.
+ * Otherwise evicts the least recently used page in Am.
+ */
+page_id FileCacheManager::rp_twoq(Shard &s, DescriptorInfo *desc_info, page_id incoming_page) {
 
-		page_to_evict = fifo_cached_pages.back()->get();
+	page_id page_to_evict = CS_MEM_VAL_BAD;
 
-		fifo_cached_pages.back()->erase();
+	uint32_t resident = s.twoq_a1in.size() + s.twoq_am.size();
+	uint32_t kin = MAX(resident / CS_TWOQ_KIN_DIVISOR, 1u);
 
-	} else if (lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
+	if (resident > CS_TWOQ_THRESH_DEFAULT) {
 
-		Frame *f = frames.operator[](page_frame_map.operator[](lru_cached_pages.back()->get()));
+		if (!s.twoq_a1in.empty() && (s.twoq_a1in.size() > kin || s.twoq_am.empty())) {
 
-		if (step - f->get_last_use() > CS_LRU_THRESH_DEFAULT) {
+			page_to_evict = take_page(s.twoq_a1in, s.twoq_a1in.back());
+			s.twoq_a1out.push_front(page_to_evict);
 
-			page_to_evict = (rng.randi() % 2) ? lru_cached_pages.back()->get() : lru_cached_pages.back()->prev()->get();
+		} else {
 
-			lru_cached_pages.erase(page_to_evict);
+			page_to_evict = take_page(s.twoq_am, s.twoq_am.back());
 		}
-	} else if (fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT / 2) {
 
-		page_to_evict = fifo_cached_pages.back()->get();
+	} else if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT) {
+
+		page_to_evict = take_page(s.fifo_cached_pages, s.fifo_cached_pages.back());
 
-		fifo_cached_pages.back()->erase();
+	} else if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT) {
+
+		page_to_evict = take_page(s.lru_cached_pages, s.lru_cached_pages.back());
+
+	} else if (resident > CS_TWOQ_THRESH_DEFAULT / 2) {
+
+		page_to_evict = s.twoq_a1in.empty() ? take_page(s.twoq_am, s.twoq_am.back()) : take_page(s.twoq_a1in, s.twoq_a1in.back());
 
 	} else {
-		CRASH_NOW_MSG("CANNOT ADD FIFO PAGE TO CACHE; INSUFFICIENT SPACE.")
+		CRASH_NOW_MSG("CANNOT ADD 2Q PAGE TO CACHE; INSUFFICIENT SPACE.")
 	}
 
 	return page_to_evict;
 }
 
-bool FileCacheManager::get_page_or_do_paging_op(DescriptorInfo *desc_info, size_t offset) {
+// Victim peeks report the page the matching replacement policy would most likely evict next,
+// without changing any policy state. Random choices made by the policies are ignored.
+
+page_id FileCacheManager::vp_lru(const Shard &s, page_id incoming_page) const {
+	if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT && s.step - frames[s.lru_cached_pages.back()]->get_last_use() > CS_LRU_THRESH_DEFAULT)
+		return page_at(s.lru_cached_pages.back());
+	if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT)
+		return page_at(s.fifo_cached_pages.back());
+	return page_at(s.lru_cached_pages.back());
+}
+
+page_id FileCacheManager::vp_fifo(const Shard &s, page_id incoming_page) const {
+	if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT || s.lru_cached_pages.size() <= CS_LRU_THRESH_DEFAULT)
+		return page_at(s.fifo_cached_pages.back());
+	return page_at(s.lru_cached_pages.back());
+}
+
+page_id FileCacheManager::vp_keep(const Shard &s, page_id incoming_page) const {
+	if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT)
+		return page_at(s.fifo_cached_pages.back());
+	if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT)
+		return page_at(s.lru_cached_pages.back());
+	return page_at(s.permanent_cached_pages.back());
+}
+
+page_id FileCacheManager::vp_clock(const Shard &s, page_id incoming_page) const {
+	if (s.clock_cached_pages.size() > CS_CLOCK_THRESH_DEFAULT) {
+		// The first unreferenced frame from the hand onwards, or the hand itself if every frame is referenced.
+		frame_id f = s.clock_hand;
+		for (uint32_t i = 0; i < s.clock_cached_pages.size(); ++i) {
+			if (!frames[f]->get_referenced()) return page_at(f);
+			f = s.clock_cached_pages.next(f);
+			if (f == (frame_id)CS_MEM_VAL_BAD) f = s.clock_cached_pages.front();
+		}
+		return page_at(s.clock_hand);
+	}
+	if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT)
+		return page_at(s.fifo_cached_pages.back());
+	if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT)
+		return page_at(s.lru_cached_pages.back());
+	return page_at(s.clock_hand);
+}
+
+page_id FileCacheManager::vp_arc(const Shard &s, page_id incoming_page) const {
+	if (s.arc_t1.size() + s.arc_t2.size() > CS_ARC_THRESH_DEFAULT) {
+		if (!s.arc_t1.empty() && (s.arc_t1.size() > s.arc_p || (s.arc_b2.has(incoming_page) && s.arc_t1.size() == s.arc_p) || s.arc_t2.empty()))
+			return page_at(s.arc_t1.back());
+		return page_at(s.arc_t2.back());
+	}
+	if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT)
+		return page_at(s.fifo_cached_pages.back());
+	if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT)
+		return page_at(s.lru_cached_pages.back());
+	return page_at(s.arc_t1.empty() ? s.arc_t2.back() : s.arc_t1.back());
+}
+
+page_id FileCacheManager::vp_twoq(const Shard &s, page_id incoming_page) const {
+	uint32_t resident = s.twoq_a1in.size() + s.twoq_am.size();
+	if (resident > CS_TWOQ_THRESH_DEFAULT) {
+		if (!s.twoq_a1in.empty() && (s.twoq_a1in.size() > MAX(resident / CS_TWOQ_KIN_DIVISOR, 1u) || s.twoq_am.empty()))
+			return page_at(s.twoq_a1in.back());
+		return page_at(s.twoq_am.back());
+	}
+	if (s.fifo_cached_pages.size() > CS_FIFO_THRESH_DEFAULT)
+		return page_at(s.fifo_cached_pages.back());
+	if (s.lru_cached_pages.size() > CS_LRU_THRESH_DEFAULT)
+		return page_at(s.lru_cached_pages.back());
+	return page_at(s.twoq_a1in.empty() ? s.twoq_am.back() : s.twoq_a1in.back());
+}
+
+frame_id FileCacheManager::evict_page(Shard &s, page_id page_to_evict) {
+	frame_id frame_to_evict = s.page_frame_map.get(page_to_evict);
+
+	CRASH_COND(frame_to_evict == (frame_id)CS_MEM_VAL_BAD);
+
+	// The file can't go away while we hold its page's shard, see remove_data_source.
+	DescriptorInfo *old_desc_info = get_desc_info(CS_GET_DESCRIPTOR_FROM_GUID(page_to_evict));
+	CRASH_COND(old_desc_info == NULL);
+
+	// A page still being loaded is passed over like a dirty one, or its load would land in the frame's next page.
+	if (!frames[frame_to_evict]->get_ready() || frames[frame_to_evict]->get_dirty()) {
+		if (frames[frame_to_evict]->get_dirty()) enqueue_write_back(old_desc_info, page_to_evict);
+
+		// Transient pages aren't in any policy list.
+		if (!s.transient_frames || !is_transient(frame_to_evict)) {
+			CS_GET_CACHE_POLICY_FN(cache_insertion_policies, old_desc_info->cache_policy)
+			(s, page_to_evict);
+		}
+		return CS_MEM_VAL_BAD;
+	}
+
+	untrack_page(s, old_desc_info, page_to_evict);
+
+	return frame_to_evict;
+}
+
+frame_id FileCacheManager::take_transient_frame(Shard &s, page_id curr_page, uint32_t range_id) {
+	for (size_t i = 0; i < s.transient_frames; ++i) {
+		size_t idx = s.next_transient;
+		frame_id curr_frame = s.first_frame + s.cached_frames + idx;
+		s.next_transient = (s.next_transient + 1) % s.transient_frames;
+
+		Frame *f = frames[curr_frame];
+
+		// Page views still point into it, or it holds an earlier page of the same range.
+		if (f->get_pins() || s.transient_range[idx] == range_id) continue;
+
+		// A dirty or loading page is kept until it is written back or ready, see evict_page.
+		if (f->get_used() && evict_page(s, f->get_owning_page()) == (frame_id)CS_MEM_VAL_BAD) continue;
+
+		f->set_used(true).set_last_use(s.step).set_used_size(0).set_owning_page(curr_page);
+
+		CRASH_COND_MSG(!s.page_frame_map.insert(curr_page, curr_frame), "Could not insert new page in page-frame map.");
+		s.transient_range[idx] = range_id;
+
+		return curr_frame;
+	}
+
+	return CS_MEM_VAL_BAD;
+}
+
+bool FileCacheManager::get_page_or_do_paging_op(DescriptorInfo *desc_info, size_t offset, uint32_t range_id, frame_id &r_dirty_frame) {
+
+	page_id curr_page = get_page_guid(desc_info, offset, false);
+	Shard &s = get_shard(curr_page);
+	MutexLock ml(s.lock);
 
-	page_id curr_page = get_page_guid(desc_info, offset, true);
 	//  WARN_PRINTS("query for offset " + itoh(offset) + " : " + itoh(curr_page));
 	frame_id curr_frame = CS_MEM_VAL_BAD;
 	bool ret;
+	r_dirty_frame = CS_MEM_VAL_BAD;
 
-	if (curr_page == (page_id)CS_MEM_VAL_BAD) {
+	if (s.page_frame_map.get(curr_page) == (frame_id)CS_MEM_VAL_BAD) {
 
-		curr_page = get_page_guid(desc_info, offset, false);
 		//  WARN_PRINTS("Adding page : " + itoh(curr_page));
 
-		// Find a free frame. last_used is only ever updated here, that could change...
+		if (admission_filter) s.admission.record(curr_page);
+
+		// Find a free frame in the shard. last_used is only ever updated here, that could change...
 		// TODO: change this to something more efficient.
 		for (
-				int i = ((last_used + 1) % CS_NUM_FRAMES);
-				i != last_used;
-				i = (i + 1) % 16) {
+				size_t i = ((s.last_used + 1) % s.cached_frames);
+				i != s.last_used;
+				i = (i + 1) % s.cached_frames) {
 
-			if (frames[i]->get_used() == false) {
+			Frame *f = frames[s.first_frame + i];
 
-				// This is the only place where a frame's owning_page value is used, that could change.
-				DescriptorInfo **old_desc_info = files.getptr(frames[i]->get_owning_page() >> 40);
+			// Frames are only let go of once they are clean, so a free one can be used right away.
+			if (f->get_used() == false) {
 
-				if (old_desc_info)
-					frames[i]->wait_clean((*old_desc_info)->dirty_sem);
+				f->set_ready_false().set_used(true).set_last_use(s.step).set_used_size(0).set_owning_page(curr_page);
 
-				frames[i]->set_ready_false().set_used(true).set_last_use(step).set_used_size(0).set_owning_page(curr_page);
-
-				curr_frame = i;
-				last_used = i;
+				curr_frame = s.first_frame + i;
+				s.last_used = i;
 
 				CRASH_COND(curr_frame == (frame_id)CS_MEM_VAL_BAD);
-				CRASH_COND(page_frame_map.insert(curr_page, curr_frame) == NULL);
+				CRASH_COND(!s.page_frame_map.insert(curr_page, curr_frame));
 
 				//WARN_PRINTS(itoh(curr_page) + " mapped to " + itoh(curr_frame));
 				CS_GET_CACHE_POLICY_FN(
 						cache_insertion_policies,
 						desc_info->cache_policy)
-				(curr_page);
+				(s, curr_page);
 				break;
 			}
 		}
 
+		// Without a free frame, a page that is used less often than the would-be victim doesn't get to evict it.
+		if (curr_frame == (frame_id)CS_MEM_VAL_BAD && admission_filter) {
+			page_id victim = CS_GET_CACHE_POLICY_FN(cache_victim_policies, desc_info->cache_policy)(s, curr_page);
+
+			if (victim != (page_id)CS_MEM_VAL_BAD && !s.admission.admit(curr_page, victim)) {
+				//  WARN_PRINTS("Admission rejected " + itoh(curr_page) + " in favour of " + itoh(victim));
+				// If every transient frame is pinned, dirty or already holds a page of this range, the page evicts the victim after all.
+				curr_frame = take_transient_frame(s, curr_page, range_id);
+				if (curr_frame != (frame_id)CS_MEM_VAL_BAD) s.admission_rejects += 1;
+			}
+		}
+
 		// If there are no free frames, we evict an old one according to the paging/caching algo.
-		if (curr_frame == (data_descriptor)CS_MEM_VAL_BAD) {
+		// Dirty and loading pages are passed over, see evict_page.
+		for (int skipped = 0; curr_frame == (data_descriptor)CS_MEM_VAL_BAD && skipped < CS_EVICT_DIRTY_SKIPS; ++skipped) {
 			//  WARN_PRINT("must evict");
 
 			//  WARN_PRINTS("Cache policy: " + String(Dictionary(desc_info->to_variant(*this)).get("cache_policy", "-1")));
 
 			// Call the appropriate replacement policy function for our caching policy.
-			page_id page_to_evict = CS_GET_CACHE_POLICY_FN(cache_replacement_policies, desc_info->cache_policy)(desc_info);
-
-			frame_id frame_to_evict = page_frame_map[page_to_evict];
-
-			CRASH_COND(frame_to_evict == (frame_id)CS_MEM_VAL_BAD);
+			page_id page_to_evict = CS_GET_CACHE_POLICY_FN(cache_replacement_policies, desc_info->cache_policy)(s, desc_info, curr_page);
 
-			if (frames[frame_to_evict]->get_dirty()) {
-				enqueue_store(files[page_to_evict >> 40], frame_to_evict, CS_GET_FILE_OFFSET_FROM_GUID(page_to_evict));
+			frame_id frame_to_evict = evict_page(s, page_to_evict);
+			if (frame_to_evict == (frame_id)CS_MEM_VAL_BAD) {
+				r_dirty_frame = s.page_frame_map.get(page_to_evict);
+				continue;
 			}
-
-			untrack_page(files[page_to_evict >> 40], page_to_evict);
+			r_dirty_frame = CS_MEM_VAL_BAD;
 
 			// Set up flags and values for the new mapping.
-			frames[frame_to_evict]->set_used(true).set_last_use(step).set_used_size(0).set_owning_page(curr_page);
+			frames[frame_to_evict]->set_used(true).set_last_use(s.step).set_used_size(0).set_owning_page(curr_page);
 
 			// We reuse the page holder we evicted.
 			curr_frame = frame_to_evict;
 
 			//  WARN_PRINTS("evicted page under " + String(desc_info->cache_policy == _FileCacheManager::LRU ? "LRU " : (desc_info->cache_policy == _FileCacheManager::KEEP ? "KEEP " : "FIFO ")) + itoh(page_to_evict));
 
-			CRASH_COND_MSG(page_frame_map.insert(curr_page, curr_frame) == NULL, "Could not insert new page in page-frame map.");
+			CRASH_COND_MSG(!s.page_frame_map.insert(curr_page, curr_frame), "Could not insert new page in page-frame map.");
 
 			CS_GET_CACHE_POLICY_FN(cache_insertion_policies, desc_info->cache_policy)
-			(curr_page);
+			(s, curr_page);
 
 			//  WARN_PRINTS("curr_page : " + itoh(curr_page) + " mapped to curr_frame: " + itoh(curr_frame));
 		}
 
-		desc_info->pages.ordered_insert(curr_page);
+		// Every page we were offered is still being written back or loaded, see load_range.
+		if (curr_frame == (frame_id)CS_MEM_VAL_BAD) return false;
+
+		desc_info->pages.insert(curr_page, curr_frame);
 
 		ret = false;
 
 	} else {
+		if (admission_filter) s.admission.record(curr_page);
+
 		// Update cache related details...
-		CS_GET_CACHE_POLICY_FN(cache_update_policies, desc_info->cache_policy)
-		(curr_page);
+		// Transient pages aren't in any policy list, they stay until the next rejected page needs the frame.
+		// Neither are pinned pages, until they are unpinned.
+		curr_frame = s.page_frame_map.get(curr_page);
+		if ((!s.transient_frames || !is_transient(curr_frame)) && !frames[curr_frame]->get_pins()) {
+			CS_GET_CACHE_POLICY_FN(cache_update_policies, desc_info->cache_policy)
+			(s, curr_page);
+		}
 		ret = true;
 	}
 
-	{
-		MutexLock ml(mutex);
-		step += 1;
-	}
+	s.step += 1;
 
 	return ret;
 }
 
+frame_id FileCacheManager::get_page_frame(Shard &s, DescriptorInfo *desc_info, page_id curr_page) {
+	size_t offset = CS_GET_FILE_OFFSET_FROM_GUID(curr_page);
+
+	while (true) {
+		frame_id curr_frame = desc_info->pages.get(curr_page);
+		if (curr_frame != (frame_id)CS_MEM_VAL_BAD) return curr_frame;
+
+		// Mapping the page may have to wait for a write-back, which mustn't happen with the shard locked, see load_range.
+		// Another thread can evict the page again before we have the shard back, so it is looked up once more.
+		s.lock->unlock();
+		load_range(desc_info, offset, offset, CtrlOp::PRIORITY_DEMAND);
+		s.lock->lock();
+	}
+}
+
+size_t FileCacheManager::copy_from_page(DescriptorInfo *desc_info, page_id curr_page, uint8_t *dst, uint32_t offset, size_t len, bool to_used_size) {
+	while (true) {
+		frame_id curr_frame;
+		{
+			Shard &s = get_shard(curr_page);
+			MutexLock ml(s.lock);
+			curr_frame = get_page_frame(s, desc_info, curr_page);
+		}
+
+		// The shard isn't held for the copy, so other threads can keep using it. If the frame is handed to another
+		// page in the meantime, what was copied may be that page's data, and we go around again.
+		Frame *f = frames[curr_frame];
+		f->wait_ready();
+		size_t copied = to_used_size ? MIN(len, (size_t)f->get_used_size()) : len;
+		f->copy_out(dst, offset, copied);
+
+		if (f->get_owning_page() == curr_page) return copied;
+	}
+}
+
+frame_id FileCacheManager::pin_page(DescriptorInfo *desc_info, page_id curr_page) {
+	Shard &s = get_shard(curr_page);
+	size_t offset = CS_GET_FILE_OFFSET_FROM_GUID(curr_page);
+
+	while (true) {
+		{
+			MutexLock ml(s.lock);
+			frame_id curr_frame = s.page_frame_map.get(curr_page);
+			if (curr_frame == (frame_id)CS_MEM_VAL_BAD) return CS_MEM_VAL_BAD;
+
+			Frame *f = frames[curr_frame];
+			if (f->get_ready()) {
+				if (f->get_pins() == 0) {
+					if (s.pinned_frames >= s.cached_frames / CS_PIN_MAX_SHARE) return CS_MEM_VAL_BAD;
+					s.pinned_frames += 1;
+
+					// Out of the policy's lists, the page can't be picked for eviction.
+					if (!s.transient_frames || !is_transient(curr_frame)) {
+						CS_GET_CACHE_POLICY_FN(cache_removal_policies, desc_info->cache_policy)
+						(s, curr_page);
+					}
+				}
+
+				f->set_pins(f->get_pins() + 1);
+				return curr_frame;
+			}
+		}
+
+		// The page is still being loaded. This moves its load up to demand priority, so a seek can't cancel it
+		// while we wait, and maps it again if it was evicted in the meantime.
+		load_range(desc_info, offset, offset, CtrlOp::PRIORITY_DEMAND);
+
+		frame_id curr_frame = desc_info->pages.get(curr_page);
+		if (curr_frame != (frame_id)CS_MEM_VAL_BAD) frames[curr_frame]->wait_ready();
+	}
+}
+
+void FileCacheManager::unpin_page(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame) {
+	Shard &s = get_shard(curr_page);
+	MutexLock ml(s.lock);
+
+	Frame *f = frames[curr_frame];
+	CRASH_COND(f->get_pins() == 0 || f->get_owning_page() != curr_page);
+
+	f->set_pins(f->get_pins() - 1);
+	if (f->get_pins()) return;
+
+	s.pinned_frames -= 1;
+
+	// It has just been used, so it goes back in as the most recent page.
+	if (!s.transient_frames || !is_transient(curr_frame)) {
+		f->set_last_use(s.step);
+		CS_GET_CACHE_POLICY_FN(cache_insertion_policies, desc_info->cache_policy)
+		(s, curr_page);
+	}
+}
+
+Error FileCacheManager::pin(const RID rid, size_t offset, size_t length, PageView &r_view) {
+	FileHandle *handle = get_handle(rid);
+	ERR_FAIL_COND_V_MSG(!handle, ERR_FILE_CANT_OPEN, "No such file");
+	DescriptorInfo *desc_info = handle->desc_info;
+
+	unpin(r_view);
+
+	length = offset < desc_info->total_size ? MIN(length, desc_info->total_size - offset) : 0;
+	if (!length) return OK;
+
+	r_view.handle = handle;
+	r_view.length = length;
+	handle->views.fetch_add(1, std::memory_order_relaxed);
+
+	size_t first_page = CS_GET_PAGE(offset);
+	size_t page_count = (CS_GET_PAGE(offset + length - 1) - first_page) / CS_PAGE_SIZE + 1;
+
+	if (page_count <= CS_VIEW_MAX_PAGES) {
+		size_t pos = offset;
+		for (size_t i = 0; i < page_count; ++i) {
+			page_id curr_page = get_page_guid(desc_info, pos, false);
+			frame_id curr_frame = pin_page(desc_info, curr_page);
+			if (curr_frame == (frame_id)CS_MEM_VAL_BAD) break;
+
+			size_t len = MIN(offset + length - pos, (size_t)(CS_PAGE_SIZE - CS_PARTIAL_SIZE(pos)));
+			r_view.pages[i] = curr_page;
+			r_view.pinned[i] = curr_frame;
+			r_view.spans[i].ptr = frames[curr_frame]->memory_region + CS_PARTIAL_SIZE(pos);
+			r_view.spans[i].len = len;
+			r_view.span_count += 1;
+			pos += len;
+		}
+
+		if (r_view.span_count == page_count) return OK;
+
+		// Some page wasn't there, so the range is copied after all.
+		for (uint32_t i = 0; i < r_view.span_count; ++i) {
+			unpin_page(desc_info, r_view.pages[i], r_view.pinned[i]);
+		}
+		r_view.span_count = 0;
+	}
+
+	r_view.copy = memnew_arr(uint8_t, length);
+
+	// This goes a run of pages at a time, so a range larger than the cache doesn't evict its own start before it is copied.
+	for (size_t done = 0; done < length;) {
+		size_t run_end = MIN(CS_GET_PAGE(offset + done) + CS_IO_MAX_RUN * CS_PAGE_SIZE, offset + length);
+		load_range(desc_info, offset + done, run_end - 1, CtrlOp::PRIORITY_DEMAND);
+
+		while (offset + done < run_end) {
+			size_t pos = offset + done;
+			size_t len = MIN(run_end - pos, (size_t)(CS_PAGE_SIZE - CS_PARTIAL_SIZE(pos)));
+			copy_from_page(desc_info, get_page_guid(desc_info, pos, false), r_view.copy + done, CS_PARTIAL_SIZE(pos), len, false);
+			done += len;
+		}
+	}
+
+	r_view.spans[0].ptr = r_view.copy;
+	r_view.spans[0].len = length;
+	r_view.span_count = 1;
+
+	return OK;
+}
+
+void FileCacheManager::unpin(PageView &view) {
+	if (!view.handle) return;
+
+	if (view.copy) {
+		memdelete_arr(view.copy);
+		view.copy = NULL;
+	} else {
+		for (uint32_t i = 0; i < view.span_count; ++i) {
+			unpin_page(view.handle->desc_info, view.pages[i], view.pinned[i]);
+		}
+	}
+
+	view.handle->views.fetch_sub(1, std::memory_order_release);
+	view.handle = NULL;
+	view.span_count = 0;
+	view.length = 0;
+}
+
+void FileCacheManager::PageView::release() {
+	if (handle) FileCacheManager::get_singleton()->unpin(*this);
+}
+
 FileCacheManager *FileCacheManager::singleton = NULL;
 _FileCacheManager *_FileCacheManager::singleton = NULL;
 
@@ -1049,7 +2397,7 @@ FileCacheManager *FileCacheManager::get_singleton() {
 }
 
 void FileCacheManager::unlock() {
-	if (!thread || !mutex) {
+	if (!memory_region || !mutex) {
 		return;
 	}
 
@@ -1057,29 +2405,123 @@ void FileCacheManager::unlock() {
 }
 
 void FileCacheManager::lock() {
-	if (!thread || !mutex) {
+	if (!memory_region || !mutex) {
 		return;
 	}
 
 	mutex->lock();
 }
 
-Error FileCacheManager::init() {
-	exit_thread = false;
-	thread = Thread::create(FileCacheManager::thread_func, this);
+Error FileCacheManager::init(size_t p_page_size, size_t p_cache_size) {
+	ERR_FAIL_COND_V_MSG(memory_region_base != NULL, ERR_ALREADY_IN_USE, "The file cache manager has already been initialised.");
 
-	// th2 = Thread::create(FileCacheManager::th2_fn, this);
+	if (p_page_size == 0)
+		p_page_size = (int64_t)GLOBAL_DEF("cacheserv/cache/page_size", CS_PAGE_SIZE_DEFAULT);
+	if (p_cache_size == 0)
+		p_cache_size = (int64_t)GLOBAL_DEF("cacheserv/cache/pool_size", CS_CACHE_SIZE_DEFAULT);
+
+	// The page arithmetic relies on the page size being a power of two.
+	size_t page_size = CLAMP(next_power_of_2(p_page_size), CS_PAGE_SIZE_MIN, CS_PAGE_SIZE_MAX);
+	size_t num_frames = MAX(p_cache_size / page_size, (size_t)CS_NUM_FRAMES_MIN);
+
+	if (page_size != p_page_size) {
+		WARN_PRINTS("Page size " + itoh(p_page_size) + " is not a power of two between " + itoh(CS_PAGE_SIZE_MIN) + " and " + itoh(CS_PAGE_SIZE_MAX) + ", using " + itoh(page_size) + " instead.");
+	}
+
+	cs_geometry.page_size = page_size;
+	cs_geometry.page_mask = page_size - 1;
+	cs_geometry.page_shift = 0;
+	while (((size_t)1 << cs_geometry.page_shift) < page_size)
+		cs_geometry.page_shift += 1;
+	cs_geometry.num_frames = num_frames;
+	cs_geometry.cache_size = num_frames * page_size;
+
+	// memnew_arr makes no alignment promises, so we over-allocate and align the pool ourselves.
+	memory_region_base = memnew_arr(uint8_t, CS_CACHE_SIZE + CS_DIRECT_IO_ALIGNMENT);
+	ERR_FAIL_COND_V_MSG(memory_region_base == NULL, ERR_OUT_OF_MEMORY, "Could not allocate " + itoh(CS_CACHE_SIZE) + " bytes for the cache.");
+	memory_region = (uint8_t *)(((uintptr_t)memory_region_base + CS_DIRECT_IO_ALIGNMENT - 1) & ~(uintptr_t)(CS_DIRECT_IO_ALIGNMENT - 1));
+
+	available_space = CS_CACHE_SIZE;
+	used_space = 0;
+	total_space = CS_CACHE_SIZE;
+
+	for (size_t i = 0; i < CS_NUM_FRAMES; ++i) {
+		frames.push_back(
+				memnew(Frame(memory_region + i * CS_PAGE_SIZE)));
+	}
+
+	admission_filter = GLOBAL_DEF("cacheserv/cache/admission_filter", false);
+
+	// The shard count is a power of two, and every shard gets enough frames for the policies' thresholds.
+	uint32_t shard_count = CLAMP((int)GLOBAL_DEF("cacheserv/cache/shards", CS_SHARDS_DEFAULT), 1, CS_SHARDS_MAX);
+	while (shard_count > 1 && CS_NUM_FRAMES / shard_count < CS_SHARD_MIN_FRAMES)
+		shard_count >>= 1;
+	uint32_t rounded = 1;
+	while (rounded * 2 <= shard_count)
+		rounded <<= 1;
+	shard_count = rounded;
+	shard_mask = shard_count - 1;
+	frames_per_shard = CS_NUM_FRAMES / shard_count;
+	size_t cached_frames = 0;
+
+	for (uint32_t i = 0; i < shard_count; ++i) {
+		Shard *s = memnew(Shard);
+		size_t shard_frames = i == shard_mask ? CS_NUM_FRAMES - i * frames_per_shard : frames_per_shard;
+
+		s->lock = Mutex::create();
+		s->first_frame = i * frames_per_shard;
+		s->transient_frames = admission_filter ? CS_TRANSIENT_FRAMES : 0;
+		s->cached_frames = shard_frames - s->transient_frames;
+		s->rng.set_seed(OS::get_singleton()->get_ticks_usec() + i);
+
+		s->page_frame_map.init(shard_frames);
+		if (admission_filter) s->admission.init(s->cached_frames);
+
+		s->lru_cached_pages.init(frames.ptr(), FRAME_LIST_LRU);
+		s->fifo_cached_pages.init(frames.ptr(), FRAME_LIST_FIFO);
+		s->permanent_cached_pages.init(frames.ptr(), FRAME_LIST_KEEP);
+		s->clock_cached_pages.init(frames.ptr(), FRAME_LIST_CLOCK);
+		s->arc_t1.init(frames.ptr(), FRAME_LIST_ARC_T1);
+		s->arc_t2.init(frames.ptr(), FRAME_LIST_ARC_T2);
+		s->arc_b1.init(shard_frames);
+		s->arc_b2.init(shard_frames);
+		s->twoq_a1in.init(frames.ptr(), FRAME_LIST_TWOQ_A1IN);
+		s->twoq_am.init(frames.ptr(), FRAME_LIST_TWOQ_AM);
+		s->twoq_a1out.init(shard_frames / 2);
+
+		shards.push_back(s);
+		cached_frames += s->cached_frames;
+	}
+
+	// Devices with deep queues (NVMe) benefit from more workers, each worker keeps one request in flight.
+	workers_per_device = CLAMP((int)GLOBAL_DEF("cacheserv/io/workers_per_device", CS_WORKERS_PER_DEVICE_DEFAULT), 1, CS_WORKERS_PER_DEVICE_MAX);
+
+	use_io_uring = GLOBAL_DEF("cacheserv/io/use_io_uring", true) && IOUringEngine::is_supported();
+	direct_io_min_size = (int64_t)GLOBAL_DEF("cacheserv/io/direct_io_min_size", 0);
+	// A window much bigger than the pool would only evict itself.
+	max_readahead_pages = CLAMP((int64_t)GLOBAL_DEF("cacheserv/io/readahead_max_size", CS_READAHEAD_MAX_DEFAULT) / (int64_t)CS_PAGE_SIZE, (int64_t)CS_READAHEAD_MIN_PAGES, (int64_t)MAX(cached_frames / 4, (size_t)CS_READAHEAD_MIN_PAGES));
+	// Write-back runs can't be longer than the iovec array a worker builds them in.
+	max_write_pages = CLAMP((int64_t)GLOBAL_DEF("cacheserv/io/max_write_size", CS_MAX_WRITE_SIZE_DEFAULT) / (int64_t)CS_PAGE_SIZE, (int64_t)1, (int64_t)CS_IO_MAX_RUN);
+	durability = (CacheDurability)CLAMP((int)GLOBAL_DEF("cacheserv/io/durability", CS_DURABILITY_FLUSH), (int)CS_DURABILITY_NONE, (int)CS_DURABILITY_DSYNC);
+	ProjectSettings::get_singleton()->set_custom_property_info("cacheserv/io/durability", PropertyInfo(Variant::INT, "cacheserv/io/durability", PROPERTY_HINT_ENUM, "None,Flush,Close,DSync"));
+
+	exit_thread = false;
 
 	return OK;
 }
 
 void FileCacheManager::thread_func(void *p_udata) {
-	FileCacheManager &fcs = *static_cast<FileCacheManager *>(p_udata);
+	IOWorker &worker = *static_cast<IOWorker *>(p_udata);
+	FileCacheManager &fcs = *worker.manager;
+
+	CtrlOp l;
+	bool have_op = false;
 
 	do {
 
-		// ERR_PRINTS("Thread" + itoh(fcs.thread->get_id()) + "Waiting for message.");
-		CtrlOp l = fcs.op_queue.pop();
+		// ERR_PRINTS("Thread" + itoh(worker.thread->get_id()) + "Waiting for message.");
+		if (!have_op) l = worker.queue.pop();
+		have_op = false;
 		//ERR_PRINT("got message");
 		if (l.type == CtrlOp::QUIT)
 			break;
@@ -1087,22 +2529,40 @@ void FileCacheManager::thread_func(void *p_udata) {
 		ERR_FAIL_COND_MSG(l.di == NULL, "Null file handle.")
 		if(l.di->valid == false) {
 			// ERR_PRINTS("Invalid file");
-			fcs.untrack_page(l.di, get_page_guid(l.di, l.offset, false));
+			page_id curr_page = get_page_guid(l.di, l.offset, false);
+			Shard &s = fcs.get_shard(curr_page);
+			MutexLock ml(s.lock);
+			fcs.untrack_page(s, l.di, curr_page);
+			if (l.type == CtrlOp::LOAD) l.di->finish_load();
+			continue;
+		}
+
+		if (worker.ring.is_ready() && l.di->fd >= 0 && (l.type == CtrlOp::LOAD || l.type == CtrlOp::STORE)) {
+			have_op = fcs.do_batched_io(worker, l);
+			continue;
+		}
+
+		if (l.di->fd >= 0 && (l.type == CtrlOp::LOAD || l.type == CtrlOp::STORE)) {
+			have_op = fcs.do_vectored_io(worker, l);
 			continue;
 		}
 
 		page_id curr_page = get_page_guid(l.di, l.offset, false);
-		frame_id curr_frame = fcs.page_frame_map[curr_page];
+		// A store goes to the frame it was queued for. The page may already be gone from the file's index by the time it runs,
+		// but its frame isn't handed out again until it has been written back.
+		frame_id curr_frame = l.type == CtrlOp::STORE ? l.frame : l.di->pages.get(curr_page);
 
 		switch (l.type) {
 			case CtrlOp::LOAD: {
 				// ERR_PRINTS("file: " + l.di->path + " Performing load for offset " + itoh(l.offset) + "\nIn pages: " + itoh(CS_GET_PAGE(l.offset)) + "\nCurr page: " + itoh(curr_page) + "\nCurr frame: " + itoh(curr_frame));
-				fcs.do_load_op(l.di, curr_page, curr_frame, l.offset);
+				// The page was dropped while the op was queued.
+				if (curr_frame != (frame_id)CS_MEM_VAL_BAD) fcs.do_load_op(l.di, curr_page, curr_frame, l.offset);
+				l.di->finish_load();
 				break;
 			}
 			case CtrlOp::STORE: {
 				// ERR_PRINTS("file: " + l.di->path + " Performing store.");
-				fcs.do_store_op(l.di, curr_page, curr_frame, l.offset);
+				fcs.do_store_op(l.di, curr_page, curr_frame, l.offset, l.priority);
 				break;
 			}
 			case CtrlOp::FLUSH: {
@@ -1122,19 +2582,132 @@ void FileCacheManager::thread_func(void *p_udata) {
 
 void FileCacheManager::check_cache(const RID rid, size_t length) {
 
-	DescriptorInfo *desc_info = files[RID_REF_TO_DD];
+	FileHandle *handle = get_handle(rid);
+
+	ERR_FAIL_COND_MSG(!handle, "No such file");
+	DescriptorInfo *desc_info = handle->desc_info;
+
+	// Without a length, as after a seek, the current readahead window is loaded. That isn't a read, so it doesn't count towards the readahead state.
+	if (length == CS_LEN_UNSPECIFIED) {
+		load_range(desc_info, handle->offset, handle->offset + handle->ra_window * CS_PAGE_SIZE, CtrlOp::PRIORITY_READAHEAD);
+		return;
+	}
+
+	load_range(desc_info, handle->offset, handle->offset + length, CtrlOp::PRIORITY_DEMAND);
+	update_readahead(handle, length);
+	update_prefetch(handle, length);
+}
 
-	if (length == CS_LEN_UNSPECIFIED) length = 8 * CS_PAGE_SIZE;
+void FileCacheManager::load_range(DescriptorInfo *desc_info, size_t start, size_t end, uint8_t priority) {
+	CtrlOp run[CS_IO_MAX_RUN];
+	uint32_t count = 0;
+	CtrlQueue *run_queue = NULL;
+	uint64_t deadline = CtrlQueue::default_deadline(priority);
+	uint32_t range_id = range_seq.fetch_add(1, std::memory_order_relaxed) + 1;
 
-	for (page_id curr_page = CS_GET_PAGE(desc_info->offset); curr_page < CS_GET_PAGE(desc_info->offset + length) + CS_PAGE_SIZE; curr_page += CS_PAGE_SIZE) {
+	for (page_id curr_page = CS_GET_PAGE(start); curr_page < CS_GET_PAGE(end) + CS_PAGE_SIZE; curr_page += CS_PAGE_SIZE) {
 		//  WARN_PRINTS("Checking cache for file " + desc_info->path + " with offset " + itoh(curr_page));
+		page_id guid = desc_info->guid_prefix | curr_page;
+
+		bool hit;
+		frame_id dirty_frame;
+		// If every page the shard's policy offered for eviction was dirty or still loading, we wait for one of them to be
+		// written back and try again. That is done here, with the shard unlocked, so the wait doesn't hold up every other
+		// thread using the shard.
+		while (!(hit = get_page_or_do_paging_op(desc_info, curr_page, range_id, dirty_frame)) && dirty_frame != (frame_id)CS_MEM_VAL_BAD) {
+			// The page we wait for may be one of our own, not yet handed to its queue.
+			if (count) {
+				run_queue->push_batch(run, count);
+				count = 0;
+			}
+			frames[dirty_frame]->wait_ready().wait_clean();
+		}
 
-		if (!get_page_or_do_paging_op(desc_info, curr_page)) {
+		if (!hit) {
 			// TODO: reduce inconsistency here.
-			//  WARN_PRINTS("get_page_or_do_paging_op result: curr_page: " + itoh(curr_page) + " curr_frame: " + itoh(page_frame_map[desc_info->guid_prefix | curr_page]))
-			enqueue_load(desc_info, page_frame_map[desc_info->guid_prefix | curr_page], curr_page);
+			//  WARN_PRINTS("get_page_or_do_paging_op result: curr_page: " + itoh(curr_page) + " curr_frame: " + itoh(desc_info->pages.get(guid)))
+			frame_id curr_frame = desc_info->pages.get(guid);
+
+			// Pages past the end of the file, or of one that is write only, don't need the queue.
+			if (curr_page > desc_info->total_size || desc_info->mode == FileAccess::WRITE) {
+				enqueue_load(desc_info, curr_frame, curr_page, priority);
+				continue;
+			}
+
+			// A run ends at a gap, or where the pages move on to another worker's block.
+			CtrlQueue *queue = get_load_queue(desc_info, guid);
+			if (count && (count == CS_IO_MAX_RUN || queue != run_queue || curr_page != run[count - 1].offset + CS_PAGE_SIZE)) {
+				run_queue->push_batch(run, count);
+				count = 0;
+			}
+
+			desc_info->pending_loads.fetch_add(1);
+			run[count++] = CtrlOp(desc_info, curr_frame, curr_page, CtrlOp::LOAD, priority, deadline);
+			run_queue = queue;
+		} else if (priority == CtrlOp::PRIORITY_DEMAND) {
+			// A page that was only read ahead may still be queued behind other readahead. The reader is about to wait on it, so it can't stay there.
+			frame_id curr_frame = desc_info->pages.get(guid);
+			if (curr_frame != (frame_id)CS_MEM_VAL_BAD && !frames[curr_frame]->get_ready()) get_load_queue(desc_info, guid)->promote(desc_info, curr_page, CtrlOp::PRIORITY_DEMAND);
 		}
 	}
+
+	if (count) run_queue->push_batch(run, count);
+}
+
+void FileCacheManager::update_prefetch(FileHandle *handle, size_t length) {
+	DescriptorInfo *desc_info = handle->desc_info;
+	const StreamPrefetcher::Stream *stream = handle->prefetcher.observe(handle->offset);
+
+	// Back to back records are plain sequential reads, which the readahead window already covers.
+	if (!stream || stream->stride == (int64_t)length) return;
+
+	page_id last_page = CS_GET_PAGE(handle->offset);
+	for (int i = 1; i <= CS_PREFETCH_DEPTH; ++i) {
+		int64_t next = (int64_t)stream->last + stream->stride * i;
+		if (next < 0 || (size_t)next >= desc_info->total_size) break;
+
+		// Short strides can predict the same page more than once.
+		if (CS_GET_PAGE(next) == last_page) continue;
+		last_page = CS_GET_PAGE(next);
+
+		load_range(desc_info, next, MIN(next + MAX(length, (size_t)1), desc_info->total_size) - 1, CtrlOp::PRIORITY_READAHEAD);
+	}
+}
+
+void FileCacheManager::update_readahead(FileHandle *handle, size_t length) {
+	DescriptorInfo *desc_info = handle->desc_info;
+	size_t start = handle->offset;
+	size_t end = start + length;
+
+	// A read is sequential if it picks up where the last one stopped, or rereads the page it stopped in.
+	bool sequential = start >= CS_GET_PAGE(handle->ra_next) && start <= handle->ra_next;
+	handle->ra_next = end;
+
+	if (!sequential) {
+		// Random access. Shrink the window and forget what was read ahead, so the next sequential read starts over from here.
+		handle->ra_window = MAX(handle->ra_window / 2, (uint32_t)CS_READAHEAD_MIN_PAGES);
+		handle->ra_end = CS_GET_PAGE(end) + CS_PAGE_SIZE;
+		handle->ra_marker = CS_GET_PAGE(end);
+		return;
+	}
+
+	// Only crossing the marker triggers readahead, so the common case costs two compares.
+	if (CS_GET_PAGE(end) < handle->ra_marker) return;
+
+	// load_range has already queued everything up to the end of this read.
+	handle->ra_end = MAX(handle->ra_end, CS_GET_PAGE(end) + CS_PAGE_SIZE);
+
+	// Nothing past the end of the file is read ahead.
+	size_t window_end = MIN(handle->ra_end + handle->ra_window * CS_PAGE_SIZE, desc_info->total_size);
+	if (handle->ra_end < window_end) {
+		// The loads are only queued, so the reader carries on with the pages it already has while they come in.
+		load_range(desc_info, handle->ra_end, window_end - 1, CtrlOp::PRIORITY_READAHEAD);
+	}
+
+	// The next window goes out as soon as the reader enters this one, so one window is always in flight ahead of it.
+	handle->ra_marker = handle->ra_end;
+	handle->ra_end += handle->ra_window * CS_PAGE_SIZE;
+	handle->ra_window = MIN(handle->ra_window * 2, max_readahead_pages);
 }
 
 _FileCacheManager::_FileCacheManager() {
@@ -36,6 +36,7 @@
 #include "core/object.h"
 #include "core/ordered_hash_map.h"
 #include "core/os/mutex.h"
+#include "core/os/rw_lock.h"
 #include "core/os/thread.h"
 #include "core/rid.h"
 #include "core/set.h"
@@ -45,6 +46,12 @@
 #include "cacheserv_defines.h"
 #include "control_queue.h"
 #include "data_helpers.h"
+#include "frame_list.h"
+#include "ghost_list.h"
+#include "file_access_unbuffered_unix.h"
+#include "io_uring_engine.h"
+#include "page_table.h"
+#include "tiny_lfu.h"
 
 //  A page is identified with a 64 bit GUID where the 24 most significant bits act as the
 //  differenciator. The 40 least significant bits represent the offset of the referred page
@@ -69,38 +76,159 @@
 // CS_MEM_VAL_BAD if we are making a query and the current page is not tracked.
 _FORCE_INLINE_ page_id get_page_guid(const DescriptorInfo *di, size_t offset, bool query) {
 	page_id x = di->guid_prefix | CS_GET_PAGE(offset);
-	if (query && di->pages.find(x) < 0) {
+	if (query && !di->pages.has(x)) {
 		return CS_MEM_VAL_BAD;
 	}
 	return x;
 }
 
-struct LRUComparator;
-
 class FileCacheManager : public Object {
 	GDCLASS(FileCacheManager, Object);
 
 	friend class _FileCacheManager;
+	friend class CacheservTestManager;
 
 	static FileCacheManager *singleton;
-	RandomNumberGenerator rng;
+	// Owns the RIDs of the tracked files, whose ids are their data descriptors.
 	RID_Owner<CachedResourceHandle> handle_owner;
-	CtrlQueue op_queue;
-	Thread *thread, *th2;
+	// Owns the RIDs handed out by open, one for each open handle.
+	mutable RID_Owner<FileHandle> file_handle_owner;
 	Mutex *mutex;
 
+	// An IO thread and its queue. A file's ops always go to the same worker, which keeps them ordered.
+	struct IOWorker {
+		FileCacheManager *manager;
+		CtrlQueue queue;
+		// Only used if io_uring is available, otherwise the worker does blocking IO.
+		IOUringEngine ring;
+		Thread *thread;
+	};
+
+	// The workers serving the files on one device, so a slow device only stalls its own files.
+	struct DeviceGroup {
+		Vector<IOWorker *> workers;
+		Vector<CtrlQueue *> queues;
+		uint32_t next_worker;
+	};
+
+	HashMap<uint64_t, DeviceGroup *> device_groups;
+	int workers_per_device = CS_WORKERS_PER_DEVICE_DEFAULT;
+	bool use_io_uring = false;
+	// Files at least this big are opened for direct IO, so their pages are only cached once, by us. 0 turns it off.
+	uint64_t direct_io_min_size = 0;
+	// The most pages a single write-back write may cover, from the cacheserv/io/max_write_size setting.
+	uint32_t max_write_pages = CS_IO_MAX_RUN;
+	// The cap on a file's readahead window, in pages.
+	uint32_t max_readahead_pages = CS_READAHEAD_INIT_PAGES;
+	CacheDurability durability = CS_DURABILITY_FLUSH;
+
 public:
+	// A slice of the frame pool with its own page table and replacement policy state.
+	// Pages are spread over the shards by the hash of their GUID and only ever use their own shard's frames,
+	// so threads that miss or hit on pages in different shards never share a lock.
+	struct Shard {
+		// Held for every lookup, mapping and eviction in the shard. Evictions never wait for a write-back while holding it, see load_range.
+		Mutex *lock;
+		PageTable page_frame_map;
+		FrameList lru_cached_pages;
+		FrameList fifo_cached_pages;
+		FrameList permanent_cached_pages;
+		FrameList clock_cached_pages;
+		// The next frame the CLOCK policy will look at when it needs a victim.
+		frame_id clock_hand;
+
+		// ARC keeps recently used pages in T1 and frequently used pages in T2.
+		// B1 and B2 remember the pages recently evicted from T1 and T2.
+		FrameList arc_t1;
+		FrameList arc_t2;
+		GhostList arc_b1;
+		GhostList arc_b2;
+		// The target size of T1. Grows on hits in B1 and shrinks on hits in B2.
+		uint32_t arc_p;
+		// A page whose ghost hit was already accounted for by rp_arc, which ip_arc must place in T2.
+		page_id arc_ghost_hit;
+
+		// 2Q admits new pages into the A1in FIFO. Only pages that come back after falling out of it,
+		// which A1out remembers, are promoted to the Am LRU list, so a single pass over a file can't flush Am.
+		FrameList twoq_a1in;
+		FrameList twoq_am;
+		GhostList twoq_a1out;
+
+		// When the admission filter is on, a missed page only evicts a cached page if the sketch
+		// says it is used more often. Rejected pages are served from the shard's transient frames,
+		// which the free frame scan and the policies never see.
+		TinyLFU admission;
+		uint64_t admission_rejects;
+
+		RandomNumberGenerator rng;
+
+		// The shard owns frames [first_frame, first_frame + cached_frames + transient_frames), the transient ones last.
+		size_t first_frame;
+		size_t cached_frames;
+		size_t transient_frames;
+		size_t next_transient;
+		// The load_range call each transient frame was last taken for, see take_transient_frame.
+		uint32_t transient_range[CS_TRANSIENT_FRAMES];
+		// Where the free frame scan left off.
+		size_t last_used;
+		// Frames held by page views. They are taken out of the policy lists while pinned, so they can't be picked for eviction.
+		uint32_t pinned_frames;
+		// Counts accesses to the shard, frames' last use times are taken from it.
+		uint64_t step;
+
+		Shard() :
+				lock(NULL),
+				clock_hand(CS_MEM_VAL_BAD),
+				arc_p(0),
+				arc_ghost_hit(CS_MEM_VAL_BAD),
+				admission_rejects(0),
+				first_frame(0),
+				cached_frames(0),
+				transient_frames(0),
+				next_transient(0),
+				last_used(0),
+				pinned_frames(0),
+				step(0) {
+			memset(transient_range, 0, sizeof(transient_range));
+		}
+	};
+
 	Vector<Frame *> frames;
+	// The file RID of every tracked file, open or not.
 	HashMap<String, RID> rids;
+	// Only changed in open and permanent_close, under the write side of files_lock. Lookups from
+	// other threads, such as readers evicting another file's page, take the read side.
 	HashMap<uint32_t, DescriptorInfo *> files;
-	Map<page_id, frame_id> page_frame_map;
-	Set<page_id, LRUComparator> lru_cached_pages;
-	List<page_id> fifo_cached_pages;
-	Set<page_id, LRUComparator> permanent_cached_pages;
-
+	RWLock *files_lock;
+	Vector<Shard *> shards;
+	uint32_t shard_mask = 0;
+	// Every shard but the last holds this many frames, the last one also gets the remainder.
+	size_t frames_per_shard = 0;
+	bool admission_filter = false;
+	// Numbers the load_range calls, starting at 1.
+	std::atomic<uint32_t> range_seq;
+
+	// How many pages the workers moved, and with how many read and write calls. Runs of pages moved
+	// with one preadv/pwritev count as a single call, so pages per call shows how much coalescing helps.
+	struct IOStats {
+		std::atomic<uint64_t> pages_read;
+		std::atomic<uint64_t> pages_written;
+		std::atomic<uint64_t> read_calls;
+		std::atomic<uint64_t> write_calls;
+		// io_uring batches, which may mix reads and writes.
+		std::atomic<uint64_t> ring_submits;
+
+		IOStats() :
+				pages_read(0),
+				pages_written(0),
+				read_calls(0),
+				write_calls(0),
+				ring_submits(0) {}
+	} io_stats;
+
+	// The frame pool. memory_region is memory_region_base rounded up to CS_DIRECT_IO_ALIGNMENT, so frames can be used for direct IO.
+	uint8_t *memory_region_base = NULL;
 	uint8_t *memory_region = NULL;
-	uint64_t step = 0;
-	size_t last_used = 0;
 	size_t available_space;
 	size_t used_space;
 	size_t total_space;
@@ -109,39 +237,202 @@ public:
 private:
 	static void thread_func(void *p_udata);
 
+	// Picks the worker queues for a new file, starting a worker group for its device if there isn't one yet.
+	void assign_queues(DescriptorInfo *desc_info);
+
+	// Returns the queue a load for the given page should go to.
+	_FORCE_INLINE_ CtrlQueue *get_load_queue(DescriptorInfo *desc_info, page_id curr_page) {
+		// Loads on the same file may only run side by side if they don't share a file position.
+		if (desc_info->fd < 0) return desc_info->queue;
+		// Pages go to the workers in aligned blocks of CS_IO_LOAD_BLOCK, so all the pages of a run end up with the one worker
+		// that reads them with a single call, see do_vectored_io.
+		return desc_info->load_queues[((CS_GET_FILE_OFFSET_FROM_GUID(curr_page) >> cs_geometry.page_shift) / CS_IO_LOAD_BLOCK) % desc_info->load_queues.size()];
+	}
+
+	// Reads or writes part of the file at the given position without touching its file position.
+	// Uses pread/pwrite on the raw descriptor if there is one, otherwise seeks and reads under the file's io_lock.
+	// Returns the number of bytes moved, or -1 on error.
+	int64_t read_at(DescriptorInfo *desc_info, uint8_t *buf, size_t len, uint64_t pos);
+	int64_t write_at(DescriptorInfo *desc_info, const uint8_t *buf, size_t len, uint64_t pos);
+
+	// Records an IO error on the file, for its handles to report. The op that failed is finished all the same,
+	// so nobody waits on its frame forever: a page that couldn't be read reads as empty, one that couldn't be written is let go of.
+	void set_io_error(DescriptorInfo *desc_info, Error p_error, const String &p_what);
+
 	// Register a file handle with the cache manager. This function takes a pointer to a FileAccess object, so anything that implements the FileAccess API (from the file system or anywhere else) can act as a data source.
-	RID add_data_source(RID rid, FileAccess *data_source, int cache_policy);
+	RID add_data_source(RID rid, FileAccess *data_source, int p_mode, int cache_policy, bool direct_io);
+
+	// Opens the file that backs a cached file, for direct IO if it is large enough. Sets r_direct_io if that worked.
+	FileAccess *open_data_source(const String &path, int p_mode, bool &r_direct_io);
+
+	// Sets up the raw descriptor used for positional page IO, see DescriptorInfo::fd.
+	void open_raw_source(DescriptorInfo *desc_info, int p_mode);
 	void remove_data_source(RID rid);
 
-	void untrack_page(DescriptorInfo *desc_info, page_id curr_page) {
-		frame_id curr_frame = page_frame_map[curr_page];
+	// Creates a new handle to an open file, positioned at offset, and returns its RID. Expects mutex to be locked.
+	RID add_handle(DescriptorInfo *desc_info, size_t offset);
+
+	// Closes a handle. The last handle to a file also closes the file, after writing back its dirty pages.
+	// Expects mutex to be locked, and the handle's RID to have been freed.
+	void close_handle(FileHandle *handle);
+
+	// Stops tracking a closed file and frees its RID.
+	void drop_file(DescriptorInfo *desc_info);
+
+	// Returns the handle behind an RID returned by open, or NULL if the RID isn't valid.
+	_FORCE_INLINE_ FileHandle *get_handle(RID rid) const {
+		return file_handle_owner.owns(rid) ? file_handle_owner.get(rid) : NULL;
+	}
+
+	// Expects the page's shard to be locked, and the page to be clean.
+	void untrack_page(Shard &s, DescriptorInfo *desc_info, page_id curr_page) {
+		frame_id curr_frame = s.page_frame_map.get(curr_page);
 		// WARN_PRINTS("Untracking page: " + itoh(curr_page) + " mapped to frame: " + itoh(curr_frame) + " in file:  " + desc_info->path)
 
-		CS_GET_CACHE_POLICY_FN(cache_removal_policies, desc_info->cache_policy)(curr_page);
+		// Another thread may have evicted it already.
+		if (curr_frame == (frame_id)CS_MEM_VAL_BAD) return;
+		// Page views point into the frame, see pin.
+		CRASH_COND_MSG(frames[curr_frame]->get_pins(), "Can't drop a page that is pinned by a page view.");
+		// Writers hold the shard, so a page that is clean here stays clean. Waiting for a dirty one would hold up the shard, see evict_page.
+		CRASH_COND_MSG(frames[curr_frame]->get_dirty(), "Can't drop a page that hasn't been written back.");
+
+		CS_GET_CACHE_POLICY_FN(cache_removal_policies, desc_info->cache_policy)(s, curr_page);
 
-		page_frame_map.erase(curr_page);
+		s.page_frame_map.erase(curr_page);
 		desc_info->pages.erase(curr_page);
-		frames[curr_frame]->wait_clean(desc_info->dirty_sem).set_used(false).set_ready_false().set_owning_page(0).set_used_size(0);
+		frames[curr_frame]->set_used(false).set_ready_false().set_owning_page(0).set_used_size(0);
 	}
 
+	// Unlinks the frame from the policy list and returns the page it holds.
+	page_id take_page(FrameList &list, frame_id frame);
+
+	// Applies ARC's adaptation for a page that missed in the cache but hit in a ghost list.
+	// Returns true if the page was found in B1 or B2.
+	bool arc_adapt(Shard &s, page_id curr_page);
+
+	_FORCE_INLINE_ Shard &get_shard(page_id page) const {
+		return *shards[(PageTable::hash(page) >> 32) & shard_mask];
+	}
+
+	_FORCE_INLINE_ Shard &get_frame_shard(frame_id frame) const {
+		return *shards[MIN(frame / frames_per_shard, (size_t)shard_mask)];
+	}
+
+	_FORCE_INLINE_ bool is_transient(frame_id frame) const {
+		const Shard &s = get_frame_shard(frame);
+		return frame >= s.first_frame + s.cached_frames;
+	}
+
+	// Looks up an open file. Returns NULL if there is no such file.
+	_FORCE_INLINE_ DescriptorInfo *get_desc_info(data_descriptor dd) const {
+		files_lock->read_lock();
+		DescriptorInfo *const *elem = files.getptr(dd);
+		DescriptorInfo *desc_info = elem ? *elem : NULL;
+		files_lock->read_unlock();
+		return desc_info;
+	}
+
+	// Maps the page to the shard's next transient frame that is neither pinned nor dirty, dropping whatever page that frame held.
+	// Frames taken for the same load_range call are passed over, or a range larger than the transient frames would drop
+	// its own first pages before they were read. Returns CS_MEM_VAL_BAD if there isn't one.
+	frame_id take_transient_frame(Shard &s, page_id curr_page, uint32_t range_id);
+
+	// Evicts the page, which the policy has just given up, and returns the frame it was in.
+	// A dirty page can't go until it is written back, or a reader could load the old data from disk in the meantime. Its write-back
+	// is queued, the page goes back to the policy as if it had just been used, and CS_MEM_VAL_BAD is returned.
+	frame_id evict_page(Shard &s, page_id page_to_evict);
+
+	// Returns the frame the page is in. If another thread evicted the page since check_cache mapped it, it is mapped and
+	// queued for loading again. Expects the page's shard to be locked once, it is let go while the page is mapped.
+	frame_id get_page_frame(Shard &s, DescriptorInfo *desc_info, page_id curr_page);
+
+	// Copies len bytes from offset in the page, or only up to the end of the page's data if to_used_size is set.
+	// Returns the number of bytes copied.
+	size_t copy_from_page(DescriptorInfo *desc_info, page_id curr_page, uint8_t *dst, uint32_t offset, size_t len, bool to_used_size);
+
+	// Pins the frame holding the page and returns it. Waits for the page if it is still being loaded.
+	// Returns CS_MEM_VAL_BAD if the page isn't in the cache, or its shard already has as many pinned frames as it allows.
+	frame_id pin_page(DescriptorInfo *desc_info, page_id curr_page);
+
+	// Drops a pin. The frame goes back into its policy list once the last pin is gone.
+	void unpin_page(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame);
+
+	// Returns the page held by the frame, or CS_MEM_VAL_BAD for an empty list.
+	_FORCE_INLINE_ page_id page_at(frame_id frame) const {
+		return frame == (frame_id)CS_MEM_VAL_BAD ? (page_id)CS_MEM_VAL_BAD : frames[frame]->get_owning_page();
+	}
+
+	// Moves the clock hand to the next frame in the clock, wrapping around at the end.
+	_FORCE_INLINE_ frame_id clock_advance(Shard &s, frame_id frame) {
+		frame_id next = s.clock_cached_pages.next(frame);
+		return next == (frame_id)CS_MEM_VAL_BAD ? s.clock_cached_pages.front() : next;
+	}
+
+	// Submits the op, and as many of the LOAD and STORE ops queued behind it as fit, through the worker's ring,
+	// then completes them all. Returns true if it popped an op it couldn't batch, which is left in op.
+	bool do_batched_io(IOWorker &worker, CtrlOp &op);
+
+	// Without io_uring, the op and any ops queued right behind it for the following pages of the same file
+	// are moved with a single preadv/pwritev, however scattered their frames are. Returns the same as do_batched_io.
+	bool do_vectored_io(IOWorker &worker, CtrlOp &op);
+
+	// The length to write for a page of a file at pos. For direct IO, this pads the frame out to whole blocks first.
+	uint32_t prepare_store(DescriptorInfo *desc_info, Frame *f, uint64_t pos, uint64_t &r_truncate);
+
+	// Marks the frame clean after a store that read it at the given version. If the page was written to while the store was out,
+	// it is still dirty, and an eviction may be waiting for it, so it is queued to be stored again at the given priority.
+	void finish_store(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame, uint32_t version, uint8_t priority);
+
+	// Writes count frames that hold consecutive pages of a file, starting at first_page, with a single write, and marks them clean.
+	// Every page but the last must be full. Pages written to in the meantime go out again at the given priority, see finish_store.
+	void write_run(DescriptorInfo *desc_info, page_id first_page, const frame_id *run, uint32_t count, uint8_t priority);
+
+	// Writes back all dirty pages of the file in file order, merging adjacent pages into writes of up to max_write_pages.
+	void write_back(DescriptorInfo *desc_info);
+
 	void do_load_op(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame, size_t offset);
-	void do_store_op(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame, size_t offset);
+	void do_store_op(DescriptorInfo *desc_info, page_id curr_page, frame_id curr_frame, size_t offset, uint8_t priority);
 
 	// Returns true if the page at the current offset is already tracked.
 	// Adds the current page to the tracked list, maps it to a frame and returns false if not.
-	// Also sets the values of the given page and frame id args.
-	bool get_page_or_do_paging_op(DescriptorInfo *desc_info, size_t offset);
+	// If no frame could be had because the pages up for eviction are all dirty, the page isn't mapped, and r_dirty_frame is
+	// set to a frame whose write-back has been queued. It is CS_MEM_VAL_BAD otherwise.
+	bool get_page_or_do_paging_op(DescriptorInfo *desc_info, size_t offset, uint32_t range_id, frame_id &r_dirty_frame);
 
 	// Expects that the page at the given offset is in the cache.
-	void enqueue_load(DescriptorInfo *desc_info, frame_id curr_frame, size_t offset);
+	void enqueue_load(DescriptorInfo *desc_info, frame_id curr_frame, size_t offset, uint8_t priority);
 
 	// Expects that the page at the given offset is in the cache.
-	void enqueue_store(DescriptorInfo *desc_info, frame_id curr_frame, size_t offset);
+	void enqueue_store(DescriptorInfo *desc_info, frame_id curr_frame, size_t offset, uint8_t priority);
+
+	// Queues a store for a dirty page that is about to be evicted, along with stores for the dirty pages
+	// right before and after it, so the worker can write them all at once. An eviction waits on them, so they go at demand priority.
+	void enqueue_write_back(DescriptorInfo *desc_info, page_id curr_page);
+
+	// Makes sure every page overlapping the given range of the file is in the cache, or queued to be loaded with the given CtrlOp::Priority.
+	// The loads are pushed a run of consecutive pages at a time, with one wakeup per run.
+	// Demand loads also promote any readahead loads still queued for pages in the range.
+	void load_range(DescriptorInfo *desc_info, size_t start, size_t end, uint8_t priority);
+
+	// The sequential stream detector. Called with the length of every read or write at the handle's offset.
+	// Once reads have been sequential for long enough to reach the readahead marker, the next window of
+	// pages is queued for loading and the window grows. Random access shrinks it again.
+	// Every handle has its own window, so readers of the same file at different places don't look random to each other.
+	void update_readahead(FileHandle *handle, size_t length);
+
+	// The stride detector. Feeds the read or write at the handle's offset to its StreamPrefetcher,
+	// and if that continues a stream, queues loads for the stream's next few records.
+	void update_prefetch(FileHandle *handle, size_t length);
 
 	void enqueue_flush(DescriptorInfo *desc_info);
 
 	void enqueue_flush_close(DescriptorInfo *desc_info);
 
+	// Makes everything written to the file so far durable, as far as its durability mode asks for.
+	// Called once per flush, after all dirty pages have been written back, and once more right before the file is closed.
+	// Each of those syncs the file exactly once, whether it has a raw descriptor, uses direct IO or neither.
+	void sync_data_source(DescriptorInfo *desc_info, bool closing);
+
 	// Flushes dirty pages of the file. Removes any pending store ops for the file from the operation queue.
 	//
 	// Expects the file pointer to be valid.
@@ -158,55 +449,98 @@ private:
 
 protected:
 public:
-	typedef void (FileCacheManager::*insertion_policy_fn)(page_id);
-	typedef page_id (FileCacheManager::*replacement_policy_fn)(DescriptorInfo *);
-	typedef void (FileCacheManager::*update_policy_fn)(page_id);
-	typedef void (FileCacheManager::*removal_policy_fn)(page_id);
-
-	page_id rp_lru(DescriptorInfo *desc_info);
-	page_id rp_fifo(DescriptorInfo *desc_info);
-	page_id rp_keep(DescriptorInfo *desc_info);
-
-	void rmp_lru(page_id curr_page);
-	void rmp_fifo(page_id curr_page);
-	void rmp_keep(page_id curr_page);
-
-	void ip_lru(page_id curr_page);
-	void ip_fifo(page_id curr_page);
-	void ip_keep(page_id curr_page);
-
-	void up_lru(page_id curr_page);
-	void up_fifo(page_id curr_page);
-	void up_keep(page_id curr_page);
-
-	insertion_policy_fn cache_insertion_policies[3] = {
+	// Policies work on the shard of the page they are given, which must be locked.
+	typedef void (FileCacheManager::*insertion_policy_fn)(Shard &, page_id);
+	typedef page_id (FileCacheManager::*replacement_policy_fn)(Shard &, DescriptorInfo *, page_id);
+	typedef void (FileCacheManager::*update_policy_fn)(Shard &, page_id);
+	typedef void (FileCacheManager::*removal_policy_fn)(Shard &, page_id);
+	typedef page_id (FileCacheManager::*victim_policy_fn)(const Shard &, page_id) const;
+
+	page_id rp_lru(Shard &s, DescriptorInfo *desc_info, page_id incoming_page);
+	page_id rp_fifo(Shard &s, DescriptorInfo *desc_info, page_id incoming_page);
+	page_id rp_keep(Shard &s, DescriptorInfo *desc_info, page_id incoming_page);
+	page_id rp_clock(Shard &s, DescriptorInfo *desc_info, page_id incoming_page);
+	page_id rp_arc(Shard &s, DescriptorInfo *desc_info, page_id incoming_page);
+	page_id rp_twoq(Shard &s, DescriptorInfo *desc_info, page_id incoming_page);
+
+	page_id vp_lru(const Shard &s, page_id incoming_page) const;
+	page_id vp_fifo(const Shard &s, page_id incoming_page) const;
+	page_id vp_keep(const Shard &s, page_id incoming_page) const;
+	page_id vp_clock(const Shard &s, page_id incoming_page) const;
+	page_id vp_arc(const Shard &s, page_id incoming_page) const;
+	page_id vp_twoq(const Shard &s, page_id incoming_page) const;
+
+	void rmp_lru(Shard &s, page_id curr_page);
+	void rmp_fifo(Shard &s, page_id curr_page);
+	void rmp_keep(Shard &s, page_id curr_page);
+	void rmp_clock(Shard &s, page_id curr_page);
+	void rmp_arc(Shard &s, page_id curr_page);
+	void rmp_twoq(Shard &s, page_id curr_page);
+
+	void ip_lru(Shard &s, page_id curr_page);
+	void ip_fifo(Shard &s, page_id curr_page);
+	void ip_keep(Shard &s, page_id curr_page);
+	void ip_clock(Shard &s, page_id curr_page);
+	void ip_arc(Shard &s, page_id curr_page);
+	void ip_twoq(Shard &s, page_id curr_page);
+
+	void up_lru(Shard &s, page_id curr_page);
+	void up_fifo(Shard &s, page_id curr_page);
+	void up_keep(Shard &s, page_id curr_page);
+	void up_clock(Shard &s, page_id curr_page);
+	void up_arc(Shard &s, page_id curr_page);
+	void up_twoq(Shard &s, page_id curr_page);
+
+	insertion_policy_fn cache_insertion_policies[6] = {
 		&FileCacheManager::ip_keep,
 		&FileCacheManager::ip_lru,
-		&FileCacheManager::ip_fifo
+		&FileCacheManager::ip_fifo,
+		&FileCacheManager::ip_clock,
+		&FileCacheManager::ip_arc,
+		&FileCacheManager::ip_twoq
 	};
 
-	replacement_policy_fn cache_replacement_policies[3] = {
+	replacement_policy_fn cache_replacement_policies[6] = {
 		&FileCacheManager::rp_keep,
 		&FileCacheManager::rp_lru,
-		&FileCacheManager::rp_fifo
+		&FileCacheManager::rp_fifo,
+		&FileCacheManager::rp_clock,
+		&FileCacheManager::rp_arc,
+		&FileCacheManager::rp_twoq
 	};
 
-	update_policy_fn cache_update_policies[3] = {
+	update_policy_fn cache_update_policies[6] = {
 		&FileCacheManager::up_keep,
 		&FileCacheManager::up_lru,
-		&FileCacheManager::up_fifo
+		&FileCacheManager::up_fifo,
+		&FileCacheManager::up_clock,
+		&FileCacheManager::up_arc,
+		&FileCacheManager::up_twoq
 	};
 
-	removal_policy_fn cache_removal_policies[3] = {
+	removal_policy_fn cache_removal_policies[6] = {
 		&FileCacheManager::rmp_keep,
 		&FileCacheManager::rmp_lru,
-		&FileCacheManager::rmp_fifo
+		&FileCacheManager::rmp_fifo,
+		&FileCacheManager::rmp_clock,
+		&FileCacheManager::rmp_arc,
+		&FileCacheManager::rmp_twoq
+	};
+
+	victim_policy_fn cache_victim_policies[6] = {
+		&FileCacheManager::vp_keep,
+		&FileCacheManager::vp_lru,
+		&FileCacheManager::vp_fifo,
+		&FileCacheManager::vp_clock,
+		&FileCacheManager::vp_arc,
+		&FileCacheManager::vp_twoq
 	};
 
 	FileCacheManager();
 	~FileCacheManager();
 
-	// Returns an RID to an open file. If the file was previously tracked, it seeks to the offset of the file when it was closed.
+	// Returns the RID of a new handle to the file. Every handle has its own offset, error state and readahead,
+	// and all handles to a file share its cached pages and backing file.
 	//
 	// Returns a valid RID if:
 	//
@@ -214,16 +548,22 @@ public:
 	//
 	// or
 	//
-	// The file is already tracked and is closed. The file is reopened with the mode and cache policy specified.
+	// The file is already tracked and is closed. The file is reopened with the mode and cache policy specified,
+	// and the handle starts at the offset the file's last handle was closed at.
+	//
+	// or
+	//
+	// The file is already open. The handle starts at offset 0 and uses the file's current cache policy.
+	// This only works if the mode doesn't truncate the file, and doesn't need writing if the file is open read only.
 	//
-	// Returns an invalid RID if the file is currently already open. Only one FileAccessCached instance can hold the RID for one file.
 	// Returns an invalid RID if the file cannot be opened; this is similar to the normal FileAccess API.
 	RID open(const String &path, int p_mode, int cache_policy);
 
-	// Close the file but keep its contents in the cache. None of the state information (like current offset) is invalidated.
+	// Close the handle and invalidate its RID. Once the last handle to a file is closed, the file is closed
+	// but its contents are kept in the cache.
 	void close(RID rid);
 
-	// Invalidates the RID. The associated file will no longer be tracked.
+	// Close the handle and invalidate its RID. The associated file will no longer be tracked once its last handle is closed.
 	void permanent_close(RID rid);
 
 
@@ -231,24 +571,158 @@ public:
 	size_t write(RID rid, const void *const data, size_t length);
 	size_t seek(RID rid, int64_t new_offset, int mode);
 
+	// A read only view of part of a cached file, filled in by pin.
+	// The spans point straight into the cache's frames, which stay pinned until the view is released, so they can't be evicted.
+	// Writes to those pages through other handles show up in the view as they happen.
+	// A view is released when it is destroyed, or by calling release.
+	class PageView {
+		friend class FileCacheManager;
+
+	public:
+		struct Span {
+			const uint8_t *ptr;
+			size_t len;
+		};
+
+	private:
+		FileHandle *handle;
+		Span spans[CS_VIEW_MAX_PAGES];
+		page_id pages[CS_VIEW_MAX_PAGES];
+		frame_id pinned[CS_VIEW_MAX_PAGES];
+		uint32_t span_count;
+		// Holds the whole range instead, if it couldn't be pinned. There is a single span over it then.
+		uint8_t *copy;
+		size_t length;
+
+		PageView(const PageView &);
+		PageView &operator=(const PageView &);
+
+	public:
+		_FORCE_INLINE_ uint32_t get_span_count() const { return span_count; }
+		_FORCE_INLINE_ const Span &get_span(uint32_t i) const { return spans[i]; }
+		_FORCE_INLINE_ size_t get_length() const { return length; }
+		// False if the range had to be copied.
+		_FORCE_INLINE_ bool is_zero_copy() const { return copy == NULL; }
+
+		void release();
+
+		PageView() :
+				handle(NULL),
+				span_count(0),
+				copy(NULL),
+				length(0) {}
+
+		~PageView() {
+			release();
+		}
+	};
+
+	// Points r_view at length bytes of the file from offset, without copying them. The range is cut off at the end of the file.
+	// The handle's offset doesn't move. Any view r_view held before is released first.
+	//
+	// Pages that are still being loaded are waited for. If a page isn't in the cache at all, the range covers more than
+	// CS_VIEW_MAX_PAGES pages, or a shard has too many pinned frames already, the range is read into a buffer owned by the view instead.
+	//
+	// Every view has to be released before its handle is closed.
+	Error pin(RID rid, size_t offset, size_t length, PageView &r_view);
+
+	// Releases the view's pages, same as PageView::release.
+	void unpin(PageView &view);
+
 	// utility method to dump the cache manager's current state as a variant.
 	Variant _get_state() {
 
+		Dictionary d;
+
+		// The policy state is summed over the shards. They're done before files_lock is taken, evictions take them the other way around.
+		uint32_t arc_p = 0, arc_t1 = 0, arc_t2 = 0, arc_b1 = 0, arc_b2 = 0;
+		uint32_t twoq_a1in = 0, twoq_am = 0, twoq_a1out = 0;
+		uint64_t admission_rejects = 0;
+		for (int i = 0; i < shards.size(); ++i) {
+			Shard &s = *shards[i];
+			MutexLock ml(s.lock);
+			arc_p += s.arc_p;
+			arc_t1 += s.arc_t1.size();
+			arc_t2 += s.arc_t2.size();
+			arc_b1 += s.arc_b1.size();
+			arc_b2 += s.arc_b2.size();
+			twoq_a1in += s.twoq_a1in.size();
+			twoq_am += s.twoq_am.size();
+			twoq_a1out += s.twoq_a1out.size();
+			admission_rejects += s.admission_rejects;
+		}
+
+		d["shards"] = Variant(shards.size());
+
+		// Open and close change the files' handles.
+		MutexLock ml(mutex);
+
+		Dictionary arc;
+		arc["p"] = Variant(arc_p);
+		arc["t1"] = Variant(arc_t1);
+		arc["t2"] = Variant(arc_t2);
+		arc["b1"] = Variant(arc_b1);
+		arc["b2"] = Variant(arc_b2);
+		d["arc"] = arc;
+
+		Dictionary twoq;
+		twoq["a1in"] = Variant(twoq_a1in);
+		twoq["am"] = Variant(twoq_am);
+		twoq["a1out"] = Variant(twoq_a1out);
+		d["twoq"] = twoq;
+
+		if (admission_filter) {
+			d["admission_rejects"] = Variant(admission_rejects);
+		}
+
 		List<uint32_t> keys;
+		files_lock->read_lock();
 		files.get_key_list(&keys);
-		Dictionary d;
 
 		for (List<uint32_t>::Element *i = keys.front(); i; i = i->next()) {
 
 			d[files[i->get()]->path] = files[i->get()]->to_variant(*this);
 		}
 
+		// How often the stride prefetchers' streams guessed the next access right, over all open handles.
+		uint64_t predictions = 0;
+		uint64_t hits = 0;
+		for (List<uint32_t>::Element *i = keys.front(); i; i = i->next()) {
+			const Vector<FileHandle *> &handles = files[i->get()]->handles;
+			for (int h = 0; h < handles.size(); ++h) {
+				predictions += handles[h]->prefetcher.get_predictions();
+				hits += handles[h]->prefetcher.get_hits();
+			}
+		}
+		files_lock->read_unlock();
+
+		Dictionary prefetch;
+		prefetch["predictions"] = Variant(predictions);
+		prefetch["hits"] = Variant(hits);
+		prefetch["accuracy"] = Variant(predictions ? (double)hits / predictions : 0.0);
+		d["prefetch"] = prefetch;
+
+		Dictionary io;
+		io["pages_read"] = Variant(io_stats.pages_read.load(std::memory_order_relaxed));
+		io["pages_written"] = Variant(io_stats.pages_written.load(std::memory_order_relaxed));
+		io["read_calls"] = Variant(io_stats.read_calls.load(std::memory_order_relaxed));
+		io["write_calls"] = Variant(io_stats.write_calls.load(std::memory_order_relaxed));
+		io["ring_submits"] = Variant(io_stats.ring_submits.load(std::memory_order_relaxed));
+		uint64_t calls = io_stats.read_calls.load(std::memory_order_relaxed) + io_stats.write_calls.load(std::memory_order_relaxed) + io_stats.ring_submits.load(std::memory_order_relaxed);
+		uint64_t pages = io_stats.pages_read.load(std::memory_order_relaxed) + io_stats.pages_written.load(std::memory_order_relaxed);
+		io["pages_per_call"] = Variant(calls ? (double)pages / calls : 0.0);
+		d["io"] = io;
+
 		return Variant(d);
 	}
 
 	static FileCacheManager *get_singleton();
 
-	Error init();
+	// Allocates the frame pool. IO workers are started as files on new devices are opened.
+	// A page size or cache size of 0 means the value is taken from the project settings
+	// (cacheserv/cache/page_size and cacheserv/cache/pool_size).
+	// The page size is rounded to a power of two between CS_PAGE_SIZE_MIN and CS_PAGE_SIZE_MAX.
+	Error init(size_t p_page_size = 0, size_t p_cache_size = 0);
 
 	// Checks that all required pages are loaded and enqueues uncached pages for loading.
 	void check_cache(RID rid, size_t length);
@@ -261,10 +735,11 @@ public:
 	_FORCE_INLINE_ void seek(RID rid, size_t p_position) { seek(rid, p_position, SEEK_SET); } ///< seek to a given position
 	_FORCE_INLINE_ void seek_end(RID rid, int64_t p_position) { seek(rid, p_position, SEEK_END); } ///< seek from the end of file
 
-	size_t get_position(RID rid) const { return files[rid.get_id()]->offset; } ///< get position in the file
+	size_t get_position(RID rid) const { return get_handle(rid)->offset; } ///< get position in the file
 	size_t get_len(RID rid) const; ///< get size of the file
 
 	bool eof_reached(RID rid) const; ///< reading passed EOF
+	Error get_error(RID rid) const; ///< get the handle's last error
 
 	// Flush cache to disk.
 	void flush(RID rid);
@@ -289,13 +764,22 @@ protected:
 		BIND_ENUM_CONSTANT(KEEP);
 		BIND_ENUM_CONSTANT(LRU);
 		BIND_ENUM_CONSTANT(FIFO);
+		BIND_ENUM_CONSTANT(CLOCK);
+		BIND_ENUM_CONSTANT(ARC);
+		BIND_ENUM_CONSTANT(TWOQ);
 	}
 
 public:
 	enum CachePolicy {
 		KEEP,
 		LRU,
-		FIFO
+		FIFO,
+		// Approximates LRU. A hit only sets the frame's reference bit, which makes hits much cheaper under contention.
+		CLOCK,
+		// Adaptive Replacement Cache. Balances recency against frequency using the history of evicted pages.
+		ARC,
+		// 2Q. Pages read once age out of a probationary queue without displacing frequently used pages.
+		TWOQ
 	};
 
 	_FileCacheManager();
@@ -306,26 +790,4 @@ public:
 VARIANT_ENUM_CAST(_FileCacheManager::CachePolicy);
 
 
-// A comparator functor to sort page IDs according to the LRU paging algorithm.
-struct LRUComparator {
-	const FileCacheManager *const fcm;
-
-	LRUComparator() :
-			fcm(FileCacheManager::get_singleton()) {}
-
-	_FORCE_INLINE_ bool operator()(page_id p1, page_id p2) {
-		page_id a = fcm->frames[fcm->page_frame_map[p1]]->get_last_use();
-
-		page_id b = fcm->frames[fcm->page_frame_map[p2]]->get_last_use();
-
-		// Older pages have lower last_use values.
-		// This means that to sort by longest age we must compare for the least value of last_use.
-		// if x == false: page p1 is younger than p2.
-		// else: page p1 is older than p2.
-		bool x = a > b;
-
-		return x;
-	}
-};
-
 #endif // !FILE_CACHE_MANAGER_H
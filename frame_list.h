@@ -0,0 +1,184 @@
+/*************************************************************************/
+/*  frame_list.h                                                         */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef FRAME_LIST_H
+#define FRAME_LIST_H
+
+#include "core/error_macros.h"
+#include "core/typedefs.h"
+
+#include "cacheserv_defines.h"
+#include "data_helpers.h"
+
+// Identifies the list a frame is currently linked into. A frame can be in at most one list at a time.
+enum FrameListTag {
+	FRAME_LIST_NONE,
+	FRAME_LIST_LRU,
+	FRAME_LIST_FIFO,
+	FRAME_LIST_KEEP,
+	FRAME_LIST_CLOCK,
+	FRAME_LIST_ARC_T1,
+	FRAME_LIST_ARC_T2,
+	FRAME_LIST_TWOQ_A1IN,
+	FRAME_LIST_TWOQ_AM,
+};
+
+// A doubly linked list of frames whose links are stored in the frames themselves.
+//
+// Linking, unlinking and moving a frame are O(1) and never allocate.
+// The front of the list holds the most recently inserted or used frame, and the back holds the oldest.
+class FrameList {
+	Frame *const *frames;
+	frame_id head;
+	frame_id tail;
+	uint32_t count;
+	uint8_t tag;
+
+public:
+	void init(Frame *const *p_frames, uint8_t p_tag) {
+		frames = p_frames;
+		tag = p_tag;
+		head = CS_MEM_VAL_BAD;
+		tail = CS_MEM_VAL_BAD;
+		count = 0;
+	}
+
+	_FORCE_INLINE_ bool has(frame_id f) const {
+		return f != (frame_id)CS_MEM_VAL_BAD && frames[f]->list_tag == tag;
+	}
+
+	_FORCE_INLINE_ frame_id front() const { return head; }
+	_FORCE_INLINE_ frame_id back() const { return tail; }
+	_FORCE_INLINE_ frame_id next(frame_id f) const { return frames[f]->list_next; }
+	_FORCE_INLINE_ frame_id prev(frame_id f) const { return frames[f]->list_prev; }
+	_FORCE_INLINE_ uint32_t size() const { return count; }
+	_FORCE_INLINE_ bool empty() const { return count == 0; }
+
+	void push_front(frame_id f) {
+		Frame *frame = frames[f];
+		CRASH_COND(frame->list_tag != FRAME_LIST_NONE);
+
+		frame->list_tag = tag;
+		frame->list_prev = CS_MEM_VAL_BAD;
+		frame->list_next = head;
+
+		if (head != (frame_id)CS_MEM_VAL_BAD)
+			frames[head]->list_prev = f;
+		else
+			tail = f;
+
+		head = f;
+		count += 1;
+	}
+
+	void push_back(frame_id f) {
+		Frame *frame = frames[f];
+		CRASH_COND(frame->list_tag != FRAME_LIST_NONE);
+
+		frame->list_tag = tag;
+		frame->list_next = CS_MEM_VAL_BAD;
+		frame->list_prev = tail;
+
+		if (tail != (frame_id)CS_MEM_VAL_BAD)
+			frames[tail]->list_next = f;
+		else
+			head = f;
+
+		tail = f;
+		count += 1;
+	}
+
+	// Links the frame in just before pos, or at the back if pos is CS_MEM_VAL_BAD.
+	void insert_before(frame_id pos, frame_id f) {
+		if (pos == (frame_id)CS_MEM_VAL_BAD) {
+			push_back(f);
+			return;
+		}
+		if (pos == head) {
+			push_front(f);
+			return;
+		}
+
+		Frame *frame = frames[f];
+		CRASH_COND(frame->list_tag != FRAME_LIST_NONE);
+		CRASH_COND(frames[pos]->list_tag != tag);
+
+		frame->list_tag = tag;
+		frame->list_next = pos;
+		frame->list_prev = frames[pos]->list_prev;
+		frames[frame->list_prev]->list_next = f;
+		frames[pos]->list_prev = f;
+		count += 1;
+	}
+
+	// Expects the frame to be in this list.
+	void remove(frame_id f) {
+		Frame *frame = frames[f];
+		CRASH_COND(frame->list_tag != tag);
+
+		if (frame->list_prev != (frame_id)CS_MEM_VAL_BAD)
+			frames[frame->list_prev]->list_next = frame->list_next;
+		else
+			head = frame->list_next;
+
+		if (frame->list_next != (frame_id)CS_MEM_VAL_BAD)
+			frames[frame->list_next]->list_prev = frame->list_prev;
+		else
+			tail = frame->list_prev;
+
+		frame->list_tag = FRAME_LIST_NONE;
+		frame->list_prev = CS_MEM_VAL_BAD;
+		frame->list_next = CS_MEM_VAL_BAD;
+		count -= 1;
+	}
+
+	// Removes and returns the oldest frame, or CS_MEM_VAL_BAD if the list is empty.
+	frame_id pop_back() {
+		frame_id f = tail;
+		if (f != (frame_id)CS_MEM_VAL_BAD) remove(f);
+		return f;
+	}
+
+	// Expects the frame to be in this list.
+	_FORCE_INLINE_ void move_to_front(frame_id f) {
+		if (head == f) return;
+		remove(f);
+		push_front(f);
+	}
+
+	FrameList() :
+			frames(NULL),
+			head(CS_MEM_VAL_BAD),
+			tail(CS_MEM_VAL_BAD),
+			count(0),
+			tag(FRAME_LIST_NONE) {}
+};
+
+#endif // FRAME_LIST_H
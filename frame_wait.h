@@ -0,0 +1,88 @@
+/*************************************************************************/
+/*  frame_wait.h                                                         */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef FRAME_WAIT_H
+#define FRAME_WAIT_H
+
+#include "core/os/os.h"
+#include "core/typedefs.h"
+
+#include "cacheserv_defines.h"
+
+#include <atomic>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Parking for threads waiting on a 32 bit state word, such as a frame's.
+//
+// On Linux this is a futex on the word itself, and park returns as soon as the word no longer holds
+// the expected value, so a wake can't be lost between checking the word and going to sleep.
+// Elsewhere, a parked thread just sleeps for a short while and checks the word again.
+class FrameWait {
+public:
+	// Sleeps until woken, unless the word has already moved on from expected. May return spuriously.
+	static void park(std::atomic<uint32_t> *word, uint32_t expected) {
+#ifdef __linux__
+		syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+#else
+		if (word->load(std::memory_order_acquire) == expected) OS::get_singleton()->delay_usec(CS_FRAME_WAIT_SLEEP_USEC);
+#endif
+	}
+
+	// Wakes every thread parked on the word.
+	static void wake_all(std::atomic<uint32_t> *word) {
+#ifdef __linux__
+		syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#endif
+	}
+
+	// Waits until (word & mask) == value. Spins for a while first, since most page loads and stores
+	// finish quickly, then parks. waiters_bit is set in the word while anyone is parked, so whoever
+	// changes it knows to call wake_all, and nobody pays for a syscall when there's no one to wake.
+	static void wait_for(std::atomic<uint32_t> *word, uint32_t mask, uint32_t value, uint32_t waiters_bit) {
+		for (int i = 0; i < CS_FRAME_WAIT_SPIN; ++i) {
+			if ((word->load(std::memory_order_acquire) & mask) == value) return;
+			if (i >= CS_FRAME_WAIT_SPIN / 2) OS::get_singleton()->delay_usec(0);
+		}
+
+		while (true) {
+			uint32_t s = word->load(std::memory_order_acquire);
+			if ((s & mask) == value) return;
+			if (!(s & waiters_bit) && !word->compare_exchange_weak(s, s | waiters_bit, std::memory_order_acq_rel)) continue;
+			park(word, s | waiters_bit);
+		}
+	}
+};
+
+#endif // FRAME_WAIT_H
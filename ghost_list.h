@@ -0,0 +1,167 @@
+/*************************************************************************/
+/*  ghost_list.h                                                         */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef GHOST_LIST_H
+#define GHOST_LIST_H
+
+#include "core/error_macros.h"
+#include "core/os/memory.h"
+#include "core/typedefs.h"
+
+#include "cacheserv_defines.h"
+#include "page_table.h"
+
+// A bounded, recency ordered list of pages that are no longer in the cache.
+//
+// Adaptive policies use ghost lists to remember what they recently evicted, so they can tell when
+// they evicted the wrong page. Only page GUIDs are kept, never data.
+//
+// Nodes come from a fixed pool and a PageTable maps each page to its node, so membership tests,
+// insertion and removal are O(1) and never allocate. Pushing onto a full list drops its oldest page.
+class GhostList {
+
+	struct Node {
+		page_id page;
+		uint32_t prev;
+		uint32_t next;
+	};
+
+	Node *nodes;
+	PageTable index;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t free_head;
+
+	void unlink(uint32_t n) {
+		Node &node = nodes[n];
+
+		if (node.prev != (uint32_t)CS_MEM_VAL_BAD)
+			nodes[node.prev].next = node.next;
+		else
+			head = node.next;
+
+		if (node.next != (uint32_t)CS_MEM_VAL_BAD)
+			nodes[node.next].prev = node.prev;
+		else
+			tail = node.prev;
+
+		index.erase(node.page);
+
+		node.next = free_head;
+		free_head = n;
+		count -= 1;
+	}
+
+public:
+	void init(uint32_t p_capacity) {
+		release();
+
+		capacity = MAX(p_capacity, 1u);
+		nodes = memnew_arr(Node, capacity);
+		index.init(capacity);
+
+		for (uint32_t i = 0; i < capacity; ++i) {
+			nodes[i].next = i + 1 < capacity ? i + 1 : CS_MEM_VAL_BAD;
+		}
+		free_head = 0;
+	}
+
+	void release() {
+		if (nodes) memdelete_arr(nodes);
+		nodes = NULL;
+		index.release();
+		capacity = 0;
+		count = 0;
+		head = CS_MEM_VAL_BAD;
+		tail = CS_MEM_VAL_BAD;
+		free_head = CS_MEM_VAL_BAD;
+	}
+
+	_FORCE_INLINE_ bool has(page_id page) const {
+		return index.has(page);
+	}
+
+	// Returns true if the page was in the list.
+	bool remove(page_id page) {
+		uint32_t n = index.get(page);
+		if (n == (uint32_t)CS_MEM_VAL_BAD) return false;
+		unlink(n);
+		return true;
+	}
+
+	// Returns the oldest page in the list after removing it, or CS_MEM_VAL_BAD if the list is empty.
+	page_id pop_back() {
+		if (tail == (uint32_t)CS_MEM_VAL_BAD) return CS_MEM_VAL_BAD;
+		page_id page = nodes[tail].page;
+		unlink(tail);
+		return page;
+	}
+
+	void push_front(page_id page) {
+		ERR_FAIL_COND(!capacity);
+
+		remove(page);
+		if (count == capacity) pop_back();
+
+		uint32_t n = free_head;
+		free_head = nodes[n].next;
+
+		nodes[n].page = page;
+		nodes[n].prev = CS_MEM_VAL_BAD;
+		nodes[n].next = head;
+
+		if (head != (uint32_t)CS_MEM_VAL_BAD)
+			nodes[head].prev = n;
+		else
+			tail = n;
+
+		head = n;
+		count += 1;
+		index.insert(page, n);
+	}
+
+	_FORCE_INLINE_ uint32_t size() const { return count; }
+
+	GhostList() :
+			nodes(NULL),
+			capacity(0),
+			count(0),
+			head(CS_MEM_VAL_BAD),
+			tail(CS_MEM_VAL_BAD),
+			free_head(CS_MEM_VAL_BAD) {}
+
+	~GhostList() {
+		release();
+	}
+};
+
+#endif // GHOST_LIST_H
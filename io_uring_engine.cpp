@@ -0,0 +1,300 @@
+/*************************************************************************/
+/*  io_uring_engine.cpp                                                  */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "io_uring_engine.h"
+
+#include "core/error_macros.h"
+
+#ifdef CS_IO_URING_ENABLED
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#define RING_PTR(base, off) ((uint32_t *)((uint8_t *)(base) + (off)))
+
+bool IOUringEngine::init(uint32_t entries, uint8_t *p_buffer, size_t p_buffer_len) {
+	release();
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = sys_io_uring_setup(entries, &p);
+	if (fd < 0) {
+		// ENOSYS on old kernels, EPERM when blocked by seccomp or sysctl.
+		return false;
+	}
+
+	sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		sq_ring_size = cq_ring_size = MAX(sq_ring_size, cq_ring_size);
+	}
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED) {
+		sq_ring = NULL;
+		::close(fd);
+		return false;
+	}
+
+	if (single_mmap) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED) {
+			cq_ring = NULL;
+			ring_fd = fd;
+			release();
+			return false;
+		}
+	}
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		sqes = NULL;
+		ring_fd = fd;
+		release();
+		return false;
+	}
+
+	ring_fd = fd;
+	sq_entries = p.sq_entries;
+
+	sq_head = RING_PTR(sq_ring, p.sq_off.head);
+	sq_tail = RING_PTR(sq_ring, p.sq_off.tail);
+	sq_mask = RING_PTR(sq_ring, p.sq_off.ring_mask);
+	sq_array = RING_PTR(sq_ring, p.sq_off.array);
+	cq_head = RING_PTR(cq_ring, p.cq_off.head);
+	cq_tail = RING_PTR(cq_ring, p.cq_off.tail);
+	cq_mask = RING_PTR(cq_ring, p.cq_off.ring_mask);
+	cqes = (uint8_t *)cq_ring + p.cq_off.cqes;
+
+	buffer = p_buffer;
+	buffer_len = p_buffer_len;
+
+	if (buffer) {
+		struct iovec iov;
+		iov.iov_base = buffer;
+		iov.iov_len = buffer_len;
+		fixed_buffers = sys_io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+	}
+
+	return true;
+}
+
+void IOUringEngine::release() {
+	if (sqes) munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+	if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+	if (sq_ring) munmap(sq_ring, sq_ring_size);
+	if (ring_fd >= 0) ::close(ring_fd);
+
+	ring_fd = -1;
+	sq_entries = 0;
+	to_submit = 0;
+	fixed_buffers = false;
+	sq_ring = NULL;
+	cq_ring = NULL;
+	sqes = NULL;
+}
+
+bool IOUringEngine::queue_op(uint8_t opcode, int fd, const uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data) {
+	ERR_FAIL_COND_V(ring_fd < 0, false);
+
+	uint32_t tail = *sq_tail;
+	uint32_t head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= sq_entries) return false;
+
+	uint32_t idx = tail & *sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+
+	// Fixed ops can only be used if the whole transfer lies inside the registered buffer.
+	bool fixed = fixed_buffers && buf >= buffer && buf + len <= buffer + buffer_len;
+
+	if (opcode == IORING_OP_READ_FIXED) {
+		sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	} else {
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	}
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = 0;
+	sqe->user_data = user_data;
+
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	to_submit += 1;
+
+	return true;
+}
+
+bool IOUringEngine::queue_read(int fd, uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data) {
+	return queue_op(IORING_OP_READ_FIXED, fd, buf, len, offset, user_data);
+}
+
+bool IOUringEngine::queue_write(int fd, const uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data) {
+	return queue_op(IORING_OP_WRITE_FIXED, fd, buf, len, offset, user_data);
+}
+
+int IOUringEngine::submit_and_wait(uint32_t wait_nr) {
+	ERR_FAIL_COND_V(ring_fd < 0, -EBADF);
+
+	int ret;
+	do {
+		ret = sys_io_uring_enter(ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) return -errno;
+
+	to_submit -= ret;
+	return ret;
+}
+
+uint32_t IOUringEngine::take_unsubmitted(uint64_t *out, uint32_t max) {
+	// Without SQPOLL the kernel only consumes entries in io_uring_enter, so the unsubmitted tail is still ours.
+	uint32_t tail = *sq_tail;
+	uint32_t n = MIN(to_submit, max);
+	tail -= n;
+	for (uint32_t i = 0; i < n; ++i) {
+		out[i] = ((struct io_uring_sqe *)sqes + ((tail + i) & *sq_mask))->user_data;
+	}
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+	to_submit -= n;
+	return n;
+}
+
+uint32_t IOUringEngine::reap(Completion *out, uint32_t max) {
+	uint32_t head = *cq_head;
+	uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	uint32_t n = 0;
+
+	while (head != tail && n < max) {
+		struct io_uring_cqe *cqe = (struct io_uring_cqe *)cqes + (head & *cq_mask);
+		out[n].user_data = cqe->user_data;
+		out[n].res = cqe->res;
+		n += 1;
+		head += 1;
+	}
+
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+bool IOUringEngine::is_supported() {
+	IOUringEngine probe;
+	return probe.init(1, NULL, 0);
+}
+
+#undef RING_PTR
+
+#else // CS_IO_URING_ENABLED
+
+bool IOUringEngine::init(uint32_t entries, uint8_t *p_buffer, size_t p_buffer_len) {
+	return false;
+}
+
+void IOUringEngine::release() {
+}
+
+bool IOUringEngine::queue_op(uint8_t opcode, int fd, const uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data) {
+	return false;
+}
+
+bool IOUringEngine::queue_read(int fd, uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data) {
+	return false;
+}
+
+bool IOUringEngine::queue_write(int fd, const uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data) {
+	return false;
+}
+
+int IOUringEngine::submit_and_wait(uint32_t wait_nr) {
+	return -1;
+}
+
+uint32_t IOUringEngine::reap(Completion *out, uint32_t max) {
+	return 0;
+}
+
+uint32_t IOUringEngine::take_unsubmitted(uint64_t *out, uint32_t max) {
+	return 0;
+}
+
+bool IOUringEngine::is_supported() {
+	return false;
+}
+
+#endif // CS_IO_URING_ENABLED
+
+IOUringEngine::IOUringEngine() :
+		ring_fd(-1),
+		sq_entries(0),
+		to_submit(0),
+		fixed_buffers(false),
+		buffer(NULL),
+		buffer_len(0),
+		sq_ring(NULL),
+		cq_ring(NULL),
+		sq_ring_size(0),
+		cq_ring_size(0),
+		sqes(NULL),
+		sq_head(NULL),
+		sq_tail(NULL),
+		sq_mask(NULL),
+		sq_array(NULL),
+		cq_head(NULL),
+		cq_tail(NULL),
+		cq_mask(NULL),
+		cqes(NULL) {}
+
+IOUringEngine::~IOUringEngine() {
+	release();
+}
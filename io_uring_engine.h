@@ -0,0 +1,114 @@
+/*************************************************************************/
+/*  io_uring_engine.h                                                    */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef IO_URING_ENGINE_H
+#define IO_URING_ENGINE_H
+
+#include "core/typedefs.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CS_IO_URING_ENABLED
+#endif
+#endif
+
+// A minimal io_uring submission/completion ring, driven through the raw syscalls so we don't need liburing.
+//
+// Each IO worker owns one engine and is the only thread that touches it.
+// The frame pool is registered as a fixed buffer when the kernel allows it, so reads and writes into
+// frames don't have to pin and unpin their pages on every op. When registration fails (usually
+// because of RLIMIT_MEMLOCK), ops fall back to plain reads and writes on the same ring.
+//
+// On platforms without io_uring init() always fails and the worker does its IO synchronously.
+class IOUringEngine {
+
+	int ring_fd;
+	uint32_t sq_entries;
+	uint32_t to_submit;
+	bool fixed_buffers;
+
+	uint8_t *buffer;
+	size_t buffer_len;
+
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	void *sqes;
+
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	void *cqes;
+
+	bool queue_op(uint8_t opcode, int fd, const uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data);
+
+public:
+	struct Completion {
+		uint64_t user_data;
+		int32_t res;
+	};
+
+	// Sets up a ring with room for the given number of in flight ops, registering the buffer if possible.
+	// Returns false if io_uring isn't usable here.
+	bool init(uint32_t entries, uint8_t *p_buffer, size_t p_buffer_len);
+	void release();
+
+	_FORCE_INLINE_ bool is_ready() const { return ring_fd >= 0; }
+	_FORCE_INLINE_ uint32_t get_capacity() const { return sq_entries; }
+
+	// Queues a read or write, nothing reaches the kernel until submit_and_wait() is called.
+	// Returns false if the submission queue is full.
+	bool queue_read(int fd, uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data);
+	bool queue_write(int fd, const uint8_t *buf, uint32_t len, uint64_t offset, uint64_t user_data);
+
+	// Submits every queued op and blocks until at least wait_nr completions are available.
+	// Returns the number of ops submitted, or a negative errno.
+	int submit_and_wait(uint32_t wait_nr);
+
+	// Copies up to max available completions into out and returns how many there were.
+	uint32_t reap(Completion *out, uint32_t max);
+
+	// Takes back the ops queued since the last successful submit, for when io_uring_enter fails.
+	// Writes their user_data to out and returns how many there were. The kernel never sees them.
+	uint32_t take_unsubmitted(uint64_t *out, uint32_t max);
+
+	// Returns true if a ring can be created at all, without keeping it.
+	static bool is_supported();
+
+	IOUringEngine();
+	~IOUringEngine();
+};
+
+#endif // IO_URING_ENGINE_H
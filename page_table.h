@@ -0,0 +1,334 @@
+/*************************************************************************/
+/*  page_table.h                                                         */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef PAGE_TABLE_H
+#define PAGE_TABLE_H
+
+#include "core/error_macros.h"
+#include "core/os/memory.h"
+#include "core/typedefs.h"
+
+#include "cacheserv_defines.h"
+
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CS_PAGE_TABLE_SSE2
+#endif
+
+// A flat open-addressing hash table mapping page GUIDs to frame ids.
+//
+// The table is laid out as groups of 16 control bytes followed by parallel key and value arrays.
+// A control byte is either empty, deleted (a tombstone) or holds the low 7 bits of the key's hash.
+// A lookup compares the 7 hash bits against a whole group at once (with SSE2 where available),
+// so most probes touch one cache line of control bytes and one key.
+//
+// The table never grows. Its capacity is fixed in init() from the maximum number of entries,
+// which for the page table is the number of frames in the cache.
+//
+// Only one thread may modify the table at a time, but any number of threads may look up pages
+// concurrently with that writer. Every modification is wrapped in a sequence counter and readers
+// retry if a modification happened while they were probing.
+class PageTable {
+
+	enum {
+		GROUP_WIDTH = 16,
+		CTRL_EMPTY = -128,
+		CTRL_DELETED = -2,
+	};
+
+	int8_t *ctrl;
+	page_id *keys;
+	frame_id *values;
+
+	uint32_t capacity;
+	uint32_t group_mask;
+	uint32_t count;
+	uint32_t tombstones;
+
+	std::atomic<uint32_t> version;
+
+public:
+	// FileCacheManager also picks a page's shard from bits 32 and up, which no table of a realistic size probes with.
+	static _FORCE_INLINE_ uint64_t hash(page_id key) {
+		// Finaliser from MurmurHash3. Page GUIDs differ mostly in bits 12 to 40, so they need to be mixed well.
+		key ^= key >> 33;
+		key *= 0xFF51AFD7ED558CCDULL;
+		key ^= key >> 33;
+		key *= 0xC4CEB9FE1A85EC53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+private:
+	static _FORCE_INLINE_ int8_t h2(uint64_t h) { return (int8_t)(h & 0x7F); }
+	static _FORCE_INLINE_ uint32_t h1(uint64_t h) { return (uint32_t)(h >> 7); }
+
+	// Returns a bitmask with bit i set if the i-th control byte of the group equals the given value.
+	static _FORCE_INLINE_ uint32_t match(const int8_t *group, int8_t value) {
+#ifdef CS_PAGE_TABLE_SSE2
+		__m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+		return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(value), g));
+#else
+		uint32_t mask = 0;
+		for (int i = 0; i < GROUP_WIDTH; ++i) {
+			mask |= (uint32_t)(group[i] == value) << i;
+		}
+		return mask;
+#endif
+	}
+
+	// Returns a bitmask of the empty or deleted slots in the group.
+	static _FORCE_INLINE_ uint32_t match_free(const int8_t *group) {
+#ifdef CS_PAGE_TABLE_SSE2
+		// Only CTRL_EMPTY and CTRL_DELETED have their sign bit set.
+		__m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+		return (uint32_t)_mm_movemask_epi8(g);
+#else
+		uint32_t mask = 0;
+		for (int i = 0; i < GROUP_WIDTH; ++i) {
+			mask |= (uint32_t)(group[i] < 0) << i;
+		}
+		return mask;
+#endif
+	}
+
+	static _FORCE_INLINE_ uint32_t lowest_bit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctz(mask);
+#else
+		uint32_t i = 0;
+		while (!(mask & 1)) {
+			mask >>= 1;
+			i += 1;
+		}
+		return i;
+#endif
+	}
+
+	// Returns the slot holding the key, or -1 if it isn't present.
+	_FORCE_INLINE_ int64_t find_slot(page_id key) const {
+		if (!capacity) return -1;
+
+		uint64_t h = hash(key);
+		int8_t tag = h2(h);
+		uint32_t group = h1(h) & group_mask;
+
+		// Triangular probing over groups visits every group once when the group count is a power of two.
+		for (uint32_t i = 1; i <= group_mask + 1; ++i) {
+			const int8_t *g = ctrl + group * GROUP_WIDTH;
+
+			for (uint32_t m = match(g, tag); m; m &= m - 1) {
+				uint32_t slot = group * GROUP_WIDTH + lowest_bit(m);
+				if (keys[slot] == key) return slot;
+			}
+
+			if (match(g, CTRL_EMPTY)) return -1;
+
+			group = (group + i) & group_mask;
+		}
+
+		return -1;
+	}
+
+	_FORCE_INLINE_ void write_begin() {
+		version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	_FORCE_INLINE_ void write_end() {
+		version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	void insert_unlocked(page_id key, frame_id value) {
+		uint64_t h = hash(key);
+		uint32_t group = h1(h) & group_mask;
+
+		for (uint32_t i = 1; i <= group_mask + 1; ++i) {
+			uint32_t m = match_free(ctrl + group * GROUP_WIDTH);
+			if (m) {
+				uint32_t slot = group * GROUP_WIDTH + lowest_bit(m);
+				if (ctrl[slot] == CTRL_DELETED) tombstones -= 1;
+				keys[slot] = key;
+				values[slot] = value;
+				ctrl[slot] = h2(h);
+				count += 1;
+				return;
+			}
+			group = (group + i) & group_mask;
+		}
+
+		CRASH_NOW_MSG("Page table is full.");
+	}
+
+	// Rebuilds the table in place to get rid of tombstones, which would otherwise make every miss probe the whole table.
+	void purge_tombstones() {
+		uint32_t n = 0;
+		page_id *old_keys = memnew_arr(page_id, count);
+		frame_id *old_values = memnew_arr(frame_id, count);
+
+		for (uint32_t i = 0; i < capacity; ++i) {
+			if (ctrl[i] >= 0) {
+				old_keys[n] = keys[i];
+				old_values[n] = values[i];
+				n += 1;
+			}
+		}
+
+		memset(ctrl, CTRL_EMPTY, capacity);
+		count = 0;
+		tombstones = 0;
+
+		for (uint32_t i = 0; i < n; ++i) {
+			insert_unlocked(old_keys[i], old_values[i]);
+		}
+
+		memdelete_arr(old_keys);
+		memdelete_arr(old_values);
+	}
+
+public:
+	// Allocates enough room for max_entries pages while keeping the load factor at or below 7/8.
+	void init(uint32_t max_entries) {
+		release();
+
+		uint32_t min_capacity = max_entries + max_entries / 7 + 1;
+		capacity = GROUP_WIDTH;
+		while (capacity < min_capacity)
+			capacity <<= 1;
+		group_mask = capacity / GROUP_WIDTH - 1;
+
+		ctrl = memnew_arr(int8_t, capacity);
+		keys = memnew_arr(page_id, capacity);
+		values = memnew_arr(frame_id, capacity);
+		memset(ctrl, CTRL_EMPTY, capacity);
+	}
+
+	void release() {
+		if (ctrl) memdelete_arr(ctrl);
+		if (keys) memdelete_arr(keys);
+		if (values) memdelete_arr(values);
+		ctrl = NULL;
+		keys = NULL;
+		values = NULL;
+		capacity = 0;
+		group_mask = 0;
+		count = 0;
+		tombstones = 0;
+	}
+
+	// Returns the frame mapped to the page, or CS_MEM_VAL_BAD if the page isn't mapped.
+	// Safe to call concurrently with a writer.
+	_FORCE_INLINE_ frame_id get(page_id key) const {
+		while (true) {
+			uint32_t v = version.load(std::memory_order_acquire);
+			if (v & 1) continue;
+
+			int64_t slot = find_slot(key);
+			frame_id out = slot < 0 ? (frame_id)CS_MEM_VAL_BAD : values[slot];
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (version.load(std::memory_order_relaxed) == v) return out;
+		}
+	}
+
+	_FORCE_INLINE_ bool has(page_id key) const {
+		return get(key) != (frame_id)CS_MEM_VAL_BAD;
+	}
+
+	// Maps the page to the frame, replacing any existing mapping.
+	// Returns false if the table has not been initialised or has no room left.
+	bool insert(page_id key, frame_id value) {
+		ERR_FAIL_COND_V(!capacity, false);
+
+		write_begin();
+
+		int64_t slot = find_slot(key);
+		if (slot >= 0) {
+			values[slot] = value;
+		} else {
+			if (count >= capacity - capacity / 8) {
+				write_end();
+				ERR_FAIL_V_MSG(false, "Page table is full.");
+			}
+			if (count + tombstones >= capacity - capacity / 8) {
+				purge_tombstones();
+			}
+			insert_unlocked(key, value);
+		}
+
+		write_end();
+		return true;
+	}
+
+	// Returns true if the page was mapped.
+	bool erase(page_id key) {
+		int64_t slot = find_slot(key);
+		if (slot < 0) return false;
+
+		write_begin();
+		ctrl[slot] = CTRL_DELETED;
+		count -= 1;
+		tombstones += 1;
+		write_end();
+
+		return true;
+	}
+
+	void clear() {
+		if (!capacity) return;
+
+		write_begin();
+		memset(ctrl, CTRL_EMPTY, capacity);
+		count = 0;
+		tombstones = 0;
+		write_end();
+	}
+
+	_FORCE_INLINE_ uint32_t size() const { return count; }
+	_FORCE_INLINE_ uint32_t get_capacity() const { return capacity; }
+
+	PageTable() :
+			ctrl(NULL),
+			keys(NULL),
+			values(NULL),
+			capacity(0),
+			group_mask(0),
+			count(0),
+			tombstones(0),
+			version(0) {}
+
+	~PageTable() {
+		release();
+	}
+};
+
+#endif // PAGE_TABLE_H
@@ -4,6 +4,10 @@
 #include "core/engine.h"
 #include "core/project_settings.h"
 
+#ifdef CACHESERV_TESTS_ENABLED
+#include "tests/test_cacheserv.h"
+#endif
+
 static FileCacheManager *file_cache_manager = NULL;
 static _FileCacheManager *_file_cache_server = NULL;
 void register_cacheserv_types() {
@@ -12,6 +16,9 @@ void register_cacheserv_types() {
 	_file_cache_server = memnew(_FileCacheManager);
 	ClassDB::register_class<_FileCacheManager>();
 	ClassDB::register_class<_FileAccessCached>();
+#ifdef CACHESERV_TESTS_ENABLED
+	ClassDB::register_class<CacheservTests>();
+#endif
 	Engine::get_singleton()->add_singleton(Engine::Singleton("FileCacheManager", _FileCacheManager::get_singleton()));
 }
 
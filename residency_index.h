@@ -0,0 +1,296 @@
+/*************************************************************************/
+/*  residency_index.h                                                    */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef RESIDENCY_INDEX_H
+#define RESIDENCY_INDEX_H
+
+#include "core/error_macros.h"
+#include "core/os/memory.h"
+#include "core/os/mutex.h"
+#include "core/typedefs.h"
+
+#include "cacheserv_defines.h"
+
+#include <atomic>
+
+// Tracks which pages of a single file are resident in the cache, and which of those are dirty.
+//
+// Pages are indexed by their page number within the file. The index is split into chunks of
+// CHUNK_PAGES pages, each holding a residency bitmap, a dirty bitmap and the frame each resident page
+// is mapped to. Chunks are allocated the first time one of their pages becomes resident, so a file only
+// pays for the regions that have actually been cached.
+//
+// Lookups are O(1), and resident or dirty pages can be walked in file offset order by scanning the bitmaps.
+//
+// Pages may be inserted and erased from several threads at once, as long as no two of them work on the
+// same page (FileCacheManager only touches a page under its shard's lock). Growing the index takes
+// grow_lock. Dirty bits may be set and cleared, and the index may be read, from any thread. Chunk tables
+// that are replaced when the index grows are kept alive until the index is destroyed so concurrent
+// readers never see freed memory.
+class ResidencyIndex {
+
+	enum {
+		CHUNK_SHIFT = 9,
+		CHUNK_PAGES = 1 << CHUNK_SHIFT,
+		CHUNK_WORDS = CHUNK_PAGES / 64,
+	};
+
+	struct Chunk {
+		std::atomic<uint64_t> resident[CHUNK_WORDS];
+		std::atomic<uint64_t> dirty[CHUNK_WORDS];
+		frame_id frames[CHUNK_PAGES];
+
+		Chunk() {
+			for (int i = 0; i < CHUNK_WORDS; ++i) {
+				resident[i].store(0, std::memory_order_relaxed);
+				dirty[i].store(0, std::memory_order_relaxed);
+			}
+		}
+	};
+
+	struct Table {
+		Table *retired;
+		uint32_t size;
+		Chunk *chunks[1];
+	};
+
+	std::atomic<Table *> table;
+	Mutex *grow_lock;
+	page_id guid_prefix;
+	std::atomic<uint32_t> count;
+
+	static _FORCE_INLINE_ uint32_t lowest_bit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctzll(mask);
+#else
+		uint32_t i = 0;
+		while (!(mask & 1)) {
+			mask >>= 1;
+			i += 1;
+		}
+		return i;
+#endif
+	}
+
+	static Table *alloc_table(uint32_t size) {
+		Table *t = (Table *)memalloc(sizeof(Table) + sizeof(Chunk *) * (size - 1));
+		t->retired = NULL;
+		t->size = size;
+		for (uint32_t i = 0; i < size; ++i) {
+			t->chunks[i] = NULL;
+		}
+		return t;
+	}
+
+	_FORCE_INLINE_ uint64_t page_index(page_id guid) const {
+		return CS_GET_FILE_OFFSET_FROM_GUID(guid) >> cs_geometry.page_shift;
+	}
+
+	_FORCE_INLINE_ page_id page_guid(uint64_t index) const {
+		return guid_prefix | (index << cs_geometry.page_shift);
+	}
+
+	_FORCE_INLINE_ Chunk *get_chunk(uint64_t index) const {
+		Table *t = table.load(std::memory_order_acquire);
+		uint64_t c = index >> CHUNK_SHIFT;
+		return (t && c < t->size) ? t->chunks[c] : NULL;
+	}
+
+	Chunk *get_or_make_chunk(uint64_t index) {
+		Chunk *chunk = get_chunk(index);
+		if (chunk) return chunk;
+
+		MutexLock ml(grow_lock);
+		uint64_t c = index >> CHUNK_SHIFT;
+		Table *t = table.load(std::memory_order_relaxed);
+
+		if (!t || c >= t->size) {
+			uint32_t size = t ? t->size : 1;
+			while (size <= c)
+				size <<= 1;
+
+			Table *n = alloc_table(size);
+			if (t) {
+				for (uint32_t i = 0; i < t->size; ++i) {
+					n->chunks[i] = t->chunks[i];
+				}
+				n->retired = t;
+			}
+			table.store(n, std::memory_order_release);
+			t = n;
+		}
+
+		if (!t->chunks[c]) {
+			Chunk *n = memnew(Chunk);
+			// Readers find the chunk without taking grow_lock, so it has to be fully built before it shows up.
+			std::atomic_thread_fence(std::memory_order_release);
+			t->chunks[c] = n;
+		}
+
+		return t->chunks[c];
+	}
+
+	// Returns the page number of the first page at or after index whose bit is set in the selected bitmap.
+	uint64_t find_next(uint64_t index, bool dirty) const {
+		Table *t = table.load(std::memory_order_acquire);
+		if (!t) return (uint64_t)CS_MEM_VAL_BAD;
+
+		for (uint64_t c = index >> CHUNK_SHIFT; c < t->size; ++c) {
+			Chunk *chunk = t->chunks[c];
+
+			if (chunk) {
+				uint32_t start = (c == (index >> CHUNK_SHIFT)) ? (uint32_t)(index & (CHUNK_PAGES - 1)) : 0;
+
+				for (uint32_t w = start / 64; w < CHUNK_WORDS; ++w) {
+					uint64_t bits = (dirty ? chunk->dirty[w] : chunk->resident[w]).load(std::memory_order_acquire);
+					if (w == start / 64) bits &= ~(uint64_t)0 << (start % 64);
+
+					if (bits) {
+						return (c << CHUNK_SHIFT) + w * 64 + lowest_bit(bits);
+					}
+				}
+			}
+		}
+
+		return (uint64_t)CS_MEM_VAL_BAD;
+	}
+
+public:
+	// Returns true if the page is resident.
+	_FORCE_INLINE_ bool has(page_id guid) const {
+		uint64_t index = page_index(guid);
+		Chunk *chunk = get_chunk(index);
+		uint32_t bit = index & (CHUNK_PAGES - 1);
+		return chunk && (chunk->resident[bit / 64].load(std::memory_order_acquire) & ((uint64_t)1 << (bit % 64)));
+	}
+
+	// Returns the frame the page is mapped to, or CS_MEM_VAL_BAD if the page isn't resident.
+	_FORCE_INLINE_ frame_id get(page_id guid) const {
+		uint64_t index = page_index(guid);
+		Chunk *chunk = get_chunk(index);
+		uint32_t bit = index & (CHUNK_PAGES - 1);
+		if (chunk && (chunk->resident[bit / 64].load(std::memory_order_acquire) & ((uint64_t)1 << (bit % 64)))) {
+			return chunk->frames[bit];
+		}
+		return CS_MEM_VAL_BAD;
+	}
+
+	void insert(page_id guid, frame_id frame) {
+		uint64_t index = page_index(guid);
+		Chunk *chunk = get_or_make_chunk(index);
+		uint32_t bit = index & (CHUNK_PAGES - 1);
+
+		chunk->frames[bit] = frame;
+		uint64_t old = chunk->resident[bit / 64].fetch_or((uint64_t)1 << (bit % 64), std::memory_order_release);
+		if (!(old & ((uint64_t)1 << (bit % 64)))) count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Returns true if the page was resident.
+	bool erase(page_id guid) {
+		uint64_t index = page_index(guid);
+		Chunk *chunk = get_chunk(index);
+		uint32_t bit = index & (CHUNK_PAGES - 1);
+		if (!chunk) return false;
+
+		uint64_t mask = (uint64_t)1 << (bit % 64);
+		chunk->dirty[bit / 64].fetch_and(~mask, std::memory_order_relaxed);
+		uint64_t old = chunk->resident[bit / 64].fetch_and(~mask, std::memory_order_release);
+		if (old & mask) {
+			count.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+
+	_FORCE_INLINE_ bool is_dirty(page_id guid) const {
+		uint64_t index = page_index(guid);
+		Chunk *chunk = get_chunk(index);
+		uint32_t bit = index & (CHUNK_PAGES - 1);
+		return chunk && (chunk->dirty[bit / 64].load(std::memory_order_acquire) & ((uint64_t)1 << (bit % 64)));
+	}
+
+	// Expects the page to be resident.
+	_FORCE_INLINE_ void set_dirty(page_id guid, bool dirty) {
+		uint64_t index = page_index(guid);
+		Chunk *chunk = get_chunk(index);
+		ERR_FAIL_COND(!chunk);
+		uint32_t bit = index & (CHUNK_PAGES - 1);
+		uint64_t mask = (uint64_t)1 << (bit % 64);
+
+		if (dirty)
+			chunk->dirty[bit / 64].fetch_or(mask, std::memory_order_release);
+		else
+			chunk->dirty[bit / 64].fetch_and(~mask, std::memory_order_release);
+	}
+
+	// Iteration over resident pages in file offset order.
+	// Returns CS_MEM_VAL_BAD when there are no more pages.
+	//
+	// for (page_id p = index.first(); p != (page_id)CS_MEM_VAL_BAD; p = index.next(p)) { ... }
+	_FORCE_INLINE_ page_id first() const { return next_from(0, false); }
+	_FORCE_INLINE_ page_id next(page_id guid) const { return next_from(page_index(guid) + 1, false); }
+
+	// Iteration over dirty pages in file offset order.
+	_FORCE_INLINE_ page_id first_dirty() const { return next_from(0, true); }
+	_FORCE_INLINE_ page_id next_dirty(page_id guid) const { return next_from(page_index(guid) + 1, true); }
+
+	_FORCE_INLINE_ page_id next_from(uint64_t index, bool dirty) const {
+		uint64_t i = find_next(index, dirty);
+		return i == (uint64_t)CS_MEM_VAL_BAD ? (page_id)CS_MEM_VAL_BAD : page_guid(i);
+	}
+
+	_FORCE_INLINE_ int size() const { return count.load(std::memory_order_relaxed); }
+
+	explicit ResidencyIndex(page_id p_guid_prefix) :
+			table(NULL),
+			grow_lock(Mutex::create()),
+			guid_prefix(p_guid_prefix),
+			count(0) {}
+
+	~ResidencyIndex() {
+		Table *t = table.load(std::memory_order_relaxed);
+
+		if (t) {
+			for (uint32_t i = 0; i < t->size; ++i) {
+				if (t->chunks[i]) memdelete(t->chunks[i]);
+			}
+		}
+
+		while (t) {
+			Table *retired = t->retired;
+			memfree(t);
+			t = retired;
+		}
+
+		memdelete(grow_lock);
+	}
+};
+
+#endif // RESIDENCY_INDEX_H
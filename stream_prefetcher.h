@@ -0,0 +1,129 @@
+/*************************************************************************/
+/*  stream_prefetcher.h                                                  */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef STREAM_PREFETCHER_H
+#define STREAM_PREFETCHER_H
+
+#include "core/typedefs.h"
+
+#include "cacheserv_defines.h"
+
+// Learns the strided and interleaved access streams of one file from the offsets it is read at.
+//
+// The last few offsets are kept in a small history. An access that, together with two earlier ones,
+// forms an even progression (a, a + s, a + 2s) starts a stream with stride s, however many other
+// accesses came in between, so interleaved cursors are told apart. A stream predicts that its next
+// access is at last + stride, and follows along for as long as that keeps being right.
+// New streams replace the least recently used one.
+class StreamPrefetcher {
+public:
+	struct Stream {
+		uint64_t last;
+		int64_t stride;
+		uint32_t last_use;
+	};
+
+private:
+	Stream streams[CS_PREFETCH_STREAMS];
+	uint64_t history[CS_PREFETCH_HISTORY];
+	uint32_t history_len;
+	uint32_t history_pos;
+	uint32_t tick;
+	// How many next offsets the streams predicted, and how many of those were then read.
+	uint64_t predictions;
+	uint64_t hits;
+
+	Stream *find_new_stream(uint64_t offset) {
+		for (uint32_t i = 0; i < history_len; ++i) {
+			int64_t stride = (int64_t)(offset - history[i]);
+			if (stride == 0 || stride > CS_PREFETCH_MAX_STRIDE || stride < -CS_PREFETCH_MAX_STRIDE) continue;
+
+			for (uint32_t j = 0; j < history_len; ++j) {
+				if (history[j] != history[i] - stride) continue;
+
+				Stream *oldest = &streams[0];
+				for (int k = 1; k < CS_PREFETCH_STREAMS; ++k) {
+					if (streams[k].last_use < oldest->last_use) oldest = &streams[k];
+				}
+				oldest->stride = stride;
+				return oldest;
+			}
+		}
+		return NULL;
+	}
+
+public:
+	// Records an access at the given offset. Returns the stream it continues, if any. The stream's next offsets are worth prefetching.
+	const Stream *observe(uint64_t offset) {
+		tick += 1;
+
+		Stream *match = NULL;
+		for (int i = 0; i < CS_PREFETCH_STREAMS; ++i) {
+			if (streams[i].last_use != 0 && streams[i].last + streams[i].stride == offset) {
+				match = &streams[i];
+				hits += 1;
+				break;
+			}
+		}
+
+		if (!match) {
+			match = find_new_stream(offset);
+
+			history[history_pos] = offset;
+			history_pos = (history_pos + 1) % CS_PREFETCH_HISTORY;
+			history_len = MIN(history_len + 1, (uint32_t)CS_PREFETCH_HISTORY);
+
+			if (!match) return NULL;
+		}
+
+		match->last = offset;
+		match->last_use = tick;
+		predictions += 1;
+		return match;
+	}
+
+	_FORCE_INLINE_ uint64_t get_predictions() const { return predictions; }
+	_FORCE_INLINE_ uint64_t get_hits() const { return hits; }
+
+	StreamPrefetcher() :
+			history_len(0),
+			history_pos(0),
+			tick(0),
+			predictions(0),
+			hits(0) {
+		for (int i = 0; i < CS_PREFETCH_STREAMS; ++i) {
+			streams[i].last = 0;
+			streams[i].stride = 0;
+			streams[i].last_use = 0;
+		}
+	}
+};
+
+#endif // STREAM_PREFETCHER_H
@@ -0,0 +1,17 @@
+extends SceneTree
+
+# Runs the cacheserv tests and benchmarks. The engine has to be built with cacheserv_tests=yes.
+#
+#   godot --no-window -s modules/cacheserv/tests/run_tests.gd [test_ | bench_ | <name>]
+#
+# Without an argument everything runs. The exit code is the number of failures.
+
+func _init():
+	var prefix = ""
+	for arg in OS.get_cmdline_args():
+		if arg.begins_with("test_") or arg.begins_with("bench_"):
+			prefix = arg
+
+	var failed = CacheservTests.new().run(prefix)
+	print("%d failed" % failed)
+	quit(failed)
@@ -0,0 +1,105 @@
+/*************************************************************************/
+/*  test_admission.cpp                                                   */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "test_cacheserv.h"
+
+#include "core/os/dir_access.h"
+#include "core/os/file_access.h"
+
+namespace TestAdmission {
+
+// With the admission filter on, a read of pages that are colder than everything cached is served from the transient frames.
+// A single read of more pages than there are transient frames must not push its own first pages out of them before it
+// gets to copy them, or it would load them again.
+bool test_large_rejected_read() {
+	const String path = "user://cacheserv_test_admission.bin";
+	const size_t pool_pages = CS_NUM_FRAMES_MIN;
+	const size_t hot_pages = pool_pages - CS_TRANSIENT_FRAMES;
+	const size_t read_pages = CS_TRANSIENT_FRAMES * 2;
+	const size_t size = (hot_pages + read_pages + CS_TRANSIENT_FRAMES) * CS_PAGE_SIZE;
+
+	CS_TEST_CHECK(cs_test_make_file(path, size, 2), "Could not create " + path);
+
+	bool ok = true;
+	{
+		Dictionary settings;
+		settings["cacheserv/cache/shards"] = 1;
+		settings["cacheserv/cache/admission_filter"] = true;
+		CacheservTestManager mgr(pool_pages * CS_PAGE_SIZE, settings);
+
+		RID rid = mgr->open(path, FileAccess::READ, _FileCacheManager::LRU);
+		CS_TEST_CHECK(rid.is_valid(), "Could not open " + path);
+
+		// Fill every cached frame with pages read often enough that a page read once never gets to evict them.
+		// They're read backwards a page at a time, so no readahead goes into the pages read below.
+		uint8_t *page = memnew_arr(uint8_t, CS_PAGE_SIZE);
+		for (int pass = 0; pass < 4; ++pass) {
+			for (size_t i = hot_pages; i-- > 0;) {
+				mgr->seek(rid, i * CS_PAGE_SIZE, SEEK_SET);
+				mgr.read(rid, page, CS_PAGE_SIZE);
+			}
+		}
+		memdelete_arr(page);
+
+		// One byte short, so the read ends on the last page it's meant to cover.
+		const size_t len = read_pages * CS_PAGE_SIZE - 1;
+		const size_t start = hot_pages * CS_PAGE_SIZE;
+		uint8_t *buf = memnew_arr(uint8_t, len);
+		uint64_t pages_read = mgr.get_pages_read();
+
+		mgr->seek(rid, start, SEEK_SET);
+		size_t got = mgr.read(rid, buf, len);
+		uint64_t loaded = mgr.get_pages_read() - pages_read;
+
+		for (size_t i = 0; ok && i < got; ++i) {
+			if (buf[i] != cs_test_byte(start + i, 2)) {
+				ERR_PRINTS("Check failed: byte " + itos(start + i) + " is wrong.");
+				ok = false;
+			}
+		}
+		memdelete_arr(buf);
+
+		if (got != len) {
+			ERR_PRINTS("Check failed: read " + itos(got) + " of " + itos(len) + " bytes.");
+			ok = false;
+		}
+		if (loaded != read_pages) {
+			ERR_PRINTS("Check failed: " + itos(loaded) + " pages were loaded for a read of " + itos(read_pages) + ".");
+			ok = false;
+		}
+
+		mgr->permanent_close(rid);
+	}
+
+	DirAccess::remove_file_or_error(path);
+	return ok;
+}
+
+} // namespace TestAdmission
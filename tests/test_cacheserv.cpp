@@ -0,0 +1,157 @@
+/*************************************************************************/
+/*  test_cacheserv.cpp                                                   */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "test_cacheserv.h"
+
+#include "core/os/file_access.h"
+#include "core/os/os.h"
+#include "core/print_string.h"
+#include "core/project_settings.h"
+
+CacheservTestManager::CacheservTestManager(size_t p_cache_size, const Dictionary &p_settings) {
+	prev_singleton = FileCacheManager::singleton;
+	prev_geometry = cs_geometry;
+
+	ProjectSettings *ps = ProjectSettings::get_singleton();
+	List<Variant> keys;
+	p_settings.get_key_list(&keys);
+
+	Dictionary saved;
+	for (List<Variant>::Element *E = keys.front(); E; E = E->next()) {
+		String name = E->get();
+		saved[name] = ps->get(name);
+		ps->set(name, p_settings[name]);
+	}
+
+	mgr = memnew(FileCacheManager);
+	mgr->init(CS_PAGE_SIZE, p_cache_size);
+
+	for (List<Variant>::Element *E = keys.front(); E; E = E->next()) {
+		String name = E->get();
+		ps->set(name, saved[name]);
+	}
+}
+
+CacheservTestManager::~CacheservTestManager() {
+	memdelete(mgr);
+	FileCacheManager::singleton = prev_singleton;
+	cs_geometry = prev_geometry;
+}
+
+size_t CacheservTestManager::read(RID rid, uint8_t *buf, size_t len) {
+	mgr->check_cache(rid, len);
+	return mgr->read(rid, buf, len);
+}
+
+size_t CacheservTestManager::write(RID rid, const uint8_t *data, size_t len) {
+	mgr->check_cache(rid, len);
+	return mgr->write(rid, data, len);
+}
+
+bool CacheservTestManager::is_cached(RID rid, size_t offset) const {
+	return get_page_guid(mgr->get_handle(rid)->desc_info, offset, true) != (page_id)CS_MEM_VAL_BAD;
+}
+
+bool cs_test_make_file(const String &p_path, size_t p_size, uint8_t p_seed) {
+	FileAccess *f = FileAccess::open(p_path, FileAccess::WRITE);
+	if (!f) return false;
+
+	uint8_t buf[0x1000];
+	for (size_t pos = 0; pos < p_size; pos += sizeof(buf)) {
+		size_t len = MIN(sizeof(buf), p_size - pos);
+		for (size_t i = 0; i < len; ++i) {
+			buf[i] = cs_test_byte(pos + i, p_seed);
+		}
+		f->store_buffer(buf, len);
+	}
+
+	bool ok = f->get_error() == OK;
+	f->close();
+	memdelete(f);
+	return ok;
+}
+
+int64_t cs_test_verify_file(const String &p_path, size_t p_size, uint8_t p_seed) {
+	FileAccess *f = FileAccess::open(p_path, FileAccess::READ);
+	if (!f) return 0;
+
+	int64_t bad = f->get_len() == p_size ? -1 : (int64_t)MIN(f->get_len(), (size_t)p_size);
+	uint8_t buf[0x1000];
+	for (size_t pos = 0; bad < 0 && pos < p_size; pos += sizeof(buf)) {
+		size_t len = f->get_buffer(buf, MIN(sizeof(buf), p_size - pos));
+		for (size_t i = 0; i < len; ++i) {
+			if (buf[i] != cs_test_byte(pos + i, p_seed)) {
+				bad = pos + i;
+				break;
+			}
+		}
+	}
+
+	f->close();
+	memdelete(f);
+	return bad;
+}
+
+struct CacheservTest {
+	const char *name;
+	bool (*func)();
+};
+
+// Ends with an empty entry.
+static const CacheservTest cacheserv_tests[] = {
+	{ "test_write_back_evicted_dirty_pages", TestWriteBack::test_evicted_dirty_pages },
+	{ "test_admission_large_rejected_read", TestAdmission::test_large_rejected_read },
+	{ "bench_page_table_lookups", TestPageTable::bench_lookups },
+	{ "bench_policies_scan_resistance", TestPolicies::bench_scan_resistance },
+	{ "bench_io_random_reads", TestIO::bench_random_reads },
+	{ "bench_shards_threaded_reads", TestShards::bench_threaded_reads },
+	{ NULL, NULL },
+};
+
+int CacheservTests::run(const String &p_prefix) {
+	int failed = 0;
+
+	for (const CacheservTest *t = cacheserv_tests; t->name; ++t) {
+		if (!String(t->name).begins_with(p_prefix)) continue;
+
+		print_line(String("Running ") + t->name);
+		uint64_t start = OS::get_singleton()->get_ticks_usec();
+		bool ok = t->func();
+		print_line(String(ok ? "  passed" : "  FAILED") + " in " + itos((OS::get_singleton()->get_ticks_usec() - start) / 1000) + " ms");
+
+		if (!ok) failed += 1;
+	}
+
+	return failed;
+}
+
+void CacheservTests::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("run", "prefix"), &CacheservTests::run, DEFVAL(""));
+}
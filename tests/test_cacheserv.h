@@ -0,0 +1,122 @@
+/*************************************************************************/
+/*  test_cacheserv.h                                                     */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef TEST_CACHESERV_H
+#define TEST_CACHESERV_H
+
+#include "core/dictionary.h"
+#include "core/reference.h"
+
+#include "../file_cache_manager.h"
+
+// Fails the running test with the given message if the condition doesn't hold.
+#define CS_TEST_CHECK(m_cond, m_msg)                                                    \
+	if (unlikely(!(m_cond))) {                                                          \
+		ERR_PRINTS(String("Check failed: ") + _STR(m_cond) + ". " + String(m_msg)); \
+		return false;                                                                   \
+	}
+
+// A FileCacheManager of the test's own, so the test can pick the pool size and the settings only init reads.
+// The engine's manager stands aside until this one is destroyed, and can't be used in the meantime.
+class CacheservTestManager {
+	FileCacheManager *mgr;
+	FileCacheManager *prev_singleton;
+	CacheGeometry prev_geometry;
+
+public:
+	// p_settings maps project settings to the values the manager is set up with.
+	// They are put back once the manager is up. The page size is always the engine's, since the page geometry is shared.
+	CacheservTestManager(size_t p_cache_size, const Dictionary &p_settings = Dictionary());
+	~CacheservTestManager();
+
+	_FORCE_INLINE_ FileCacheManager *operator->() const { return mgr; }
+
+	// Read and write at the handle's position, the way FileAccessCached does.
+	size_t read(RID rid, uint8_t *buf, size_t len);
+	size_t write(RID rid, const uint8_t *data, size_t len);
+
+	// Whether the page at the offset is in the cache, or on its way in.
+	bool is_cached(RID rid, size_t offset) const;
+
+	_FORCE_INLINE_ uint64_t get_pages_read() const { return mgr->io_stats.pages_read.load(std::memory_order_relaxed); }
+};
+
+// The byte a test file holds at the given position. The seed tells files, and the writes over them, apart.
+_FORCE_INLINE_ uint8_t cs_test_byte(uint64_t pos, uint8_t seed) {
+	return (uint8_t)((pos >> 12) * 7 + pos * 31 + seed);
+}
+
+// Creates a file of the given size with the plain FileAccess, filled with cs_test_byte. Returns false if it can't be written.
+bool cs_test_make_file(const String &p_path, size_t p_size, uint8_t p_seed);
+
+// Checks the file on disk against cs_test_byte, without going through the cache.
+// Returns the position of the first wrong byte, or -1 if there isn't one.
+int64_t cs_test_verify_file(const String &p_path, size_t p_size, uint8_t p_seed);
+
+// Tests return false once a check fails. Benchmarks print what they measure, and only fail if they can't run.
+
+namespace TestWriteBack {
+bool test_evicted_dirty_pages();
+}
+
+namespace TestAdmission {
+bool test_large_rejected_read();
+}
+
+namespace TestPageTable {
+bool bench_lookups();
+}
+
+namespace TestPolicies {
+bool bench_scan_resistance();
+}
+
+namespace TestIO {
+bool bench_random_reads();
+}
+
+namespace TestShards {
+bool bench_threaded_reads();
+}
+
+// Runs the module's tests and benchmarks from a script, in builds with cacheserv_tests=yes. See tests/run_tests.gd.
+class CacheservTests : public Reference {
+	GDCLASS(CacheservTests, Reference);
+
+protected:
+	static void _bind_methods();
+
+public:
+	// Runs everything whose name starts with the prefix, all of it for an empty prefix. Tests are named test_*, benchmarks bench_*.
+	// Returns how many failed.
+	int run(const String &p_prefix);
+};
+
+#endif // TEST_CACHESERV_H
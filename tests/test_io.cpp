@@ -0,0 +1,111 @@
+/*************************************************************************/
+/*  test_io.cpp                                                          */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "test_cacheserv.h"
+
+#include "core/os/dir_access.h"
+#include "core/os/file_access.h"
+#include "core/os/os.h"
+#include "core/print_string.h"
+
+#include "../io_uring_engine.h"
+
+namespace TestIO {
+
+// Reads random pages of a file much larger than the cache, queue_depth pages at a time: the loads of a batch are all queued
+// before the first one is waited on. Runs with io_uring and with the blocking workers, and prints the page reads per second
+// and the throughput of each. The file has just been written, so much of it is likely still in the OS cache.
+bool bench_random_reads() {
+	const String path = "user://cacheserv_bench_io.bin";
+	const size_t pool_pages = 1024;
+	const size_t file_pages = pool_pages * 16;
+	const size_t total_reads = 8192;
+	const uint32_t depths[] = { 1, 4, 16, 32 };
+
+	CS_TEST_CHECK(cs_test_make_file(path, file_pages * CS_PAGE_SIZE, 5), "Could not create " + path);
+
+	uint8_t *page = memnew_arr(uint8_t, CS_PAGE_SIZE);
+	bool ok = true;
+	for (int uring = 0; ok && uring < 2; ++uring) {
+		if (uring && !IOUringEngine::is_supported()) {
+			print_line("  io_uring isn't available here, the workers always use blocking IO.");
+			break;
+		}
+
+		for (size_t d = 0; ok && d < sizeof(depths) / sizeof(depths[0]); ++d) {
+			uint32_t depth = depths[d];
+
+			Dictionary settings;
+			settings["cacheserv/io/use_io_uring"] = uring != 0;
+			CacheservTestManager mgr(pool_pages * CS_PAGE_SIZE, settings);
+
+			RID rid = mgr->open(path, FileAccess::READ, _FileCacheManager::LRU);
+			if (!rid.is_valid()) {
+				ERR_PRINTS("Check failed: could not open " + path);
+				ok = false;
+				break;
+			}
+
+			size_t offsets[32];
+			uint64_t x = 0x5851F42D4C957F2D;
+			uint64_t start = OS::get_singleton()->get_ticks_usec();
+
+			for (size_t done = 0; done < total_reads; done += depth) {
+				for (uint32_t i = 0; i < depth; ++i) {
+					x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+					offsets[i] = (size_t)((x >> 33) % file_pages) * CS_PAGE_SIZE;
+					mgr->seek(rid, offsets[i], SEEK_SET);
+					mgr->check_cache(rid, CS_PAGE_SIZE);
+				}
+
+				for (uint32_t i = 0; i < depth; ++i) {
+					mgr->seek(rid, offsets[i], SEEK_SET);
+					if (mgr.read(rid, page, CS_PAGE_SIZE) != CS_PAGE_SIZE || page[7] != cs_test_byte(offsets[i] + 7, 5)) {
+						ERR_PRINTS("Check failed: the page at " + itos(offsets[i]) + " read wrong.");
+						ok = false;
+					}
+				}
+			}
+
+			uint64_t usec = MAX(OS::get_singleton()->get_ticks_usec() - start, (uint64_t)1);
+
+			print_line(String("  ") + (uring ? "io_uring" : "blocking") + ", queue depth " + itos(depth) + ": " + itos(total_reads * 1000000 / usec) + " pages/s, " +
+					   rtos(total_reads * CS_PAGE_SIZE / (double)usec) + " MB/s");
+
+			mgr->permanent_close(rid);
+		}
+	}
+
+	memdelete_arr(page);
+	DirAccess::remove_file_or_error(path);
+	return ok;
+}
+
+} // namespace TestIO
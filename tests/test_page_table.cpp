@@ -0,0 +1,107 @@
+/*************************************************************************/
+/*  test_page_table.cpp                                                  */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "test_cacheserv.h"
+
+#include "core/map.h"
+#include "core/os/os.h"
+#include "core/print_string.h"
+
+#include "../page_table.h"
+
+namespace TestPageTable {
+
+// The i-th of the pages a few open files would have cached, spread over 8 files with 4 KiB pages.
+static _FORCE_INLINE_ page_id bench_page(uint32_t i) {
+	return CS_GET_GUID_PREFIX(i % 8 + 1) | (page_id)(i / 8) << 12;
+}
+
+// Times inserting n pages into a PageTable and into the Map<page_id, frame_id> it replaced, then looking them up in random order,
+// at pool sizes from the smallest to one far larger than the CPU caches.
+bool bench_lookups() {
+	const uint32_t sizes[] = { 64, 64 * 1024, 1024 * 1024 };
+	const uint32_t lookups = 4 * 1024 * 1024;
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		uint32_t n = sizes[s];
+
+		// The lookup order is made up front, so only the lookups are timed.
+		uint32_t *order = memnew_arr(uint32_t, lookups);
+		uint64_t x = 0x9E3779B97F4A7C15;
+		uint64_t expected = 0;
+		for (uint32_t i = 0; i < lookups; ++i) {
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+			order[i] = (uint32_t)(x >> 33) % n;
+			expected += order[i];
+		}
+
+		PageTable table;
+		Map<page_id, frame_id> map;
+
+		uint64_t start = OS::get_singleton()->get_ticks_usec();
+		table.init(n);
+		for (uint32_t i = 0; i < n; ++i) {
+			table.insert(bench_page(i), i);
+		}
+		uint64_t table_insert = OS::get_singleton()->get_ticks_usec() - start;
+
+		start = OS::get_singleton()->get_ticks_usec();
+		for (uint32_t i = 0; i < n; ++i) {
+			map.insert(bench_page(i), i);
+		}
+		uint64_t map_insert = OS::get_singleton()->get_ticks_usec() - start;
+
+		uint64_t table_sum = 0;
+		start = OS::get_singleton()->get_ticks_usec();
+		for (uint32_t i = 0; i < lookups; ++i) {
+			table_sum += table.get(bench_page(order[i]));
+		}
+		uint64_t table_get = OS::get_singleton()->get_ticks_usec() - start;
+
+		uint64_t map_sum = 0;
+		start = OS::get_singleton()->get_ticks_usec();
+		for (uint32_t i = 0; i < lookups; ++i) {
+			map_sum += map.find(bench_page(order[i]))->get();
+		}
+		uint64_t map_get = OS::get_singleton()->get_ticks_usec() - start;
+
+		memdelete_arr(order);
+
+		// The sums also keep the lookups from being optimised away.
+		CS_TEST_CHECK(table_sum == expected && map_sum == expected, "Lookups at " + itos(n) + " frames found the wrong frames.");
+
+		print_line("  " + itos(n) + " frames: insert " + rtos(table_insert * 1000.0 / n) + " ns/page (Map " + rtos(map_insert * 1000.0 / n) +
+				   "), lookup " + rtos(table_get * 1000.0 / lookups) + " ns (Map " + rtos(map_get * 1000.0 / lookups) + ")");
+	}
+
+	return true;
+}
+
+} // namespace TestPageTable
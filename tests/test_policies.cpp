@@ -0,0 +1,109 @@
+/*************************************************************************/
+/*  test_policies.cpp                                                    */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "test_cacheserv.h"
+
+#include "core/os/dir_access.h"
+#include "core/os/file_access.h"
+#include "core/os/os.h"
+#include "core/print_string.h"
+
+namespace TestPolicies {
+
+// A hot set of pages that fits in the cache is read at random, one page between each two pages of a scan over a file
+// sixteen times the size of the cache, the way a level pack is streamed. Prints the share of hot reads that found their
+// page cached during the scan, per policy.
+bool bench_scan_resistance() {
+	const String hot_path = "user://cacheserv_bench_hot.bin";
+	const String scan_path = "user://cacheserv_bench_scan.bin";
+	const size_t pool_pages = 256;
+	const size_t hot_pages = pool_pages / 2;
+	const size_t hot_size = hot_pages * CS_PAGE_SIZE;
+	const size_t scan_size = pool_pages * 16 * CS_PAGE_SIZE;
+
+	CS_TEST_CHECK(cs_test_make_file(hot_path, hot_size, 3), "Could not create " + hot_path);
+	CS_TEST_CHECK(cs_test_make_file(scan_path, scan_size, 4), "Could not create " + scan_path);
+
+	const int policies[] = { _FileCacheManager::LRU, _FileCacheManager::CLOCK, _FileCacheManager::ARC, _FileCacheManager::TWOQ };
+	const char *names[] = { "LRU", "CLOCK", "ARC", "2Q" };
+	uint8_t *page = memnew_arr(uint8_t, CS_PAGE_SIZE);
+	bool ok = true;
+
+	for (size_t p = 0; ok && p < sizeof(policies) / sizeof(policies[0]); ++p) {
+		// The policies each run on one pool, not on a pool per shard.
+		Dictionary settings;
+		settings["cacheserv/cache/shards"] = 1;
+		CacheservTestManager mgr(pool_pages * CS_PAGE_SIZE, settings);
+
+		RID hot = mgr->open(hot_path, FileAccess::READ, policies[p]);
+		RID scanned = mgr->open(scan_path, FileAccess::READ, policies[p]);
+		if (!hot.is_valid() || !scanned.is_valid()) {
+			ERR_PRINTS("Check failed: could not open the benchmark files.");
+			ok = false;
+			break;
+		}
+
+		// The hot set is read twice up front, which is what it takes for 2Q to promote a page out of its probationary queue.
+		for (int pass = 0; pass < 2; ++pass) {
+			mgr->seek(hot, 0, SEEK_SET);
+			for (size_t i = 0; i < hot_pages; ++i) {
+				mgr.read(hot, page, CS_PAGE_SIZE);
+			}
+		}
+
+		uint64_t reads = 0;
+		uint64_t hits = 0;
+		uint64_t x = 0x2545F4914F6CDD1D;
+		for (size_t pos = 0; pos < scan_size; pos += CS_PAGE_SIZE) {
+			mgr.read(scanned, page, CS_PAGE_SIZE);
+
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+			size_t offset = (size_t)((x >> 33) % hot_pages) * CS_PAGE_SIZE;
+
+			if (mgr.is_cached(hot, offset)) hits += 1;
+			reads += 1;
+
+			mgr->seek(hot, offset, SEEK_SET);
+			mgr.read(hot, page, CS_PAGE_SIZE);
+		}
+
+		print_line(String("  ") + names[p] + ": " + rtos(reads ? hits * 100.0 / reads : 0) + "% of " + itos(reads) + " hot reads hit during the scan");
+
+		mgr->permanent_close(hot);
+		mgr->permanent_close(scanned);
+	}
+
+	memdelete_arr(page);
+	DirAccess::remove_file_or_error(hot_path);
+	DirAccess::remove_file_or_error(scan_path);
+	return ok;
+}
+
+} // namespace TestPolicies
@@ -0,0 +1,145 @@
+/*************************************************************************/
+/*  test_shards.cpp                                                      */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "test_cacheserv.h"
+
+#include "core/os/dir_access.h"
+#include "core/os/file_access.h"
+#include "core/os/os.h"
+#include "core/os/thread.h"
+#include "core/print_string.h"
+
+#include <atomic>
+
+namespace TestShards {
+
+struct ReaderState {
+	CacheservTestManager *mgr;
+	RID rid;
+	size_t size;
+	uint32_t reads;
+	uint64_t seed;
+	std::atomic<uint32_t> *start;
+	bool ok;
+};
+
+// Small reads at random places in the reader's own file.
+static void reader_func(void *p_udata) {
+	ReaderState *r = (ReaderState *)p_udata;
+	uint8_t buf[256];
+	uint64_t x = r->seed;
+
+	// All readers start together, so the threads that are started first don't get the cache to themselves.
+	while (!r->start->load(std::memory_order_acquire)) {
+	}
+
+	for (uint32_t i = 0; i < r->reads; ++i) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		size_t offset = (size_t)((x >> 33) % (r->size - sizeof(buf)));
+		(*r->mgr)->seek(r->rid, offset, SEEK_SET);
+		if (r->mgr->read(r->rid, buf, sizeof(buf)) != sizeof(buf) || buf[0] != cs_test_byte(offset, 6)) r->ok = false;
+	}
+}
+
+// Random reads of files that are entirely cached, from 1 to 32 threads at once, each on a file of its own.
+// Prints the reads per second at each thread count and the speedup over one thread, with a single shard and with the default.
+bool bench_threaded_reads() {
+	const size_t file_pages = 64;
+	const size_t size = file_pages * CS_PAGE_SIZE;
+	const uint32_t reads_per_thread = 100000;
+	const int shard_counts[] = { 1, CS_SHARDS_DEFAULT };
+
+	String paths[32];
+	for (int i = 0; i < 32; ++i) {
+		paths[i] = "user://cacheserv_bench_shards_" + itos(i) + ".bin";
+		CS_TEST_CHECK(cs_test_make_file(paths[i], size, 6), "Could not create " + paths[i]);
+	}
+
+	bool ok = true;
+	for (size_t c = 0; ok && c < sizeof(shard_counts) / sizeof(shard_counts[0]); ++c) {
+		Dictionary settings;
+		settings["cacheserv/cache/shards"] = shard_counts[c];
+		CacheservTestManager mgr(file_pages * 32 * 2 * CS_PAGE_SIZE, settings);
+
+		// Everything is loaded up front, so only the lookups are measured.
+		RID rids[32];
+		uint8_t warm[0x10000];
+		for (int i = 0; i < 32; ++i) {
+			rids[i] = mgr->open(paths[i], FileAccess::READ, _FileCacheManager::LRU);
+			CS_TEST_CHECK(rids[i].is_valid(), "Could not open " + paths[i]);
+			for (size_t pos = 0; pos < size; pos += sizeof(warm)) {
+				mgr.read(rids[i], warm, MIN(sizeof(warm), size - pos));
+			}
+		}
+
+		double single = 0;
+		for (int threads = 1; ok && threads <= 32; threads *= 2) {
+			ReaderState state[32];
+			Thread *thread[32];
+			std::atomic<uint32_t> start(0);
+
+			for (int i = 0; i < threads; ++i) {
+				state[i].mgr = &mgr;
+				state[i].rid = rids[i];
+				state[i].size = size;
+				state[i].reads = reads_per_thread;
+				state[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+				state[i].start = &start;
+				state[i].ok = true;
+				thread[i] = Thread::create(reader_func, &state[i]);
+			}
+
+			uint64_t begin = OS::get_singleton()->get_ticks_usec();
+			start.store(1, std::memory_order_release);
+			for (int i = 0; i < threads; ++i) {
+				Thread::wait_to_finish(thread[i]);
+				memdelete(thread[i]);
+				ok = ok && state[i].ok;
+			}
+			uint64_t usec = MAX(OS::get_singleton()->get_ticks_usec() - begin, (uint64_t)1);
+
+			double rate = (double)threads * reads_per_thread * 1000000.0 / usec;
+			if (threads == 1) single = rate;
+			print_line("  " + itos(shard_counts[c]) + " shard(s), " + itos(threads) + " thread(s): " + itos((int64_t)rate) + " reads/s, " + rtos(rate / single) + "x one thread");
+		}
+
+		for (int i = 0; i < 32; ++i) {
+			mgr->permanent_close(rids[i]);
+		}
+	}
+
+	for (int i = 0; i < 32; ++i) {
+		DirAccess::remove_file_or_error(paths[i]);
+	}
+	CS_TEST_CHECK(ok, "Some reads returned the wrong data.");
+	return true;
+}
+
+} // namespace TestShards
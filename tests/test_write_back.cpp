@@ -0,0 +1,78 @@
+/*************************************************************************/
+/*  test_write_back.cpp                                                  */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "test_cacheserv.h"
+
+#include "core/os/dir_access.h"
+#include "core/os/file_access.h"
+
+namespace TestWriteBack {
+
+// Writes over a file four times the size of the pool, with a single IO worker. Once the pool is full every page
+// that gets evicted is dirty, so each eviction has to get its page written back by the worker that also serves the loads.
+bool test_evicted_dirty_pages() {
+	const String path = "user://cacheserv_test_write_back.bin";
+	const size_t pool_pages = CS_NUM_FRAMES_MIN;
+	// The last page is a partial one.
+	const size_t size = pool_pages * 4 * CS_PAGE_SIZE + 123;
+
+	CS_TEST_CHECK(cs_test_make_file(path, size, 0), "Could not create " + path);
+
+	{
+		Dictionary settings;
+		settings["cacheserv/io/workers_per_device"] = 1;
+		settings["cacheserv/cache/shards"] = 1;
+		CacheservTestManager mgr(pool_pages * CS_PAGE_SIZE, settings);
+
+		RID rid = mgr->open(path, FileAccess::READ_WRITE, _FileCacheManager::LRU);
+		CS_TEST_CHECK(rid.is_valid(), "Could not open " + path);
+
+		// An odd write size, so most writes cover the end of one page and the start of the next.
+		uint8_t buf[3001];
+		for (size_t pos = 0; pos < size;) {
+			size_t len = MIN(sizeof(buf), size - pos);
+			for (size_t i = 0; i < len; ++i) {
+				buf[i] = cs_test_byte(pos + i, 1);
+			}
+			CS_TEST_CHECK(mgr.write(rid, buf, len) == len, "Short write at " + itos(pos));
+			pos += len;
+		}
+
+		mgr->permanent_close(rid);
+	}
+
+	int64_t bad = cs_test_verify_file(path, size, 1);
+	DirAccess::remove_file_or_error(path);
+	CS_TEST_CHECK(bad < 0, "The write to byte " + itos(bad) + " didn't reach the disk.");
+
+	return true;
+}
+
+} // namespace TestWriteBack
@@ -0,0 +1,195 @@
+/*************************************************************************/
+/*  tiny_lfu.h                                                           */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                           GODOT ENGINE                                */
+/*                      https://godotengine.org                          */
+/*************************************************************************/
+/* Copyright (c) 2007-2019 Juan Linietsky, Ariel Manzur.                 */
+/* Copyright (c) 2014-2019 Godot Engine contributors (cf. AUTHORS.md)    */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef TINY_LFU_H
+#define TINY_LFU_H
+
+#include "core/error_macros.h"
+#include "core/os/memory.h"
+#include "core/typedefs.h"
+
+#include "cacheserv_defines.h"
+
+#include <string.h>
+
+// A TinyLFU frequency estimator, used to decide whether a page is worth caching at all.
+//
+// Frequencies live in a count-min sketch of 4 bit counters, 16 to a word, one row per hash.
+// A doorkeeper bloom filter sits in front of the sketch, so a page seen only once never reaches it.
+// After a sample of (10 * capacity) accesses every counter is halved and the doorkeeper is cleared,
+// which lets the estimate follow a changing working set.
+class TinyLFU {
+
+	enum {
+		DEPTH = 4,
+		COUNTERS_PER_WORD = 16,
+		COUNTER_MAX = 15,
+	};
+
+	uint64_t *table;
+	uint64_t *doorkeeper;
+	uint32_t row_mask; // counters per row - 1.
+	uint32_t row_words;
+	uint32_t door_mask; // doorkeeper bits - 1.
+	uint32_t additions;
+	uint32_t sample_size;
+
+	static _FORCE_INLINE_ uint64_t hash(page_id page, uint32_t seed) {
+		uint64_t h = page + 0x9E3779B97F4A7C15ULL * (seed + 1);
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	_FORCE_INLINE_ uint32_t counter_get(uint32_t row, uint32_t idx) const {
+		uint64_t word = table[row * row_words + idx / COUNTERS_PER_WORD];
+		return (word >> ((idx % COUNTERS_PER_WORD) * 4)) & 0xF;
+	}
+
+	_FORCE_INLINE_ void counter_increment(uint32_t row, uint32_t idx) {
+		table[row * row_words + idx / COUNTERS_PER_WORD] += (uint64_t)1 << ((idx % COUNTERS_PER_WORD) * 4);
+	}
+
+	// Returns true if the page was already in the doorkeeper.
+	bool doorkeeper_put(page_id page) {
+		uint64_t h = hash(page, DEPTH);
+		uint32_t a = (uint32_t)h & door_mask;
+		uint32_t b = (uint32_t)(h >> 32) & door_mask;
+		bool present = (doorkeeper[a / 64] >> (a % 64) & 1) && (doorkeeper[b / 64] >> (b % 64) & 1);
+		doorkeeper[a / 64] |= (uint64_t)1 << (a % 64);
+		doorkeeper[b / 64] |= (uint64_t)1 << (b % 64);
+		return present;
+	}
+
+	bool doorkeeper_has(page_id page) const {
+		uint64_t h = hash(page, DEPTH);
+		uint32_t a = (uint32_t)h & door_mask;
+		uint32_t b = (uint32_t)(h >> 32) & door_mask;
+		return (doorkeeper[a / 64] >> (a % 64) & 1) && (doorkeeper[b / 64] >> (b % 64) & 1);
+	}
+
+	void age() {
+		// Halve every counter at once, the mask drops the bit shifted in from the neighbouring counter.
+		for (uint32_t i = 0; i < DEPTH * row_words; ++i) {
+			table[i] = (table[i] >> 1) & 0x7777777777777777ULL;
+		}
+		memset(doorkeeper, 0, ((door_mask + 1) / 64) * sizeof(uint64_t));
+		additions /= 2;
+	}
+
+public:
+	void init(uint32_t capacity) {
+		release();
+
+		uint32_t counters = MAX(next_power_of_2(capacity), (uint32_t)COUNTERS_PER_WORD);
+		row_mask = counters - 1;
+		row_words = counters / COUNTERS_PER_WORD;
+		table = memnew_arr(uint64_t, DEPTH * row_words);
+		memset(table, 0, DEPTH * row_words * sizeof(uint64_t));
+
+		// Around 8 bits per cached page keeps the doorkeeper's false positive rate low with 2 hashes.
+		uint32_t door_bits = MAX(next_power_of_2(capacity * 8), 64u);
+		door_mask = door_bits - 1;
+		doorkeeper = memnew_arr(uint64_t, door_bits / 64);
+		memset(doorkeeper, 0, (door_bits / 64) * sizeof(uint64_t));
+
+		additions = 0;
+		sample_size = 10 * capacity;
+	}
+
+	void release() {
+		if (table) memdelete_arr(table);
+		if (doorkeeper) memdelete_arr(doorkeeper);
+		table = NULL;
+		doorkeeper = NULL;
+		row_mask = 0;
+		row_words = 0;
+		door_mask = 0;
+		additions = 0;
+		sample_size = 0;
+	}
+
+	// Counts one access to the page.
+	void record(page_id page) {
+		ERR_FAIL_COND(!table);
+
+		if (doorkeeper_put(page)) {
+			// Conservative update, only the counters that hold the current minimum are raised.
+			uint32_t idx[DEPTH];
+			uint32_t min = COUNTER_MAX;
+			for (uint32_t i = 0; i < DEPTH; ++i) {
+				idx[i] = (uint32_t)hash(page, i) & row_mask;
+				min = MIN(min, counter_get(i, idx[i]));
+			}
+
+			if (min < COUNTER_MAX) {
+				for (uint32_t i = 0; i < DEPTH; ++i) {
+					if (counter_get(i, idx[i]) == min) counter_increment(i, idx[i]);
+				}
+			}
+		}
+
+		if (++additions >= sample_size) age();
+	}
+
+	// Returns the estimated number of recent accesses to the page.
+	uint32_t estimate(page_id page) const {
+		if (!table) return 0;
+
+		uint32_t min = COUNTER_MAX;
+		for (uint32_t i = 0; i < DEPTH; ++i) {
+			min = MIN(min, counter_get(i, (uint32_t)hash(page, i) & row_mask));
+		}
+		return min + (doorkeeper_has(page) ? 1 : 0);
+	}
+
+	// Returns true if caching the candidate is worth evicting the victim.
+	_FORCE_INLINE_ bool admit(page_id candidate, page_id victim) const {
+		return estimate(candidate) > estimate(victim);
+	}
+
+	TinyLFU() :
+			table(NULL),
+			doorkeeper(NULL),
+			row_mask(0),
+			row_words(0),
+			door_mask(0),
+			additions(0),
+			sample_size(0) {}
+
+	~TinyLFU() {
+		release();
+	}
+};
+
+#endif // TINY_LFU_H